@@ -0,0 +1,84 @@
+//===- AOTCompiler.h - Ahead-of-time compilation to object files ----------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Collects the definitions of a session into a single module and emits it as
+// an object file for the host architecture. Hot functions are cloned for
+// several instruction set levels, and calls to them go through a dispatcher
+// that picks the best clone the machine supports when the object is loaded.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_AOTCOMPILER_H
+#define KALEIDOSCOPE_AOTCOMPILER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/TargetParser/Triple.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+/// ISALevel - An instruction set level functions are cloned for, as the CPU
+/// the clone is tuned for and the features its code may use. Levels are
+/// described by features rather than by a CPU, whose other extensions
+/// kal_isa_level would have to check as well.
+struct ISALevel {
+  const char *Name;
+  const char *CPU;
+  const char *TuneCPU;
+  const char *Features;
+};
+
+/// AOTOptions - Configuration of ahead-of-time compilation.
+struct AOTOptions {
+  /// Baseline CPU of the object, the generic CPU of the host architecture
+  /// if empty.
+  std::string CPU;
+
+  /// Clone functions containing loops for the instruction set levels of the
+  /// architecture, along with the functions named in Multiversion.
+  bool MultiversionLoops = true;
+  std::vector<std::string> Multiversion;
+
+  llvm::TargetOptions TargetOpts;
+};
+
+class AOTCompiler {
+public:
+  explicit AOTCompiler(AOTOptions Opts);
+
+  /// Add the definitions of M but Skip, M may live in another context. A
+  /// definition replaces an earlier one of the same name.
+  void addModule(const llvm::Module &M, llvm::StringRef Skip = "");
+
+  /// Multiversion, optimise and write the collected definitions as an object
+  /// file at Path. Returns false on error.
+  bool emit(llvm::StringRef Path);
+
+  /// Get the instruction set levels above the baseline that functions are
+  /// cloned for on T. kal_isa_level returns the index of the highest one the
+  /// host supports, plus one.
+  static llvm::ArrayRef<ISALevel> getISALevels(const llvm::Triple &T);
+
+private:
+  /// Returns true if F should be cloned for every instruction set level.
+  bool shouldMultiversion(const llvm::Function &F) const;
+
+  /// Clone Functions for each of Levels, and make calls to them go through a
+  /// dispatcher picking the clone of the highest level the host supports.
+  void multiversion(llvm::ArrayRef<llvm::Function *> Functions,
+                    llvm::ArrayRef<ISALevel> Levels,
+                    const llvm::Triple &T);
+
+  AOTOptions Opts;
+  llvm::LLVMContext Context;
+  std::unique_ptr<llvm::Module> Module;
+};
+
+#endif // KALEIDOSCOPE_AOTCOMPILER_H
@@ -11,18 +11,155 @@
 #ifndef KALEIDOSCOPE_ASTEXPR_H
 #define KALEIDOSCOPE_ASTEXPR_H
 
+#include "FastMath.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Constant.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Verifier.h"
+#include <cassert>
+#include <cmath>
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
+class BinaryExprAST;
 class CodeGen;
+class StructuralKey;
+
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+class MLIRGen;
+namespace mlir {
+class Value;
+} // namespace mlir
+#endif
+
+/// ValueType - Static types of values. Everything is a double unless
+/// annotated otherwise, with types inferred locally from there.
+enum class ValueType { Double, Float, Int, Bool };
+
+/// ExprCost - Estimated cost of evaluating an expression, in instructions,
+/// and whether it can be evaluated even when its value isn't needed, that is
+/// without side effects or loops.
+struct ExprCost {
+  unsigned Cost = 0;
+  bool Speculatable = true;
+};
 
 /// ExprAST - Base class for all expression nodes.
 class ExprAST {
 public:
   virtual ~ExprAST() = default;
   virtual llvm::Value *codegen(CodeGen &CG) = 0;
+
+  /// Returns the name of the variable if this expression can be assigned to.
+  virtual const std::string *getAssignableName() const { return nullptr; }
+
+  /// Mark this expression as the last thing evaluated before its function
+  /// returns. Propagates through the expressions whose value is their result.
+  virtual void markTailPosition() {}
+
+  /// Returns true if this expression is a literal with an integral value.
+  virtual bool isIntegerLiteral() const { return false; }
+
+  /// Returns the value of this expression if it is a literal.
+  virtual std::optional<double> getLiteralValue() const {
+    return std::nullopt;
+  }
+
+  /// Returns this expression if it applies a binary operator other than '=',
+  /// so that long chains of operators can be walked without recursion.
+  virtual const BinaryExprAST *getBinaryOperator() const { return nullptr; }
+
+  /// Returns Bound if this expression is the loop condition Var < Bound.
+  virtual const ExprAST *getUpperBoundOf(const std::string &Var) const {
+    return nullptr;
+  }
+
+  /// Returns Value if this expression is the assignment Var = Value.
+  virtual const ExprAST *getAssignedValueOf(const std::string &Var) const {
+    return nullptr;
+  }
+
+  /// Returns true if this expression is integral whenever its operands and
+  /// Var are, that is if it is an integer literal, Var or one of + - *.
+  virtual bool keepsIntegral(const std::string &Var) const { return false; }
+
+  /// Append the child expressions of this node to Children, so that trees
+  /// can be walked without recursion. Absent children are appended as null.
+  virtual void getChildren(std::vector<const ExprAST *> &Children) const {}
+
+  /// Add the cost of evaluating this expression to Cost. Expressions the
+  /// model doesn't cover are not speculatable. The estimate may stop as soon
+  /// as Cost exceeds Limit, which also bounds its recursion.
+  virtual void estimateCost(CodeGen &CG, unsigned Limit,
+                            ExprCost &Cost) const {
+    Cost.Speculatable = false;
+  }
+
+  /// Append the structure of this expression to Key. Expressions the key
+  /// doesn't cover make it invalid.
+  virtual void profile(StructuralKey &Key) const;
+
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  /// Emit this expression as MLIR, in MLIRGen.cpp. Returns null if it uses
+  /// what the MLIR path doesn't cover.
+  virtual mlir::Value mlirgen(MLIRGen &Gen) const;
+#endif
+
+protected:
+  /// Move the child expressions of this node into Children.
+  virtual void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) {}
+
+  /// Destroy the children of this node from an explicit worklist instead of
+  /// recursively, so that very deep trees can't overflow the stack. Called
+  /// from the destructor of every node with children.
+  void releaseChildren();
+};
+
+/// StructuralKey - Canonical encoding of a function, to find the ones that
+/// are structurally identical. Variables are encoded by where they are bound
+/// rather than by name, and calls of the function itself as such, so that
+/// functions only differing in these names get the same key. Trees nested
+/// deeper than MaxDepth get no key, which also bounds the recursion.
+class StructuralKey {
+  std::string Key;
+  std::string Self;
+  std::vector<std::string> Scope; // Variables in scope, innermost last.
+  unsigned Depth = 0;
+  bool Valid = true;
+
+public:
+  static constexpr unsigned MaxDepth = 1024;
+
+  explicit StructuralKey(const std::string &Self) : Self(Self) {}
+
+  /// Append a child expression.
+  void add(const ExprAST &E);
+
+  /// Append a node kind or an operator.
+  void addTag(char Tag) { Key += Tag; }
+
+  void addNumber(double Val);
+  void addType(std::optional<ValueType> Type);
+  void addVariable(const std::string &Name);
+  void addCallee(const std::string &Name);
+
+  /// Bring a variable into scope, or drop the innermost N.
+  void bind(const std::string &Name) { Scope.push_back(Name); }
+  void unbind(size_t N = 1) { Scope.resize(Scope.size() - N); }
+
+  void invalidate() { Valid = false; }
+
+  /// Get the key, if the function has one.
+  std::optional<std::string> take() {
+    if (!Valid)
+      return std::nullopt;
+    return std::move(Key);
+  }
+
+private:
+  void addName(const std::string &Name);
 };
 
 /// NumberExprAST - Expression class for numeric literals.
@@ -32,6 +169,19 @@ class NumberExprAST : public ExprAST {
 public:
   NumberExprAST(double Val) : Val(Val) {}
   llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  bool isIntegerLiteral() const override {
+    return Val == std::trunc(Val) && std::fabs(Val) < 0x1p53;
+  }
+  std::optional<double> getLiteralValue() const override { return Val; }
+  bool keepsIntegral(const std::string &Var) const override {
+    return isIntegerLiteral();
+  }
+  void estimateCost(CodeGen &CG, unsigned Limit,
+                    ExprCost &Cost) const override {}
 };
 
 /// VariableExprAST - Expression class for referencing a variable.
@@ -41,6 +191,16 @@ class VariableExprAST : public ExprAST {
 public:
   VariableExprAST(const std::string &Name) : Name(Name) {}
   llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  const std::string *getAssignableName() const override { return &Name; }
+  bool keepsIntegral(const std::string &Var) const override {
+    return Name == Var;
+  }
+  void estimateCost(CodeGen &CG, unsigned Limit,
+                    ExprCost &Cost) const override {}
 };
 
 /// IfExprAST - This class represents an expression for if/then/else.
@@ -51,8 +211,29 @@ public:
   IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
             std::unique_ptr<ExprAST> Else)
       : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+  ~IfExprAST() override { releaseChildren(); }
 
   llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  void markTailPosition() override {
+    Then->markTailPosition();
+    Else->markTailPosition();
+  }
+  void estimateCost(CodeGen &CG, unsigned Limit,
+                    ExprCost &Cost) const override;
+  void getChildren(std::vector<const ExprAST *> &Children) const override {
+    Children.insert(Children.end(), {Cond.get(), Then.get(), Else.get()});
+  }
+
+protected:
+  void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) override {
+    Children.push_back(std::move(Cond));
+    Children.push_back(std::move(Then));
+    Children.push_back(std::move(Else));
+  }
 };
 
 /// ForExprAST - Expression class for for/in.
@@ -66,8 +247,155 @@ public:
              std::unique_ptr<ExprAST> Body)
       : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
         Step(std::move(Step)), Body(std::move(Body)) {}
+  ~ForExprAST() override { releaseChildren(); }
+
+  llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  void getChildren(std::vector<const ExprAST *> &Children) const override {
+    Children.insert(Children.end(),
+                    {Start.get(), End.get(), Step.get(), Body.get()});
+  }
+
+protected:
+  void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) override {
+    Children.push_back(std::move(Start));
+    Children.push_back(std::move(End));
+    Children.push_back(std::move(Step));
+    Children.push_back(std::move(Body));
+  }
+};
+
+/// ReduceExprAST - Expression class for reductions over a for-style range,
+/// such as 'sum for i = 0, i < n in f(i)'. Unlike for, the condition is
+/// checked before every iteration, so an empty range reduces to the
+/// identity of the reduction.
+class ReduceExprAST : public ExprAST {
+public:
+  /// Numbered like KalReduceKind of the task runtime.
+  enum ReduceKind { Sum, Prod, Min, Max };
+
+  /// Get the reduction a name before 'for' stands for, if any.
+  static std::optional<ReduceKind> getKind(const std::string &Name);
+
+private:
+  ReduceKind Kind;
+  std::string VarName;
+  std::unique_ptr<ExprAST> Start, End, Step, Body;
+
+public:
+  ReduceExprAST(ReduceKind Kind, const std::string &VarName,
+                std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
+                std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body)
+      : Kind(Kind), VarName(VarName), Start(std::move(Start)),
+        End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
+  ~ReduceExprAST() override { releaseChildren(); }
+
+  llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+  void getChildren(std::vector<const ExprAST *> &Children) const override {
+    Children.insert(Children.end(),
+                    {Start.get(), End.get(), Step.get(), Body.get()});
+  }
+
+protected:
+  void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) override {
+    Children.push_back(std::move(Start));
+    Children.push_back(std::move(End));
+    Children.push_back(std::move(Step));
+    Children.push_back(std::move(Body));
+  }
+
+private:
+  /// Emit the loop from StartV, the value of the variable of type VarTy,
+  /// and return the reduced value. Runs while the variable is below Limit
+  /// if given, or else while the condition holds. Sets AssignsVar, if
+  /// given, to whether the body assigns the variable.
+  llvm::Value *emitLoop(CodeGen &CG, llvm::Value *StartV, llvm::Type *VarTy,
+                        llvm::Value *Limit, bool *AssignsVar = nullptr);
 
+  /// Emit the loop as a function over a chunk of the range, which the task
+  /// runtime calls on chunks of at least ParallelReduceMin iterations.
+  /// Returns false without emitting anything if the reduction isn't a
+  /// counted one, or its body assigns the variables it captures or the
+  /// variable itself, or calls anything with side effects.
+  bool emitParallel(CodeGen &CG, llvm::Value *StartV, llvm::Value *&Result);
+
+  /// Get Bound if the condition is Var < Bound.
+  ExprAST *getBound() {
+    return const_cast<ExprAST *>(End->getUpperBoundOf(VarName));
+  }
+
+  /// Combine the reduced value Acc with V.
+  llvm::Value *combine(CodeGen &CG, llvm::Value *Acc, llvm::Value *V);
+};
+
+/// VarBinding - A variable introduced by var/in, with its optional type
+/// annotation and initializer.
+struct VarBinding {
+  std::string Name;
+  std::optional<ValueType> Type;
+  std::unique_ptr<ExprAST> Init;
+};
+
+/// VarExprAST - Expression class for var/in.
+class VarExprAST : public ExprAST {
+  std::vector<VarBinding> VarNames;
+  std::unique_ptr<ExprAST> Body;
+
+public:
+  VarExprAST(std::vector<VarBinding> VarNames, std::unique_ptr<ExprAST> Body)
+      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+  ~VarExprAST() override { releaseChildren(); }
+
+  llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  void markTailPosition() override { Body->markTailPosition(); }
+  void estimateCost(CodeGen &CG, unsigned Limit,
+                    ExprCost &Cost) const override;
+  void getChildren(std::vector<const ExprAST *> &Children) const override {
+    for (const VarBinding &Binding : VarNames)
+      Children.push_back(Binding.Init.get());
+    Children.push_back(Body.get());
+  }
+
+protected:
+  void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) override {
+    for (VarBinding &Binding : VarNames)
+      Children.push_back(std::move(Binding.Init));
+    Children.push_back(std::move(Body));
+  }
+};
+
+/// UnaryExprAST - Expression class for a unary operator.
+class UnaryExprAST : public ExprAST {
+  char Opcode;
+  std::unique_ptr<ExprAST> Operand;
+
+public:
+  UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
+      : Opcode(Opcode), Operand(std::move(Operand)) {}
+  ~UnaryExprAST() override { releaseChildren(); }
   llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  void estimateCost(CodeGen &CG, unsigned Limit,
+                    ExprCost &Cost) const override;
+  void getChildren(std::vector<const ExprAST *> &Children) const override {
+    Children.push_back(Operand.get());
+  }
+
+protected:
+  void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) override {
+    Children.push_back(std::move(Operand));
+  }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -79,33 +407,181 @@ public:
   BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
                 std::unique_ptr<ExprAST> RHS)
       : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  ~BinaryExprAST() override { releaseChildren(); }
   llvm::Value *codegen(CodeGen &CG) override;
+  const BinaryExprAST *getBinaryOperator() const override {
+    return Op == '=' ? nullptr : this;
+  }
+  const ExprAST *getUpperBoundOf(const std::string &Var) const override {
+    const std::string *Name = LHS->getAssignableName();
+    return Op == '<' && Name && *Name == Var ? RHS.get() : nullptr;
+  }
+  const ExprAST *getAssignedValueOf(const std::string &Var) const override {
+    const std::string *Name = LHS->getAssignableName();
+    return Op == '=' && Name && *Name == Var ? RHS.get() : nullptr;
+  }
+  bool keepsIntegral(const std::string &Var) const override {
+    return Op == '+' || Op == '-' || Op == '*';
+  }
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  void estimateCost(CodeGen &CG, unsigned Limit,
+                    ExprCost &Cost) const override;
+  void getChildren(std::vector<const ExprAST *> &Children) const override {
+    Children.insert(Children.end(), {LHS.get(), RHS.get()});
+  }
+
+protected:
+  void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) override {
+    Children.push_back(std::move(LHS));
+    Children.push_back(std::move(RHS));
+  }
+
+private:
+  /// Get the operators down the left operands of this one, this one first,
+  /// which chains like a + b + c + ... nest as deep as they are long.
+  std::vector<const BinaryExprAST *> getLeftSpine() const {
+    std::vector<const BinaryExprAST *> Spine = {this};
+    while (const BinaryExprAST *Left = Spine.back()->LHS->getBinaryOperator())
+      Spine.push_back(Left);
+    return Spine;
+  }
+
+  /// Apply the operator to the emitted operands L and R.
+  llvm::Value *emitOperator(CodeGen &CG, llvm::Value *L, llvm::Value *R) const;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value emitOperator(MLIRGen &Gen, mlir::Value L, mlir::Value R) const;
+#endif
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
   std::string Callee;
   std::vector<std::unique_ptr<ExprAST>> Args;
+  bool IsTailCall = false;
 
 public:
   CallExprAST(const std::string &Callee,
               std::vector<std::unique_ptr<ExprAST>> Args)
       : Callee(Callee), Args(std::move(Args)) {}
+  ~CallExprAST() override { releaseChildren(); }
   llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  void markTailPosition() override { IsTailCall = true; }
+  void estimateCost(CodeGen &CG, unsigned Limit,
+                    ExprCost &Cost) const override;
+  void getChildren(std::vector<const ExprAST *> &Children) const override {
+    for (const auto &Arg : Args)
+      Children.push_back(Arg.get());
+  }
+
+protected:
+  void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) override {
+    for (auto &Arg : Args)
+      Children.push_back(std::move(Arg));
+  }
+};
+
+/// SpawnExprAST - Expression class for spawn, which evaluates the arguments
+/// of a call and starts the call itself as a task on the task pool. Its value
+/// is the future of the result, an int handle only await can use.
+class SpawnExprAST : public ExprAST {
+  std::string Callee;
+  std::vector<std::unique_ptr<ExprAST>> Args;
+
+public:
+  SpawnExprAST(const std::string &Callee,
+               std::vector<std::unique_ptr<ExprAST>> Args)
+      : Callee(Callee), Args(std::move(Args)) {}
+  ~SpawnExprAST() override { releaseChildren(); }
+  llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  void getChildren(std::vector<const ExprAST *> &Children) const override {
+    for (const auto &Arg : Args)
+      Children.push_back(Arg.get());
+  }
+
+protected:
+  void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) override {
+    for (auto &Arg : Args)
+      Children.push_back(std::move(Arg));
+  }
+};
+
+/// AwaitExprAST - Expression class for await, which waits for the task
+/// behind a future and evaluates to its result as a double.
+class AwaitExprAST : public ExprAST {
+  std::unique_ptr<ExprAST> Future;
+
+public:
+  AwaitExprAST(std::unique_ptr<ExprAST> Future) : Future(std::move(Future)) {}
+  ~AwaitExprAST() override { releaseChildren(); }
+  llvm::Value *codegen(CodeGen &CG) override;
+  void profile(StructuralKey &Key) const override;
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  mlir::Value mlirgen(MLIRGen &Gen) const override;
+#endif
+  void getChildren(std::vector<const ExprAST *> &Children) const override {
+    Children.push_back(Future.get());
+  }
+
+protected:
+  void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Children) override {
+    Children.push_back(std::move(Future));
+  }
 };
 
 /// ProtoTypeAST - This class represents the "prototype" for a function,
-/// which captures its name and its argument names.
+/// which captures its name and its argument names (thus implicitly the number
+/// of arguments the function takes) and types, as well as if it is an
+/// operator.
 class ProtoTypeAST {
   std::string Name;
   std::vector<std::string> Args;
+  std::vector<ValueType> ArgTypes;
+  ValueType RetType;
+  bool IsOperator;
+  unsigned Precedence; // Precedence if a binary op.
 
 public:
-  ProtoTypeAST(const std::string &Name, std::vector<std::string> Args)
-      : Name(Name), Args(std::move(Args)) {}
+  ProtoTypeAST(const std::string &Name, std::vector<std::string> Args,
+               bool IsOperator = false, unsigned Precedence = 0,
+               std::vector<ValueType> ArgTypes = {},
+               ValueType RetType = ValueType::Double)
+      : Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)),
+        RetType(RetType), IsOperator(IsOperator), Precedence(Precedence) {
+    // Unannotated arguments are doubles.
+    this->ArgTypes.resize(this->Args.size(), ValueType::Double);
+  }
 
   /// Get the prototype name.
   const std::string &getName() const;
+
+  const std::vector<std::string> &getArgs() const { return Args; }
+  const std::vector<ValueType> &getArgTypes() const { return ArgTypes; }
+  ValueType getRetType() const { return RetType; }
+  bool isOperator() const { return IsOperator; }
+  bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
+  bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
+
+  /// Get the operator character of a unary or binary operator.
+  char getOperatorName() const {
+    assert(isUnaryOp() || isBinaryOp());
+    return Name[Name.size() - 1];
+  }
+
+  unsigned getBinaryPrecedence() const { return Precedence; }
+
+  /// Returns true if Other can be called the same way as this prototype.
+  bool hasSameSignature(const ProtoTypeAST &Other) const;
   llvm::Function *codegen(CodeGen &CG);
 };
 
@@ -113,12 +589,48 @@ public:
 class FunctionAST {
   std::unique_ptr<ProtoTypeAST> Proto;
   std::unique_ptr<ExprAST> Body;
+  std::optional<FastMathPolicy> FastMath; // Overrides the session policy.
+  unsigned Line;                           // Line of the source it starts on.
 
 public:
   FunctionAST(std::unique_ptr<ProtoTypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+              std::unique_ptr<ExprAST> Body,
+              std::optional<FastMathPolicy> FastMath = std::nullopt,
+              unsigned Line = 0)
+      : Proto(std::move(Proto)), Body(std::move(Body)), FastMath(FastMath),
+        Line(Line) {}
+
+  /// Get the prototype of the function.
+  const ProtoTypeAST &getProto() const;
+  const ExprAST &getBody() const { return *Body; }
+  const std::optional<FastMathPolicy> &getFastMath() const { return FastMath; }
+  unsigned getLine() const { return Line; }
   llvm::Function *codegen(CodeGen &CG);
+
+  /// Get the structural key of the function, which does not depend on its
+  /// name or the names of its variables. None if the body is too deep.
+  std::optional<std::string> getStructuralKey() const;
+
+  /// Emit the body into the current module as an available_externally
+  /// definition, so that callers can inline it while the symbol itself keeps
+  /// resolving to the copy that was already handed to the JIT.
+  llvm::Function *codegenImport(CodeGen &CG);
+
+  /// Emit a clone of the function named Name into the current module, with
+  /// the arguments that Bound has a constant for fixed to it. The clone only
+  /// takes the remaining arguments.
+  llvm::Function *codegenSpecialization(CodeGen &CG, const std::string &Name,
+                                        llvm::ArrayRef<llvm::Constant *> Bound);
+
+private:
+  /// Emit the body into the given function and optimise it. Arguments that
+  /// Bound has a constant for are not parameters of the function.
+  bool emitBody(CodeGen &CG, llvm::Function *Function,
+                llvm::ArrayRef<llvm::Constant *> Bound = {});
+
+  /// Verify and optimise the emitted Function, guaranteeing the tail calls
+  /// feeding its returns, and report them if asked.
+  void optimiseBody(CodeGen &CG, llvm::Function *Function);
 };
 
 #endif // KALEIDOSCOPE_ASTEXPR_H
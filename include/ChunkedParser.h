@@ -0,0 +1,48 @@
+//===- ChunkedParser.h - Parallel parsing of large sources ----------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Splits a source into chunks at top-level item boundaries and parses the
+// chunks in parallel, merging their items back in source order.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_CHUNKEDPARSER_H
+#define KALEIDOSCOPE_CHUNKEDPARSER_H
+
+#include "Parser.h"
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// SourceChunk - A run of whole top-level items of the source.
+struct SourceChunk {
+  std::string_view Text;
+
+  /// Binary operators defined in the chunk, with their precedence. Chunks
+  /// after it are parsed with them installed.
+  std::vector<std::pair<char, unsigned>> BinaryOps;
+};
+
+class ChunkedParser {
+public:
+  /// Chunks are never split smaller than this many bytes.
+  static constexpr size_t MinChunkSize = 64 * 1024;
+
+  /// Split Source into at most NumChunks chunks of similar size. Chunks only
+  /// start at a 'def' or 'extern' outside of comments and parentheses, so no
+  /// item spans two chunks.
+  static std::vector<SourceChunk> split(std::string_view Source,
+                                        unsigned NumChunks);
+
+  /// Parse Source as NumChunks chunks in parallel and return its items in
+  /// source order. Errors are reported in source order once all chunks are
+  /// parsed.
+  static std::vector<TopLevelItem> parse(std::string_view Source,
+                                         unsigned NumChunks,
+                                         ParserOptions Opts = ParserOptions());
+};
+
+#endif // KALEIDOSCOPE_CHUNKEDPARSER_H
@@ -11,11 +11,14 @@
 #ifndef KALEIDOSCOPE_CODEGEN_H
 #define KALEIDOSCOPE_CODEGEN_H
 
+#include "AOTCompiler.h"
 #include "ASTExpr.h"
+#include "FastMath.h"
 #include "KaleidoscopeJIT.h"
 #include "llvm/Analysis/CGSCCPassManager.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassInstrumentation.h"
@@ -23,22 +26,233 @@
 #include "llvm/IR/Value.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/ElimAvailExtern.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/MergeFunctions.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SROA.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/Transforms/Vectorize/SLPVectorizer.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+
+/// CodeGenOptions - Session-wide knobs for code generation.
+struct CodeGenOptions {
+  /// Definitions with at most this many instructions after optimisation are
+  /// imported into later modules as available_externally bodies.
+  unsigned ImportInstrThreshold = 24;
+
+  /// Larger definitions are still imported once they have been called from
+  /// at least ImportHotCallThreshold call sites.
+  unsigned ImportHotInstrThreshold = 128;
+  unsigned ImportHotCallThreshold = 4;
+
+  /// Call definitions through indirect stubs so that they can be redefined
+  /// while the session is live. Imports other than operators are disabled in
+  /// this mode, since an inlined copy could not be replaced.
+  bool HotSwap = false;
+
+  /// Report the tail calls found and eliminated in every definition.
+  bool ReportTailCalls = false;
+
+  /// If/then/else whose arms are free of side effects and cost at most this
+  /// many instructions together is lowered to a select of both arms instead
+  /// of a branch.
+  unsigned SelectCostThreshold = 6;
+
+  /// Report how every if/then/else was lowered.
+  bool ReportSelects = false;
+
+  /// Instructions the clones of retained definitions specialized on the
+  /// constant arguments of their call sites may add up to, 0 disables
+  /// specialization.
+  unsigned SpecializationBudget = 2048;
+
+  /// Report every specialization made.
+  bool ReportSpecializations = false;
+
+  /// Fast-math policy of functions that don't declare their own.
+  FastMathPolicy FastMath;
+
+  /// CPU the JIT generates code for, "host" to detect the CPU and features
+  /// of the host or "generic" for the baseline of its architecture, and
+  /// features toggled on top, such as "+avx2" or "-sve".
+  std::string JITCPU = "host";
+  std::vector<std::string> JITFeatures;
+
+  /// Optimisation pipeline: 0 only inlines operators, 1 adds the function
+  /// pipeline and 2 adds cross-module inlining and vectorization.
+  unsigned OptLevel = 2;
+
+  /// Print the IR of every item compiled and log the passes run on it.
+  bool PrintIR = true;
+
+  /// Import the runtime from bitcode so that its helpers can be inlined. The
+  /// bitcode built along with the library is used unless a path is given.
+  bool InlineRuntime = true;
+  std::string RuntimeBitcode;
+
+  /// Bytes of JIT'd code definitions may keep resident, 0 for no limit.
+  /// Definitions are called through stubs in this mode, so that the least
+  /// recently used ones can be evicted and compiled again from their bitcode
+  /// when they are next called. Only code counts against the budget: the
+  /// bitcode and bookkeeping kept for every definition can't be evicted, and
+  /// are shown by ReportResidency instead.
+  uint64_t MemoryBudget = 0;
+
+  /// Report the code kept resident whenever definitions are evicted.
+  bool ReportResidency = false;
+
+  /// Compile definitions on their first call rather than when they are
+  /// defined. Until then their stubs point at a trampoline compiling them.
+  bool LazyCompile = false;
+
+  /// With LazyCompile, compile the likely callees of code as it is entered
+  /// on background threads, so that their first calls don't wait for the
+  /// compiler. Callees are predicted from the calls in the code and from the
+  /// order earlier first calls were made in.
+  bool Speculate = false;
+
+  /// How many calls deep speculation follows from code as it is entered: 1
+  /// compiles its likely callees, 2 theirs as well, and so on. Deeper
+  /// callees compile on their first call, which speculates from there.
+  unsigned SpeculationDepth = 2;
+
+  /// Report the first calls that waited for the compiler, and how many
+  /// speculative compiles were used or wasted.
+  bool ReportSpeculation = false;
+
+  /// Reuse the code of definitions and top-level expressions structurally
+  /// identical to earlier ones, and merge identical functions of a module.
+  bool Dedup = false;
+
+  /// Top-level expressions whose code is kept for reuse under Dedup, the
+  /// oldest are dropped first.
+  unsigned ExpressionCacheSize = 256;
+
+  /// Report how many definitions and expressions were duplicates.
+  bool ReportDedup = false;
+
+  /// Lower definitions with counted loops through MLIR's affine dialect,
+  /// fusing, interchanging and tiling their loop nests. Needs a build with
+  /// KALEIDOSCOPE_ENABLE_MLIR.
+  bool MLIR = false;
+
+  /// Initialise the JIT, its target machine and the first module on a
+  /// background thread while the first input is read and parsed, rather
+  /// than before.
+  bool BackgroundInit = false;
+
+  /// Split counted reductions into chunks of at least this many iterations,
+  /// reduced on the task threads. Zero keeps them on one thread.
+  unsigned ParallelReduceMin = 0;
+
+  /// Keep frame pointers in JIT'd code and attribute the samples of the
+  /// profiler to its functions and their source lines.
+  bool Profile = false;
+
+  /// Engine shared with the other sessions of a server, a private one is
+  /// created if null. With Prelude, definitions are compiled into the
+  /// engine's prelude, which every session can call, instead of a dylib of
+  /// their own.
+  std::shared_ptr<llvm::orc::KaleidoscopeJITEngine> Engine;
+  bool Prelude = false;
+
+  /// Held while JIT'd code runs, if the process-wide runtime is shared with
+  /// other sessions. Output is then written to the stream of the session.
+  std::mutex *RuntimeLock = nullptr;
+};
+
+/// FunctionVersion - The live version of a definition and the resource
+/// tracker owning its code.
+struct FunctionVersion {
+  unsigned Version = 0;
+  llvm::orc::ResourceTrackerSP RT;
+};
+
+/// CachedExpression - The code of a top-level expression kept for reuse.
+struct CachedExpression {
+  llvm::orc::ExecutorAddr Addr;
+  llvm::orc::ResourceTrackerSP RT;
+};
+
+/// FunctionResidency - What is kept of a definition that may be evicted.
+struct FunctionResidency {
+  /// Name the live version is compiled under.
+  std::string ImplName;
+
+  /// Bytes of machine code of the definition while it is resident.
+  uint64_t CodeSize = 0;
+
+  /// Optimised module of the definition, compiled again once an evicted
+  /// definition is called.
+  std::shared_ptr<const llvm::SmallVector<char, 0>> Bitcode;
+
+  std::atomic<bool> Resident = true;
+
+  /// Entry count seen by the last sweep, and the sweep it last changed in.
+  uint64_t LastEntries = 0;
+  uint64_t LastUsed = 0;
+};
+
+/// LazyFunction - A definition compiled on its first call, unless it is
+/// compiled speculatively before.
+struct LazyFunction {
+  enum CompileState { Pending, Speculating, Compiled };
+
+  /// Name the live version is compiled under, and its size in instructions.
+  std::string ImplName;
+  unsigned Instructions = 0;
+
+  CompileState State = Pending;
+
+  /// Whether it was compiled speculatively, and whether its first call
+  /// still had to wait for it.
+  bool Speculated = false;
+  bool Stalled = false;
+};
+
+/// FunctionProfile - The samples of the profiler attributed to a function:
+/// those it was running in itself, those it was on the stack of, and the
+/// hottest offsets into its code.
+struct FunctionProfile {
+  uint64_t Self = 0;
+  uint64_t Total = 0;
+  std::map<uint64_t, uint64_t> Offsets;
+};
 
 class CodeGen {
 public:
+  CodeGenOptions Opts;
+
   std::unique_ptr<llvm::LLVMContext> Context;
   std::unique_ptr<llvm::IRBuilder<>> Builder;
   std::unique_ptr<llvm::Module> Module;
-  std::map<std::string, llvm::Value *> NamedValues;
+  std::map<std::string, llvm::AllocaInst *> NamedValues;
 
   std::unique_ptr<llvm::orc::KaleidoscopeJIT> JIT;
+  std::unique_ptr<llvm::TargetMachine> TM;
 
   std::unique_ptr<llvm::FunctionPassManager> FPM;
+  std::unique_ptr<llvm::ModulePassManager> MPM;
   std::unique_ptr<llvm::LoopAnalysisManager> LAM;
   std::unique_ptr<llvm::FunctionAnalysisManager> FAM;
   std::unique_ptr<llvm::CGSCCAnalysisManager> CGAM;
@@ -46,46 +260,386 @@ public:
   std::unique_ptr<llvm::PassInstrumentationCallbacks> PIC;
   std::unique_ptr<llvm::StandardInstrumentations> SI;
 
-  std::map<std::string, std::unique_ptr<ProtoTypeAST>> FunctionProtos;
+  /// Tables indexed by function name are hashed, so that a session with
+  /// hundreds of thousands of definitions spends constant time on each.
+  llvm::StringMap<std::unique_ptr<ProtoTypeAST>> FunctionProtos;
+
+  /// Definitions retained for cross-module import, along with the size of
+  /// their optimised body and the number of call sites seen so far.
+  llvm::StringMap<std::unique_ptr<FunctionAST>> ImportableFunctions;
+  llvm::StringMap<unsigned> FunctionSizes;
+  llvm::StringMap<unsigned> CallSiteCounts;
+
+  /// Definitions handed over to the JIT so far.
+  llvm::StringMap<FunctionVersion> Definitions;
+
+  /// Definitions and specializations without side effects, whose calls a
+  /// reduction may run on several threads and in any order. Definitions
+  /// behind stubs are never in, as they may be replaced by any other.
+  llvm::StringSet<> PureFunctions;
+
+  /// Specializations made so far by callee and argument pattern, the ones
+  /// still to be split out of the current module, how many were ever made,
+  /// and their total size.
+  std::map<std::string, std::string> Specializations;
+  std::vector<std::string> PendingSpecializations;
+  unsigned NumSpecializations = 0;
+  uint64_t SpecializedInstructions = 0;
+
+  /// Code of replaced definitions, freed once no JIT'd code is running.
+  std::vector<llvm::orc::ResourceTrackerSP> RetiredTrackers;
+  std::atomic<unsigned> ActiveCalls = 0;
+
+  /// IR instructions handed over to the JIT so far.
+  uint64_t EmittedInstructions = 0;
+
+  /// Entry counts of the definitions that may be evicted under the memory
+  /// budget, and what is needed to bring them back. The trampolines of
+  /// evicted definitions update Residency from whichever thread calls them,
+  /// so it is guarded by ResidencyMutex.
+  std::map<std::string, std::atomic<uint64_t>> EntryCounts;
+  std::mutex ResidencyMutex;
+  std::map<std::string, FunctionResidency> Residency;
+  uint64_t ResidencyEpoch = 0;
+  uint64_t Evictions = 0;
+  std::atomic<uint64_t> Rematerializations = 0;
+
+  /// Definitions compiled on their first call, the callees called from the
+  /// code of each function, the functions first called after each one, and
+  /// the statistics of speculation. Trampolines and background compiles
+  /// update them from other threads, under SpeculationMutex.
+  std::mutex SpeculationMutex;
+  std::condition_variable SpeculationDone;
+  std::map<std::string, LazyFunction> LazyFunctions;
+  std::map<std::string, std::set<std::string>> CallGraph;
+  std::map<std::string, std::set<std::string>> ObservedNext;
+  std::string LastFirstCall;
+  unsigned SpeculationsInFlight = 0;
+  uint64_t FirstCallStalls = 0;
+
+  /// Definitions and top-level expressions compiled so far by structural
+  /// key, the order the expressions were cached in, and how many of each
+  /// were looked up and found.
+  llvm::StringMap<std::string> CompiledFunctions;
+  llvm::StringMap<CachedExpression> CompiledExpressions;
+  std::deque<std::string> ExpressionOrder;
+  unsigned KeyedDefinitions = 0, DuplicateDefinitions = 0;
+  unsigned KeyedExpressions = 0, DuplicateExpressions = 0;
+
+  /// Under Profile, the line every definition starts on, and the samples
+  /// drained so far, both by call stack, root first, in the folded format of
+  /// flame graphs and by function.
+  llvm::StringMap<unsigned> SourceLines;
+  std::vector<uint64_t> SampleBuffer;
+  std::map<std::string, uint64_t> SampledStacks;
+  std::map<std::string, FunctionProfile> FunctionProfiles;
+  uint64_t Samples = 0;
+
+  /// Collects the definitions for an object file, if one is emitted.
+  std::unique_ptr<AOTCompiler> AOT;
+
+  /// Background initialisation, see BackgroundInit, and when the session
+  /// started, its JIT became ready and its first result was printed.
+  std::future<void> Initialisation;
+  std::chrono::steady_clock::time_point StartTime =
+      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point JITReadyTime;
+  std::chrono::steady_clock::time_point FirstResultTime;
+
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  /// Lowers loop nests through MLIR, created on first use.
+  std::unique_ptr<MLIRGen> MLIRLowering;
+  MLIRGen &getMLIRGen();
+#endif
+
+  /// Bitcode of the runtime and the functions it defines.
+  std::unique_ptr<llvm::MemoryBuffer> RuntimeBitcode;
+  llvm::StringSet<> RuntimeFunctions;
 
   llvm::ExitOnError ExitOnError;
 
-  void InitialiseModuleAndPassManager() {
-    JIT = CodeGen::ExitOnError(llvm::orc::KaleidoscopeJIT::Create());
+  /// Background compiles refer to the compiler, so they must finish first.
+  ~CodeGen();
+
+  /// Get the LLVM type values of type Ty are represented with.
+  llvm::Type *getType(ValueType Ty);
+
+  /// Convert V to DestTy following the implicit conversions of the language.
+  llvm::Value *CreateCast(llvm::Value *V, llvm::Type *DestTy);
+
+  /// Get the type a builtin binary operator on L and R is carried out in.
+  /// Booleans take part as integers, a constant operand adopts the type of
+  /// the other operand if it fits, and otherwise the operands are widened
+  /// from int to float to double.
+  llvm::Type *getCommonType(llvm::Value *L, llvm::Value *R);
+
+  /// Create the JIT shared by every module of the session.
+  void InitialiseJIT() {
+    llvm::TargetOptions Options;
+    Opts.FastMath.applyTo(Options);
+    if (!Opts.Engine)
+      Opts.Engine =
+          CodeGen::ExitOnError(llvm::orc::KaleidoscopeJITEngine::Create(
+              Options, /*ConcurrentCompile*/ Opts.Speculate, Opts.JITCPU,
+              Opts.JITFeatures));
+    if (Opts.Prelude)
+      JIT = CodeGen::ExitOnError(
+          llvm::orc::KaleidoscopeJIT::CreatePrelude(Opts.Engine));
+    else
+      JIT = CodeGen::ExitOnError(
+          llvm::orc::KaleidoscopeJIT::Create(Opts.Engine));
+    TM = CodeGen::ExitOnError(JIT->createTargetMachine());
+    if (Opts.Profile)
+      Opts.Engine->recordFunctions();
+    RegisterRuntime();
+    JITReadyTime = std::chrono::steady_clock::now();
+  }
+
+  /// Initialise the JIT and the first module on a background thread, see
+  /// BackgroundInit.
+  void StartInitialisation() {
+    Initialisation = std::async(std::launch::async, [this] {
+      InitialiseJIT();
+      InitialiseModuleAndPassManager();
+    });
+  }
+
+  /// Wait for the background initialisation, if it is still running. Called
+  /// before anything is compiled.
+  void EnsureInitialised() {
+    if (Initialisation.valid())
+      Initialisation.get();
+  }
+
+  /// Print how long the JIT took to become ready and the first result to be
+  /// printed, from the start of the session, or that the JIT was never
+  /// initialised.
+  void ReportStartup();
+
+  /// Make the runtime's symbols resolve to the copy compiled into the host,
+  /// and load its bitcode for inlining.
+  void RegisterRuntime();
+
+  /// Import the bodies of the runtime functions the current module calls as
+  /// available_externally definitions, so that they can be inlined.
+  void ImportRuntime();
+
+  /// Returns true if definitions are called through stubs rather than
+  /// directly. Operators are always inlined, so they never need one.
+  bool usesStub(const ProtoTypeAST &Proto) const {
+    return (Opts.HotSwap || Opts.MemoryBudget || Opts.LazyCompile) &&
+           !Proto.isOperator();
+  }
+
+  /// Count the entries into the function being emitted, if it may be evicted
+  /// under the memory budget or compiled speculatively.
+  void EmitEntryCount(const std::string &Name);
+
+  /// Record a call to Callee from the function being emitted, as a callee
+  /// to speculate on once the function is entered.
+  void RecordCall(const std::string &Callee);
+
+  /// Forget the calls recorded from Caller, which is being replaced.
+  void ForgetCalls(const std::string &Caller);
+
+  /// Check whether the emitted F only calls intrinsics that don't access
+  /// memory, pure definitions and itself, so that it has no side effects
+  /// other than through its own stores.
+  bool callsOnlyPureFunctions(const llvm::Function &F) const;
+
+  /// Compile the stub definition Name, whose module defines ImplName with
+  /// Instructions instructions, on its first call. Returns the trampoline
+  /// for its stub to point at until then.
+  llvm::orc::ExecutorAddr DeferCompile(const std::string &Name,
+                                       const std::string &ImplName,
+                                       unsigned Instructions);
 
+  /// Start compiling the likely callees of Caller that are still pending on
+  /// the engine's compile threads, each pointing its stub at its code once
+  /// compiled, and theirs in turn up to Depth calls away from Caller.
+  void Speculate(const std::string &Caller, unsigned Depth);
+
+  /// Wait for the background compiles in flight.
+  void WaitForSpeculation();
+
+  /// Print the first calls that waited for the compiler and what became of
+  /// the speculative compiles.
+  void ReportSpeculation();
+
+  /// If an earlier definition has the structural key Key, define FnAST as
+  /// an alias of its code and return true.
+  bool ReuseDefinition(const std::string &Key,
+                       std::unique_ptr<FunctionAST> &FnAST);
+
+  /// Find the code of an earlier top-level expression with the structural
+  /// key Key.
+  std::optional<llvm::orc::ExecutorAddr>
+  findCachedExpression(const std::string &Key);
+
+  /// Keep the code of a top-level expression for reuse, dropping the oldest
+  /// one if the cache is full.
+  void CacheExpression(const std::string &Key, llvm::orc::ExecutorAddr Addr,
+                       llvm::orc::ResourceTrackerSP RT);
+
+  /// Print the share of definitions and expressions that were duplicates.
+  void ReportDedup();
+
+  /// Attribute the samples recorded since the last call, while the code
+  /// they were taken in is still loaded. Samples of a top-level expression
+  /// are attributed to the line Line it starts on.
+  void CollectSamples(unsigned Line);
+
+  /// Write the samples by call stack to Path, for flamegraph.pl, and print
+  /// the hottest functions.
+  void ReportProfile(const std::string &Path);
+
+  /// Start tracking the residency of the stub definition Name, which was just
+  /// compiled under ImplName into CodeSize bytes from Bitcode.
+  void TrackResidency(
+      const std::string &Name, const std::string &ImplName, uint64_t CodeSize,
+      std::shared_ptr<const llvm::SmallVector<char, 0>> Bitcode);
+
+  /// Evict the least recently used definitions until the resident code fits
+  /// the memory budget. Definitions entered since the previous sweep are
+  /// kept, so the budget may be exceeded until they cool down.
+  void EnforceMemoryBudget();
+
+  /// Replace the code of Name by a trampoline that compiles it again from its
+  /// bitcode when it is next called. Called with ResidencyMutex held.
+  void Evict(const std::string &Name, FunctionResidency &R);
+
+  /// Print the code kept resident and the evictions made so far.
+  void ReportResidency();
+
+  /// Returns true if the retained body of Name should be imported into the
+  /// current module.
+  bool shouldImport(const std::string &Name) {
+    auto It = ImportableFunctions.find(Name);
+    if (It == ImportableFunctions.end())
+      return false;
+
+    // Operators are always inlined.
+    if (It->second->getProto().isOperator())
+      return true;
+    if (Opts.HotSwap)
+      return false;
+
+    unsigned Size = FunctionSizes[Name];
+    if (Size <= Opts.ImportInstrThreshold)
+      return true;
+    return Size <= Opts.ImportHotInstrThreshold &&
+           CallSiteCounts[Name] >= Opts.ImportHotCallThreshold;
+  }
+
+  /// Get the specialization of the retained definition Name for the
+  /// constants among the arguments Args of a call site, creating it if the
+  /// budget allows. Args is left with the arguments the specialization still
+  /// takes. Returns null if the call can't be specialized.
+  llvm::Function *getSpecialization(const std::string &Name,
+                                    std::vector<llvm::Value *> &Args);
+
+  /// Move the specializations created in the current module into modules of
+  /// their own, so that they outlive it and every later module can call
+  /// them. Called once the module is optimised.
+  void SplitSpecializations();
+
+  /// Free the code of replaced definitions if nothing can be executing it.
+  void ReleaseQuiescentCode() {
+    if (ActiveCalls)
+      return;
+    for (auto &RT : RetiredTrackers)
+      ExitOnError(RT->remove());
+    RetiredTrackers.clear();
+    EnforceMemoryBudget();
+  }
+
+  /// Run the module level pipeline, inlining imported bodies into their
+  /// callers before the module is handed over to the JIT, then split out the
+  /// specializations the module created.
+  void OptimiseModule() {
+    ImportRuntime();
+    MPM->run(*Module, *MAM);
+    EmittedInstructions += Module->getInstructionCount();
+    SplitSpecializations();
+  }
+
+  void InitialiseModuleAndPassManager() {
     // Open a new context and module.
     Context = std::make_unique<llvm::LLVMContext>();
     Module = std::make_unique<llvm::Module>("KaleidoscopeJIT", *Context);
     Module->setDataLayout(JIT->getDataLayout());
+    // The target triple selects the library functions known to
+    // TargetLibraryInfo, including the vector math library picked with
+    // -vector-library.
+    Module->setTargetTriple(TM->getTargetTriple().str());
 
     // Create a new builder for the module.
     Builder = std::make_unique<llvm::IRBuilder<>>(*Context);
 
     // Create new pass and analysis managers.
     FPM = std::make_unique<llvm::FunctionPassManager>();
+    MPM = std::make_unique<llvm::ModulePassManager>();
     LAM = std::make_unique<llvm::LoopAnalysisManager>();
     FAM = std::make_unique<llvm::FunctionAnalysisManager>();
     CGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
     MAM = std::make_unique<llvm::ModuleAnalysisManager>();
     PIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
     SI = std::make_unique<llvm::StandardInstrumentations>(
-        *Context, /*DebugLogging*/ true);
+        *Context, /*DebugLogging*/ Opts.PrintIR);
 
     SI->registerCallbacks(*PIC, MAM.get());
 
-    // Transform passes for simple 'peephole' and bit-twiddling optimizations.
-    FPM->addPass(llvm::InstCombinePass());
-    // Reassociate expressions.
-    FPM->addPass(llvm::ReassociatePass());
-    // Eliminate common sub-expressions.
-    FPM->addPass(llvm::GVNPass());
-    // Simplify the control flow graph (ex: deleting unreachable blocks, ...)
-    FPM->addPass(llvm::SimplifyCFGPass());
-
-    // Register analysis passes used in these transform passes.
-    llvm::PassBuilder PB;
+    if (Opts.OptLevel >= 1) {
+      // Promote the allocas of mutable variables to registers.
+      FPM->addPass(llvm::PromotePass());
+      // Scalar replacement of whatever allocas are left.
+      FPM->addPass(llvm::SROAPass(llvm::SROAOptions::ModifyCFG));
+      // Transform passes for simple 'peephole' and bit-twiddling
+      // optimizations.
+      FPM->addPass(llvm::InstCombinePass());
+      // Reassociate expressions.
+      FPM->addPass(llvm::ReassociatePass());
+      // Eliminate common sub-expressions.
+      FPM->addPass(llvm::GVNPass());
+      // Simplify the control flow graph (ex: deleting unreachable blocks, ...)
+      FPM->addPass(llvm::SimplifyCFGPass());
+      // Turn self-recursive tail calls into loops.
+      FPM->addPass(llvm::TailCallElimPass());
+    }
+
+    // Inline imported bodies, clean up after them and drop whatever imported
+    // bodies are left so that only the definitions of this module get
+    // compiled.
+    llvm::FunctionPassManager PostInlineFPM;
+    PostInlineFPM.addPass(llvm::InstCombinePass());
+    PostInlineFPM.addPass(llvm::GVNPass());
+    PostInlineFPM.addPass(llvm::SimplifyCFGPass());
+    // Vectorize loops and straight-line code, reductions only vectorize if
+    // their fast-math flags allow reassociation.
+    PostInlineFPM.addPass(llvm::LoopVectorizePass());
+    PostInlineFPM.addPass(llvm::SLPVectorizerPass());
+    PostInlineFPM.addPass(llvm::InstCombinePass());
+
+    if (Opts.OptLevel >= 2) {
+      MPM->addPass(llvm::ModuleInlinerWrapperPass(llvm::getInlineParams()));
+      MPM->addPass(
+          llvm::createModuleToFunctionPassAdaptor(std::move(PostInlineFPM)));
+    } else {
+      // Operators are still inlined, as they would be if they were builtin.
+      MPM->addPass(llvm::AlwaysInlinerPass());
+    }
+    MPM->addPass(llvm::EliminateAvailableExternallyPass());
+    MPM->addPass(llvm::GlobalDCEPass());
+    if (Opts.Dedup)
+      MPM->addPass(llvm::MergeFunctionsPass());
+
+    // Register analysis passes used in these transform passes, with the cost
+    // models of the target code is compiled for.
+    llvm::PassBuilder PB(TM.get());
     PB.registerModuleAnalyses(*MAM);
+    PB.registerCGSCCAnalyses(*CGAM);
     PB.registerFunctionAnalyses(*FAM);
+    PB.registerLoopAnalyses(*LAM);
     PB.crossRegisterProxies(*LAM, *FAM, *CGAM, *MAM);
   }
 };
@@ -0,0 +1,101 @@
+//===- FastMath.h - Fast-math policy --------------------------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Fast-math policy of a session or a single function, and how it maps to IR
+// flags, function attributes and target options.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_FASTMATH_H
+#define KALEIDOSCOPE_FASTMATH_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/FMF.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Target/TargetOptions.h"
+
+/// FastMathPolicy - Which floating point assumptions code may be optimised
+/// under. The default policy is strict IEEE semantics.
+struct FastMathPolicy {
+  bool Reassoc = false;       // Reassociate, needed to vectorize reductions.
+  bool NoNaNs = false;        // Assume no NaNs.
+  bool NoInfs = false;        // Assume no infinities.
+  bool NoSignedZeros = false; // Ignore the sign of zero.
+  bool Contract = false;      // Contract operations, e.g. into fmuladd.
+  bool FuseFMA = false;       // Fuse multiply-adds, implies Contract.
+
+  /// Get the policy with every assumption enabled.
+  static FastMathPolicy fast() {
+    FastMathPolicy Policy;
+    Policy.Reassoc = Policy.NoNaNs = Policy.NoInfs = true;
+    Policy.NoSignedZeros = Policy.Contract = Policy.FuseFMA = true;
+    return Policy;
+  }
+
+  /// Enable the assumption named Flag, or all of them for "fast". Returns
+  /// false if Flag is unknown.
+  bool enable(llvm::StringRef Flag) {
+    if (Flag == "fast")
+      *this = fast();
+    else if (Flag == "reassoc")
+      Reassoc = true;
+    else if (Flag == "nnan")
+      NoNaNs = true;
+    else if (Flag == "ninf")
+      NoInfs = true;
+    else if (Flag == "nsz")
+      NoSignedZeros = true;
+    else if (Flag == "contract")
+      Contract = true;
+    else if (Flag == "fma")
+      FuseFMA = true;
+    else
+      return false;
+    return true;
+  }
+
+  bool isUnsafe() const {
+    return Reassoc && NoNaNs && NoInfs && NoSignedZeros;
+  }
+
+  /// Get the flags put on the floating point instructions.
+  llvm::FastMathFlags getFlags() const {
+    llvm::FastMathFlags FMF;
+    FMF.setAllowReassoc(Reassoc);
+    FMF.setNoNaNs(NoNaNs);
+    FMF.setNoInfs(NoInfs);
+    FMF.setNoSignedZeros(NoSignedZeros);
+    // Fused multiply-adds are only formed from contractable operations.
+    FMF.setAllowContract(Contract || FuseFMA);
+    return FMF;
+  }
+
+  /// Set the function attributes the backend reads its per-function target
+  /// options from.
+  void applyTo(llvm::Function &F) const {
+    if (isUnsafe())
+      F.addFnAttr("unsafe-fp-math", "true");
+    if (NoNaNs)
+      F.addFnAttr("no-nans-fp-math", "true");
+    if (NoInfs)
+      F.addFnAttr("no-infs-fp-math", "true");
+    if (NoSignedZeros)
+      F.addFnAttr("no-signed-zeros-fp-math", "true");
+  }
+
+  /// Set the session wide target options.
+  void applyTo(llvm::TargetOptions &Options) const {
+    Options.UnsafeFPMath = isUnsafe();
+    Options.NoNaNsFPMath = NoNaNs;
+    Options.NoInfsFPMath = NoInfs;
+    Options.NoSignedZerosFPMath = NoSignedZeros;
+    // The backend fuses only operations flagged contract, so that functions
+    // with a stricter policy of their own keep separate roundings.
+    Options.AllowFPOpFusion = llvm::FPOpFusion::Standard;
+  }
+};
+
+#endif // KALEIDOSCOPE_FASTMATH_H
@@ -4,71 +4,246 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// Contains a simple JIT for the Kaleidoscope language.
+// Contains a simple JIT for the Kaleidoscope language. Sessions compile into
+// dylibs of their own, on top of an engine several sessions can share.
 //
 //===----------------------------------------------------------------------===//
 
 #ifndef KALEIDOSCOPE_KALEIDOSCOPEJIT_H
 #define KALEIDOSCOPE_KALEIDOSCOPEJIT_H
 
+#include "Profiler.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/Mangling.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/SelfExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 
 namespace llvm {
 namespace orc {
 
-class KaleidoscopeJIT {
+/// BitcodeMaterializationUnit - Compiles a module kept as bitcode once its
+/// symbol is looked up, so that code that was evicted only takes the memory
+/// of its bitcode until it is called again.
+class BitcodeMaterializationUnit : public MaterializationUnit {
+public:
+  BitcodeMaterializationUnit(
+      IRLayer &Layer, SymbolStringPtr Name,
+      std::shared_ptr<const SmallVector<char, 0>> Bitcode)
+      : MaterializationUnit(Interface(
+            SymbolFlagsMap({{std::move(Name), JITSymbolFlags::Exported |
+                                                  JITSymbolFlags::Callable}}),
+            nullptr)),
+        Layer(Layer), Bitcode(std::move(Bitcode)) {}
+
+  StringRef getName() const override { return "BitcodeMaterializationUnit"; }
+
+  void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
+    auto Context = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode->data(), Bitcode->size()),
+                        "evicted"),
+        *Context);
+    if (!M) {
+      Layer.getExecutionSession().reportError(M.takeError());
+      R->failMaterialization();
+      return;
+    }
+    Layer.emit(std::move(R),
+               ThreadSafeModule(std::move(*M), std::move(Context)));
+  }
+
+private:
+  void discard(const JITDylib &JD, const SymbolStringPtr &Name) override {}
+
+  IRLayer &Layer;
+  std::shared_ptr<const SmallVector<char, 0>> Bitcode;
+};
+
+/// ProcessSymbolGenerator - Resolves the symbols no dylib defines from the
+/// host process. Symbols found are defined in the dylib, and the names not
+/// found are remembered, so that neither is searched for again.
+class ProcessSymbolGenerator : public DefinitionGenerator {
+public:
+  explicit ProcessSymbolGenerator(char GlobalPrefix)
+      : GlobalPrefix(GlobalPrefix) {}
+
+  Error tryToGenerate(LookupState &LS, LookupKind K, JITDylib &JD,
+                      JITDylibLookupFlags JDLookupFlags,
+                      const SymbolLookupSet &Symbols) override {
+    SymbolMap Found;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      for (const auto &[Name, Flags] : Symbols) {
+        if (Missing.count(Name))
+          continue;
+        StringRef HostName = *Name;
+        void *Addr = nullptr;
+        if (!GlobalPrefix || HostName.consume_front(GlobalPrefixStr()))
+          Addr = sys::DynamicLibrary::SearchForAddressOfSymbol(HostName.str());
+        if (!Addr) {
+          Missing.insert(Name);
+          continue;
+        }
+        Found[Name] = {ExecutorAddr::fromPtr(Addr), JITSymbolFlags::Exported};
+      }
+    }
+    if (Found.empty())
+      return Error::success();
+    return JD.define(absoluteSymbols(std::move(Found)));
+  }
+
+private:
+  StringRef GlobalPrefixStr() const { return StringRef(&GlobalPrefix, 1); }
+
+  char GlobalPrefix;
+  std::mutex Mutex;
+  DenseSet<SymbolStringPtr> Missing;
+};
+
+/// KaleidoscopeJITEngine - The parts of the JIT shared by every session: the
+/// execution session with its compile threads, the compile and link layers,
+/// and the prelude dylib every session links against, which resolves the
+/// host process symbols and whatever definitions are compiled into it.
+class KaleidoscopeJITEngine {
 private:
   std::unique_ptr<ExecutionSession> ES;
 
   DataLayout DL;
   MangleAndInterner Mangle;
 
+  /// Copy of the builder the compiler creates its target machines from.
+  JITTargetMachineBuilder TMBuilder;
+
   RTDyldObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
 
-  JITDylib &MainJD;
+  JITDylib &PreludeJD;
+
+  /// Trampolines that compile a symbol on their first call.
+  std::unique_ptr<LazyCallThroughManager> LCTM;
+
+  /// Counters of the bytes of machine code loaded into each dylib.
+  std::mutex CodeSizeMutex;
+  DenseMap<const JITDylib *, std::atomic<uint64_t> *> CodeSizes;
+
+  /// The functions loaded since recordFunctions, by start address, with
+  /// their end address and name, for the profiler to attribute samples, and
+  /// the sections of code the profiler samples, by the object holding them.
+  std::mutex FunctionsMutex;
+  std::map<uint64_t, std::pair<uint64_t, std::string>> Functions;
+  DenseMap<JITEventListener::ObjectKey,
+           SmallVector<std::pair<uint64_t, uint64_t>, 1>>
+      CodeSections;
+  std::atomic<bool> RecordFunctions = false;
+
+  /// CodeListener - Tells the engine about the objects the object layer
+  /// loads and frees, so that the profiler only samples code still there.
+  class CodeListener : public JITEventListener {
+    KaleidoscopeJITEngine &Engine;
+
+  public:
+    explicit CodeListener(KaleidoscopeJITEngine &Engine) : Engine(Engine) {}
+
+    void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                            const RuntimeDyld::LoadedObjectInfo &L) override {
+      if (Engine.RecordFunctions)
+        Engine.addFunctions(K, Obj, L);
+    }
+
+    void notifyFreeingObject(ObjectKey K) override { Engine.removeCode(K); }
+  };
+  CodeListener Listener{*this};
+
+  /// Number of sessions created so far, to name their dylibs.
+  std::atomic<unsigned> NumSessions = 0;
 
 public:
-  KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+  KaleidoscopeJITEngine(std::unique_ptr<ExecutionSession> ES,
+                        JITTargetMachineBuilder JTMB, DataLayout DL)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+        TMBuilder(JTMB),
         ObjectLayer(*this->ES,
                     [](const MemoryBuffer &) {
                       return std::make_unique<SectionMemoryManager>();
                     }),
         CompileLayer(*this->ES, ObjectLayer,
                      std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
-    MainJD.addGenerator(
-        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
-            DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+        PreludeJD(this->ES->createBareJITDylib("<prelude>")) {
+    LCTM = cantFail(createLocalLazyCallThroughManager(
+        TMBuilder.getTargetTriple(), *this->ES,
+        ExecutorAddr::fromPtr(&handleCallThroughError)));
+    PreludeJD.addGenerator(
+        std::make_unique<ProcessSymbolGenerator>(this->DL.getGlobalPrefix()));
+    ObjectLayer.setNotifyLoaded(
+        [this](MaterializationResponsibility &R, const object::ObjectFile &Obj,
+               const RuntimeDyld::LoadedObjectInfo &Info) {
+          uint64_t Size = 0;
+          for (const object::SectionRef &Section : Obj.sections())
+            if (Section.isText())
+              Size += Section.getSize();
+          std::lock_guard<std::mutex> Lock(CodeSizeMutex);
+          auto It = CodeSizes.find(&R.getTargetJITDylib());
+          if (It != CodeSizes.end())
+            *It->second += Size;
+        });
+    ObjectLayer.registerJITEventListener(Listener);
+    if (TMBuilder.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
   }
 
-  ~KaleidoscopeJIT() {
+  ~KaleidoscopeJITEngine() {
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  /// Create an engine for the host. Code is generated for the host CPU and
+  /// its features if CPU is "host", or else for CPU, which may be "generic"
+  /// for code any host of the architecture can run, with Features toggled
+  /// on top. With ConcurrentCompile, modules are compiled on a pool of
+  /// threads, so that the sessions sharing the engine don't wait for each
+  /// other's compiles.
+  static Expected<std::shared_ptr<KaleidoscopeJITEngine>>
+  Create(const TargetOptions &Options = TargetOptions(),
+         bool ConcurrentCompile = false, StringRef CPU = "host",
+         ArrayRef<std::string> Features = {}) {
+    std::unique_ptr<TaskDispatcher> Dispatcher;
+    if (ConcurrentCompile)
+      Dispatcher = std::make_unique<DynamicThreadPoolTaskDispatcher>();
+    else
+      Dispatcher = std::make_unique<InPlaceTaskDispatcher>();
+
+    auto EPC = SelfExecutorProcessControl::Create(nullptr,
+                                                  std::move(Dispatcher));
     if (!EPC)
       return EPC.takeError();
 
@@ -76,27 +251,327 @@ public:
 
     JITTargetMachineBuilder JTMB(
         ES->getExecutorProcessControl().getTargetTriple());
+    if (CPU == "host") {
+      auto HostJTMB = JITTargetMachineBuilder::detectHost();
+      if (!HostJTMB)
+        return HostJTMB.takeError();
+      JTMB = std::move(*HostJTMB);
+    } else {
+      JTMB.setCPU(CPU.str());
+    }
+    JTMB.addFeatures(std::vector<std::string>(Features.begin(),
+                                              Features.end()));
+    JTMB.setOptions(Options);
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    return std::make_shared<KaleidoscopeJITEngine>(
+        std::move(ES), std::move(JTMB), std::move(*DL));
   }
 
+  ExecutionSession &getExecutionSession() { return *ES; }
+
   const DataLayout &getDataLayout() const { return DL; }
 
+  JITDylib &getPreludeJITDylib() { return PreludeJD; }
+
+  IRLayer &getCompileLayer() { return CompileLayer; }
+
+  LazyCallThroughManager &getLazyCallThroughManager() { return *LCTM; }
+
+  SymbolStringPtr mangle(StringRef Name) { return Mangle(Name.str()); }
+
+  /// Create a target machine matching the one code is compiled with, for
+  /// target specific analyses in the optimisation pipeline.
+  Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+    return TMBuilder.createTargetMachine();
+  }
+
+  const Triple &getTargetTriple() const {
+    return TMBuilder.getTargetTriple();
+  }
+
+  /// Create the dylib of a new session, linked against the prelude.
+  Expected<JITDylib &> createSessionJITDylib() {
+    auto JD = ES->createJITDylib("<session " + std::to_string(NumSessions++) +
+                                 ">");
+    if (!JD)
+      return JD.takeError();
+    JD->addToLinkOrder(PreludeJD);
+    return *JD;
+  }
+
+  /// Count the bytes of machine code loaded into JD in Counter.
+  void trackCodeSize(const JITDylib &JD, std::atomic<uint64_t> *Counter) {
+    std::lock_guard<std::mutex> Lock(CodeSizeMutex);
+    if (Counter)
+      CodeSizes[&JD] = Counter;
+    else
+      CodeSizes.erase(&JD);
+  }
+
+  /// Record the address range of every function loaded from now on, and
+  /// add it to the code the profiler walks the frames of.
+  void recordFunctions() { RecordFunctions = true; }
+
+  /// Find the recorded function containing Addr, and the offset of Addr
+  /// into it.
+  std::optional<std::pair<std::string, uint64_t>> findFunction(uint64_t Addr) {
+    std::lock_guard<std::mutex> Lock(FunctionsMutex);
+    auto It = Functions.upper_bound(Addr);
+    if (It == Functions.begin())
+      return std::nullopt;
+    --It;
+    if (Addr >= It->second.first)
+      return std::nullopt;
+    return std::make_pair(It->second.second, Addr - It->first);
+  }
+
+private:
+  void addFunctions(JITEventListener::ObjectKey K,
+                    const object::ObjectFile &Obj,
+                    const RuntimeDyld::LoadedObjectInfo &Info) {
+    std::lock_guard<std::mutex> Lock(FunctionsMutex);
+    DenseMap<uint64_t, uint64_t> Sections;
+    for (auto &[Sym, Size] : object::computeSymbolSizes(Obj)) {
+      auto Type = Sym.getType();
+      auto Name = Sym.getName();
+      auto Addr = Sym.getAddress();
+      auto Section = Sym.getSection();
+      if (!Type || !Name || !Addr || !Section) {
+        consumeError(Type.takeError());
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        consumeError(Section.takeError());
+        continue;
+      }
+      if (*Type != object::SymbolRef::ST_Function || !Size ||
+          *Section == Obj.section_end())
+        continue;
+
+      uint64_t SectionBegin = Info.getSectionLoadAddress(**Section);
+      uint64_t Begin = SectionBegin + *Addr - (*Section)->getAddress();
+      uint64_t End = Begin + Size;
+      Sections.try_emplace(SectionBegin, (*Section)->getSize());
+
+      // Memory of code that was removed may have been reused, so drop the
+      // functions the new one overlaps.
+      auto It = Functions.lower_bound(Begin);
+      if (It != Functions.begin() && std::prev(It)->second.first > Begin)
+        --It;
+      while (It != Functions.end() && It->first < End)
+        It = Functions.erase(It);
+
+      StringRef Unmangled = *Name;
+      if (char Prefix = DL.getGlobalPrefix())
+        Unmangled.consume_front(StringRef(&Prefix, 1));
+      Functions.emplace(Begin, std::make_pair(End, Unmangled.str()));
+    }
+
+    // The sampler gets the sections of code, of which there are far fewer
+    // than functions, until the object is freed.
+    for (auto &[Begin, Size] : Sections) {
+      kal_profile_add_code(Begin, Begin + Size);
+      CodeSections[K].emplace_back(Begin, Begin + Size);
+    }
+  }
+
+  /// Stop sampling the code of an object that is freed. Its functions stay
+  /// known, so that samples taken before can still be attributed.
+  void removeCode(JITEventListener::ObjectKey K) {
+    std::lock_guard<std::mutex> Lock(FunctionsMutex);
+    auto It = CodeSections.find(K);
+    if (It == CodeSections.end())
+      return;
+    for (auto &[Begin, End] : It->second)
+      kal_profile_remove_code(Begin, End);
+    CodeSections.erase(It);
+  }
+
+  /// Called by a trampoline whose symbol could not be compiled.
+  static void handleCallThroughError() {
+    fprintf(stderr, "Error: failed to compile the target of a call\n");
+    abort();
+  }
+};
+
+/// KaleidoscopeJIT - The JIT as seen by one session: a dylib of its own with
+/// the stubs of its definitions, on top of an engine that may be shared with
+/// other sessions.
+class KaleidoscopeJIT {
+private:
+  std::shared_ptr<KaleidoscopeJITEngine> Engine;
+
+  JITDylib &MainJD;
+
+  /// Whether MainJD belongs to this session and goes away with it, rather
+  /// than being the engine's prelude.
+  bool OwnsDylib;
+
+  /// Stubs through which redefinable functions are called.
+  std::unique_ptr<IndirectStubsManager> ISM;
+
+  /// Bytes of machine code loaded so far.
+  std::atomic<uint64_t> CodeSize = 0;
+
+public:
+  KaleidoscopeJIT(std::shared_ptr<KaleidoscopeJITEngine> Engine,
+                  JITDylib &MainJD, bool OwnsDylib)
+      : Engine(std::move(Engine)), MainJD(MainJD), OwnsDylib(OwnsDylib),
+        ISM(createLocalIndirectStubsManagerBuilder(
+            this->Engine->getTargetTriple())()) {
+    this->Engine->trackCodeSize(MainJD, &CodeSize);
+  }
+
+  ~KaleidoscopeJIT() {
+    Engine->trackCodeSize(MainJD, nullptr);
+    if (!OwnsDylib)
+      return;
+    if (auto Err = Engine->getExecutionSession().removeJITDylib(MainJD))
+      Engine->getExecutionSession().reportError(std::move(Err));
+  }
+
+  /// Create a session on an engine of its own.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(const TargetOptions &Options = TargetOptions()) {
+    auto Engine = KaleidoscopeJITEngine::Create(Options);
+    if (!Engine)
+      return Engine.takeError();
+    return Create(std::move(*Engine));
+  }
+
+  /// Create a new session on a shared engine.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(std::shared_ptr<KaleidoscopeJITEngine> Engine) {
+    auto JD = Engine->createSessionJITDylib();
+    if (!JD)
+      return JD.takeError();
+    return std::make_unique<KaleidoscopeJIT>(std::move(Engine), *JD,
+                                             /*OwnsDylib*/ true);
+  }
+
+  /// Create a session compiling into the prelude of a shared engine, whose
+  /// definitions every other session can call.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  CreatePrelude(std::shared_ptr<KaleidoscopeJITEngine> Engine) {
+    JITDylib &JD = Engine->getPreludeJITDylib();
+    return std::make_unique<KaleidoscopeJIT>(std::move(Engine), JD,
+                                             /*OwnsDylib*/ false);
+  }
+
+  const DataLayout &getDataLayout() const { return Engine->getDataLayout(); }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  /// Get the number of bytes of machine code loaded so far.
+  uint64_t getCodeSize() const { return CodeSize; }
+
+  /// Create a target machine matching the one code is compiled with, for
+  /// target specific analyses in the optimisation pipeline.
+  Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+    return Engine->createTargetMachine();
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
-    return CompileLayer.add(RT, std::move(TSM));
+    return Engine->getCompileLayer().add(RT, std::move(TSM));
   }
 
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
-    return ES->lookup({&MainJD}, Mangle(Name.str()));
+    return Engine->getExecutionSession().lookup({&MainJD},
+                                                Engine->mangle(Name));
+  }
+
+  /// Find the function of any session containing Addr, see
+  /// KaleidoscopeJITEngine::recordFunctions.
+  std::optional<std::pair<std::string, uint64_t>> findFunction(uint64_t Addr) {
+    return Engine->findFunction(Addr);
+  }
+
+  /// Define Name as an alias of Aliasee, resolving to the same code.
+  Error addAlias(StringRef Name, StringRef Aliasee) {
+    SymbolAliasMap Aliases;
+    Aliases[Engine->mangle(Name)] = {
+        Engine->mangle(Aliasee),
+        JITSymbolFlags::Exported | JITSymbolFlags::Callable};
+    return MainJD.define(symbolAliases(std::move(Aliases)));
+  }
+
+  /// Look Name up on the engine's compile threads, calling OnComplete with
+  /// its address once it is compiled.
+  void lookupAsync(
+      StringRef Name,
+      unique_function<void(Expected<ExecutorSymbolDef>)> OnComplete) {
+    SymbolStringPtr Symbol = Engine->mangle(Name);
+    Engine->getExecutionSession().lookup(
+        LookupKind::Static, makeJITDylibSearchOrder({&MainJD}),
+        SymbolLookupSet(Symbol), SymbolState::Ready,
+        [Symbol, OnComplete = std::move(OnComplete)](
+            Expected<SymbolMap> Result) mutable {
+          if (!Result)
+            return OnComplete(Result.takeError());
+          OnComplete((*Result)[Symbol]);
+        },
+        NoDependenciesToRegister);
+  }
+
+  /// Look up several names at once. Whatever they need is compiled in one
+  /// go, on the engine's compile threads if it has them.
+  Expected<SymbolMap> lookup(ArrayRef<StringRef> Names) {
+    SymbolLookupSet Symbols;
+    for (StringRef Name : Names)
+      Symbols.add(Engine->mangle(Name));
+    return Engine->getExecutionSession().lookup(
+        makeJITDylibSearchOrder({&MainJD}), std::move(Symbols));
+  }
+
+  /// Make each name resolve to the given address of the host process.
+  Error addAbsoluteSymbols(
+      ArrayRef<std::pair<StringRef, ExecutorSymbolDef>> Symbols) {
+    SymbolMap Map;
+    for (const auto &[Name, Def] : Symbols)
+      Map[Engine->mangle(Name)] = Def;
+    return MainJD.define(absoluteSymbols(std::move(Map)));
+  }
+
+  /// Create an indirect stub for Name that jumps to Addr, and make Name
+  /// resolve to the stub.
+  Error addStub(StringRef Name, ExecutorAddr Addr) {
+    if (auto Err = ISM->createStub(Name, Addr,
+                                   JITSymbolFlags::Exported |
+                                       JITSymbolFlags::Callable))
+      return Err;
+    return MainJD.define(
+        absoluteSymbols({{Engine->mangle(Name), ISM->findStub(Name, true)}}));
+  }
+
+  /// Atomically repoint the stub for Name to Addr.
+  Error updateStub(StringRef Name, ExecutorAddr Addr) {
+    return ISM->updatePointer(Name, Addr);
+  }
+
+  /// Define Name under RT as the function kept in Bitcode, compiled once it
+  /// is looked up.
+  Error addBitcode(ResourceTrackerSP RT, StringRef Name,
+                   std::shared_ptr<const SmallVector<char, 0>> Bitcode) {
+    return RT->getJITDylib().define(
+        std::make_unique<BitcodeMaterializationUnit>(
+            Engine->getCompileLayer(), Engine->mangle(Name),
+            std::move(Bitcode)),
+        RT);
+  }
+
+  /// Create a trampoline that looks up Name when it is first called, hands
+  /// its address to NotifyResolved and then jumps to it.
+  Expected<ExecutorAddr>
+  createCallThrough(StringRef Name,
+                    LazyCallThroughManager::NotifyResolvedFunction
+                        NotifyResolved) {
+    return Engine->getLazyCallThroughManager().getCallThroughTrampoline(
+        MainJD, Engine->mangle(Name), std::move(NotifyResolved));
   }
 };
 
@@ -11,8 +11,10 @@
 #ifndef KALEIDOSCOPE_LEXER_H
 #define KALEIDOSCOPE_LEXER_H
 
+#include <cstdio>
 #include <cstdlib>
 #include <string>
+#include <string_view>
 
 /// Token returns enum values when valid, else returns its
 /// ASCII value [0-255].
@@ -35,6 +37,20 @@ enum Token {
   // For
   TOK_FOR = -9,
   TOK_IN = -10,
+
+  // Operators
+  TOK_BINARY = -11,
+  TOK_UNARY = -12,
+
+  // Var definition
+  TOK_VAR = -13,
+
+  // Function attributes
+  TOK_FASTMATH = -14,
+
+  // Tasks
+  TOK_SPAWN = -15,
+  TOK_AWAIT = -16,
 };
 
 /// Lexer - The lexer returns tokens for valid input, else its ASCII value.
@@ -46,15 +62,51 @@ class Lexer {
   int CurTok;
   int lastChar = ' ';
 
-  /// Returns token from standard input.
+  /// Source buffer, Stream is read when the lexer has none.
+  bool HasBuffer = false;
+  const char *BufPtr = nullptr;
+  const char *BufEnd = nullptr;
+  FILE *Stream = stdin;
+
+  /// Line of the input being read, and the line the current token starts on.
+  unsigned Line = 1;
+  unsigned TokLine = 1;
+
+  /// Returns the next character of the input.
+  int getChar() {
+    int C;
+    if (!HasBuffer)
+      C = getc(Stream);
+    else if (BufPtr == BufEnd)
+      C = EOF;
+    else
+      C = static_cast<unsigned char>(*BufPtr++);
+    if (C == '\n')
+      ++Line;
+    return C;
+  }
+
+  /// Returns token from the input.
   int getTok() {
-    // Skip any whitespace.
-    while (isspace(lastChar))
-      lastChar = getchar();
+    // Skip any whitespace and comments, iteratively so that long runs of
+    // comment lines don't grow the stack.
+    while (true) {
+      while (isspace(lastChar))
+        lastChar = getChar();
+
+      if (lastChar != '#')
+        break;
+
+      // Comment until end of line.
+      do
+        lastChar = getChar();
+      while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
+    }
+    TokLine = Line;
 
     if (isalpha(lastChar)) { // Identifier: [a-zA-Z][a-zA-Z0-9]*
       IdentifierStr = lastChar;
-      while (isalnum(lastChar = getchar())) {
+      while (isalnum(lastChar = getChar())) {
         IdentifierStr += lastChar;
       }
 
@@ -72,6 +124,18 @@ class Lexer {
         return TOK_FOR;
       if (IdentifierStr == "in")
         return TOK_IN;
+      if (IdentifierStr == "binary")
+        return TOK_BINARY;
+      if (IdentifierStr == "unary")
+        return TOK_UNARY;
+      if (IdentifierStr == "var")
+        return TOK_VAR;
+      if (IdentifierStr == "fastmath")
+        return TOK_FASTMATH;
+      if (IdentifierStr == "spawn")
+        return TOK_SPAWN;
+      if (IdentifierStr == "await")
+        return TOK_AWAIT;
       return TOK_IDENTIFIER;
     }
 
@@ -79,23 +143,13 @@ class Lexer {
       std::string numStr;
       do {
         numStr += lastChar;
-        lastChar = getchar();
+        lastChar = getChar();
       } while (isdigit(lastChar) || lastChar == '.');
 
       NumVal = strtod(numStr.c_str(), nullptr);
       return TOK_NUMBER;
     }
 
-    if (lastChar == '#') {
-      // Comment until end of line.
-      do
-        lastChar = getchar();
-      while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
-
-      if (lastChar != EOF)
-        return getTok();
-    }
-
     // If it's end of file, don't eat EOF.
     if (lastChar == EOF)
       return TOK_EOF;
@@ -103,11 +157,24 @@ class Lexer {
     // Return ASCII value of character if none of the above conditions are
     // satisfied.
     int thisChar = lastChar;
-    lastChar = getchar();
+    lastChar = getChar();
     return thisChar;
   }
 
 public:
+  /// Lex standard input.
+  Lexer() = default;
+
+  /// Lex the given stream, such as the connection of a server session.
+  explicit Lexer(FILE *Stream) : Stream(Stream) {}
+
+  /// Lex the given source buffer, which must outlive the lexer. FirstLine
+  /// is the line it starts on, for a buffer that is part of a larger source.
+  explicit Lexer(std::string_view Source, unsigned FirstLine = 1)
+      : HasBuffer(true), BufPtr(Source.data()),
+        BufEnd(Source.data() + Source.size()), Line(FirstLine),
+        TokLine(FirstLine) {}
+
   /// Updates token buffer by reading another token from the lexer.
   int getNextTok() {
     CurTok = getTok();
@@ -116,6 +183,9 @@ public:
   int &getCurTok() { return CurTok; };
   std::string &getIdentifierStr() { return IdentifierStr; };
   double &getNumVal() { return NumVal; };
+
+  /// Line of the source the current token starts on, counting from 1.
+  unsigned getTokLine() const { return TokLine; }
 };
 
 #endif // KALEIDOSCOPE_LEXER_H
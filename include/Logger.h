@@ -13,12 +13,34 @@
 
 #include "ASTExpr.h"
 #include "llvm/IR/Value.h"
+#include "llvm/Support/Error.h"
+#include <string>
 
 class Logger {
 public:
+  /// Errors of the current thread are appended here instead of printed when
+  /// it is set, so that parsers running in parallel can report in order.
+  static std::string *&getDiagnosticBuffer() {
+    static thread_local std::string *Buffer = nullptr;
+    return Buffer;
+  }
+
+  /// Stream the errors and results of the current thread are written to, so
+  /// that each session of a server reports to its own client.
+  static FILE *&getStream() {
+    static thread_local FILE *Stream = stderr;
+    return Stream;
+  }
+
   /// Error handling helper function for ExprAST.
   static std::unique_ptr<ExprAST> LogError(const char *Str) {
-    fprintf(stderr, "Error: %s\n", Str);
+    if (std::string *Buffer = getDiagnosticBuffer()) {
+      *Buffer += "Error: ";
+      *Buffer += Str;
+      *Buffer += "\n";
+      return nullptr;
+    }
+    fprintf(getStream(), "Error: %s\n", Str);
     return nullptr;
   }
 
@@ -33,6 +55,15 @@ public:
     LogError(Str);
     return nullptr;
   }
+
+  /// Error handling helper function for the JIT, whose errors are reported
+  /// to the session rather than exiting. Returns true if there was one.
+  static bool LogError(llvm::Error Err) {
+    if (!Err)
+      return false;
+    LogError(llvm::toString(std::move(Err)).c_str());
+    return true;
+  }
 };
 
 #endif // KALEIDOSCOPE_LOGGER_H
@@ -0,0 +1,102 @@
+//===- MLIRGen.h - Lowering of loop nests through MLIR --------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// An alternative code generation path for definitions with loops. Counted
+// loops are emitted as affine.for, or scf.for where their bounds aren't
+// affine, with the arithmetic in the arith dialect and variables as rank-0
+// memrefs. The nests are fused, interchanged and tiled for locality, then
+// lowered to LLVM IR that is linked into the current module of the JIT.
+// Only built with KALEIDOSCOPE_ENABLE_MLIR.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_MLIRGEN_H
+#define KALEIDOSCOPE_MLIRGEN_H
+
+#include "ASTExpr.h"
+#include "mlir/IR/Builders.h"
+#include "mlir/IR/BuiltinOps.h"
+#include "mlir/IR/MLIRContext.h"
+#include "mlir/IR/OwningOpRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include <string>
+#include <vector>
+
+class CodeGen;
+
+namespace llvm {
+class Function;
+} // namespace llvm
+
+class MLIRGen {
+  /// MLIRVariable - A variable in scope, either a mutable slot or the value
+  /// of a loop's induction variable, which the body can't assign.
+  struct MLIRVariable {
+    std::string Name;
+    mlir::Value Value;
+    bool IsInduction = false;
+    unsigned Writes = 0;
+  };
+
+  CodeGen &CG;
+  mlir::MLIRContext Context;
+  mlir::OpBuilder Builder;
+
+  /// The module and function being emitted, the variables in scope with the
+  /// innermost last, and the number of loops emitted.
+  mlir::OwningOpRef<mlir::ModuleOp> Unit;
+  mlir::Block *EntryBlock = nullptr;
+  std::vector<MLIRVariable> Scope;
+  unsigned Loops = 0;
+
+public:
+  explicit MLIRGen(CodeGen &CG);
+
+  /// Lower Function through MLIR into the current module of CG under its
+  /// fast-math policy, and return its definition there, which is left to be
+  /// optimised like a directly emitted one. Returns null without changing
+  /// the module if it has no loops or uses what the path doesn't cover.
+  llvm::Function *lower(const FunctionAST &Function);
+
+  /// Helpers for the mlirgen methods of the nodes, all values are f64.
+  mlir::OpBuilder &getBuilder() { return Builder; }
+  mlir::Location getLoc() { return Builder.getUnknownLoc(); }
+  mlir::Value getConstant(double Val);
+  mlir::Value toBool(mlir::Value V);
+  mlir::Value fromBool(mlir::Value V);
+
+  /// Read or assign the innermost variable Name. Returns null if there is
+  /// none, or if it is an induction variable being assigned.
+  mlir::Value read(const std::string &Name);
+  mlir::Value write(const std::string &Name, mlir::Value V);
+
+  /// Number of assignments to the innermost variable Name so far.
+  unsigned getWrites(const std::string &Name);
+
+  /// Bring a variable initialized to Init into scope, or drop the innermost
+  /// N.
+  void bind(const std::string &Name, mlir::Value Init);
+  void unbind(size_t N = 1);
+
+  /// Call the function Callee, which takes and returns doubles.
+  mlir::Value call(const std::string &Callee, llvm::ArrayRef<mlir::Value> Args);
+
+  /// Emit a loop with VarName running from Lower up to Upper, both index
+  /// values, by Step, and its body with EmitBody. Returns false if the body
+  /// couldn't be emitted.
+  bool emitLoop(const std::string &VarName, mlir::Value Lower,
+                mlir::Value Upper, int64_t Step,
+                llvm::function_ref<bool()> EmitBody);
+
+private:
+  /// Fuse, interchange and tile the loop nests, then lower everything to
+  /// the LLVM dialect.
+  bool optimise();
+
+  MLIRVariable *lookup(const std::string &Name);
+};
+
+#endif // KALEIDOSCOPE_MLIRGEN_H
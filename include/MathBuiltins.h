@@ -0,0 +1,85 @@
+//===- MathBuiltins.h - Math externs known to the compiler ----------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Maps well-known math externs to the LLVM intrinsics with the same meaning,
+// so that calls to them can be folded, hoisted and vectorized.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_MATHBUILTINS_H
+#define KALEIDOSCOPE_MATHBUILTINS_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Intrinsics.h"
+#include <optional>
+
+class MathBuiltins {
+  struct Builtin {
+    const char *Name;
+    llvm::Intrinsic::ID ID;
+    unsigned NumArgs;
+  };
+
+public:
+  /// Get the intrinsic implementing the extern Name taking NumArgs
+  /// arguments, if there is one.
+  static std::optional<llvm::Intrinsic::ID> lookup(llvm::StringRef Name,
+                                                   unsigned NumArgs) {
+    static const Builtin Builtins[] = {
+        {"sin", llvm::Intrinsic::sin, 1},
+        {"cos", llvm::Intrinsic::cos, 1},
+        {"exp", llvm::Intrinsic::exp, 1},
+        {"exp2", llvm::Intrinsic::exp2, 1},
+        {"log", llvm::Intrinsic::log, 1},
+        {"log2", llvm::Intrinsic::log2, 1},
+        {"log10", llvm::Intrinsic::log10, 1},
+        {"sqrt", llvm::Intrinsic::sqrt, 1},
+        {"fabs", llvm::Intrinsic::fabs, 1},
+        {"floor", llvm::Intrinsic::floor, 1},
+        {"ceil", llvm::Intrinsic::ceil, 1},
+        {"trunc", llvm::Intrinsic::trunc, 1},
+        {"round", llvm::Intrinsic::round, 1},
+        {"rint", llvm::Intrinsic::rint, 1},
+        {"nearbyint", llvm::Intrinsic::nearbyint, 1},
+        {"pow", llvm::Intrinsic::pow, 2},
+        {"fmin", llvm::Intrinsic::minnum, 2},
+        {"fmax", llvm::Intrinsic::maxnum, 2},
+        {"copysign", llvm::Intrinsic::copysign, 2},
+        {"fma", llvm::Intrinsic::fma, 3},
+    };
+
+    for (const Builtin &B : Builtins)
+      if (Name == B.Name && NumArgs == B.NumArgs)
+        return B.ID;
+    return std::nullopt;
+  }
+
+  /// Get the approximate cost of a builtin in instructions. Most targets
+  /// have instructions for the rounding and sign operations, the others are
+  /// library calls.
+  static unsigned getCost(llvm::Intrinsic::ID ID) {
+    switch (ID) {
+    case llvm::Intrinsic::fabs:
+    case llvm::Intrinsic::copysign:
+    case llvm::Intrinsic::minnum:
+    case llvm::Intrinsic::maxnum:
+    case llvm::Intrinsic::floor:
+    case llvm::Intrinsic::ceil:
+    case llvm::Intrinsic::trunc:
+    case llvm::Intrinsic::round:
+    case llvm::Intrinsic::rint:
+    case llvm::Intrinsic::nearbyint:
+      return 1;
+    case llvm::Intrinsic::sqrt:
+    case llvm::Intrinsic::fma:
+      return 4;
+    default:
+      return 16;
+    }
+  }
+};
+
+#endif // KALEIDOSCOPE_MATHBUILTINS_H
@@ -16,7 +16,29 @@
 #include "CodeGen.h"
 #include "Lexer.h"
 #include "Logger.h"
-#include <map>
+#include <array>
+
+/// ParserOptions - Configuration of the parser.
+struct ParserOptions {
+  /// Parse expressions with explicit stacks instead of recursive descent, so
+  /// that stack use stays bounded however deeply the input nests. Errors are
+  /// recovered from by skipping to the next top-level item.
+  bool Iterative = false;
+
+  /// Nesting depth of parentheses, calls, if/for/var and unary operators
+  /// beyond which expressions are rejected.
+  unsigned MaxNestingDepth = 256;
+
+  /// Only build ASTs, without a JIT behind the parser.
+  bool ParseOnly = false;
+};
+
+/// TopLevelItem - A parsed top-level item waiting for codegen.
+struct TopLevelItem {
+  enum ItemKind { Definition, Extern, Expression } Kind;
+  std::unique_ptr<FunctionAST> Function; // Definition or Expression.
+  std::unique_ptr<ProtoTypeAST> Proto;   // Extern.
+};
 
 /// The parser starts with the most simple literal,
 /// which are then used by compound literals to break down
@@ -40,38 +62,68 @@ public:
   ///   ::= Identifier '(' expression* ')'
   std::unique_ptr<ExprAST> ParseIdentifierExpr();
 
+  /// Parse the arguments of a call after its '(', up to and including the
+  /// closing ')'. Returns false on error.
+  bool ParseCallArgs(std::vector<std::unique_ptr<ExprAST>> &Args);
+
   /// Parse primary expressions.
   ///
   /// Primary
   ///   ::= IdentifierExpr
   ///   ::= NumberExpr
   ///   ::= ParenExpr
+  ///   ::= SpawnExpr
+  ///   ::= AwaitExpr
   std::unique_ptr<ExprAST> ParsePrimary();
 
+  /// Parse unary expressions.
+  ///
+  /// Unary
+  ///   ::= Primary
+  ///   ::= '!' Unary
+  std::unique_ptr<ExprAST> ParseUnary();
+
   /// Parse primary binorph expressions.
   ///
   /// Expression
-  ///   ::= Primary Binorphs
+  ///   ::= Unary Binorphs
   std::unique_ptr<ExprAST> ParseExpression();
 
+  /// Parse an expression of the same grammar as ParseExpression, keeping
+  /// pending operators, operands and enclosing constructs on explicit stacks.
+  std::unique_ptr<ExprAST> ParseExpressionIterative();
+
   /// Parse RHS with the given LHS for the binorph.
   ///
   /// Binorphs
-  ///   ::= ('+' primary)*
+  ///   ::= ('+' Unary)*
   std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
                                          std::unique_ptr<ExprAST> LHS);
 
+  /// Parse an optional type annotation into Ty, leaving Ty untouched if
+  /// there is none. Returns false on error.
+  ///
+  /// TypeAnnotation ::= (':' ('double' | 'float' | 'int' | 'bool'))?
+  bool ParseOptionalType(ValueType &Ty);
+
   /// Parse prototype expressions.
   ///
   /// ProtoType
-  ///   ::= id '(' id* ')'
+  ///   ::= id '(' (id TypeAnnotation)* ')' TypeAnnotation
+  ///   ::= binary LETTER number? (id, id) TypeAnnotation
+  ///   ::= unary LETTER (id) TypeAnnotation
   std::unique_ptr<ProtoTypeAST> ParseProtoType();
 
   /// Parse definition for the prototype expression.
   ///
-  /// Definition ::= 'def' PrototTypeExpr
+  /// Definition ::= 'def' FastMath? PrototTypeExpr
   std::unique_ptr<FunctionAST> ParseDefinition();
 
+  /// Parse the fast-math policy of a definition.
+  ///
+  /// FastMath ::= 'fastmath' ('(' id* ')')?
+  std::optional<FastMathPolicy> ParseFastMath();
+
   /// Parse external prototype expressions.
   ///
   /// External ::= 'extern' ProtoType
@@ -87,10 +139,30 @@ public:
   /// IfExpr ::= 'if' expression 'then' expression 'else' expression
   std::unique_ptr<ExprAST> ParseIfExpr();
 
-  /// Parse for/in expressions.
+  /// Parse for/in expressions, and reductions over them, whose name the
+  /// caller has read.
   ///
   /// ForExpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-  std::unique_ptr<ExprAST> ParseForExpr();
+  /// ReduceExpr ::= ('sum' | 'prod' | 'min' | 'max') ForExpr
+  std::unique_ptr<ExprAST> ParseForExpr(
+      std::optional<ReduceExprAST::ReduceKind> Reduction = std::nullopt);
+
+  /// Parse var/in expressions.
+  ///
+  /// VarExpr ::= 'var' identifier TypeAnnotation ('=' expression)?
+  ///             (',' identifier TypeAnnotation ('=' expression)?)*
+  ///             'in' expression
+  std::unique_ptr<ExprAST> ParseVarExpr();
+
+  /// Parse spawn expressions.
+  ///
+  /// SpawnExpr ::= 'spawn' identifier '(' expression* ')'
+  std::unique_ptr<ExprAST> ParseSpawnExpr();
+
+  /// Parse await expressions, which bind as tightly as unary operators.
+  ///
+  /// AwaitExpr ::= 'await' Unary
+  std::unique_ptr<ExprAST> ParseAwaitExpr();
 
   /// Helper function to handle prototype definitions.
   void HandleDefinition();
@@ -101,10 +173,37 @@ public:
   /// Helper function to handle top level expressions.
   void HandleTopLevelExpression();
 
+  /// Generate code for a parsed definition and add it to the JIT.
+  void CodegenDefinition(std::unique_ptr<FunctionAST> FnAST);
+
+  /// Generate code for a parsed external prototype.
+  void CodegenExtern(std::unique_ptr<ProtoTypeAST> ProtoAST);
+
+  /// Generate code for a parsed top level expression and evaluate it.
+  void CodegenTopLevelExpression(std::unique_ptr<FunctionAST> FnAST);
+
+  /// Parse all remaining top-level items of the input without generating
+  /// code for them. Binary operators take effect as soon as they are parsed.
+  std::vector<TopLevelItem> ParseTopLevelItems();
+
+  /// Generate code for parsed top-level items in order.
+  void CodegenItems(std::vector<TopLevelItem> Items);
+
+  /// Skip past the tokens of a top-level item that failed to parse.
+  void RecoverFromError();
+
+  /// Make the definitions, externs and operators of a prelude compiled into
+  /// the shared engine known to this session.
+  void ImportPrelude(const Parser &Prelude);
+
 private:
-  /// Holds the precedence value for a valid binary operator.
+  /// Nesting depth of the expression being parsed by recursive descent.
+  unsigned NestingDepth = 0;
+
+  /// Holds the precedence value for a valid binary operator, indexed by the
+  /// operator character.
   class OpPrecedence {
-    std::map<char, int> BinOpPrecedence;
+    std::array<int, 256> BinOpPrecedence{};
 
   public:
     /// Get the precedence of the operator token.
@@ -120,12 +219,25 @@ private:
       return TokPrec;
     }
 
+    /// Install the precedence of a user defined binary operator.
+    void SetBinOpPrecedence(char Op, int Prec) {
+      BinOpPrecedence[static_cast<unsigned char>(Op)] = Prec;
+    }
+
+    /// Returns true if Op is one of the standard binary operators.
+    static bool IsBuiltinBinOp(int Op) {
+      return Op == '=' || Op == '<' || Op == '+' || Op == '-' || Op == '*' ||
+             Op == '/';
+    }
+
     /// Initialise standard binary operators.
     OpPrecedence() {
+      BinOpPrecedence['='] = 2;
       BinOpPrecedence['<'] = 10;
       BinOpPrecedence['+'] = 20;
       BinOpPrecedence['-'] = 30;
-      BinOpPrecedence['*'] = 40; // highest
+      BinOpPrecedence['*'] = 40;
+      BinOpPrecedence['/'] = 40; // highest
     }
   };
 
@@ -141,7 +253,21 @@ public:
 
   OpPrecedence BinOpPrecedence;
 
-  Parser() { CG.InitialiseModuleAndPassManager(); }
+  ParserOptions Opts;
+
+  Parser(CodeGenOptions CGOpts = CodeGenOptions(),
+         ParserOptions Opts = ParserOptions())
+      : Opts(Opts) {
+    CG.Opts = CGOpts;
+    if (Opts.ParseOnly)
+      return;
+    if (CG.Opts.BackgroundInit) {
+      CG.StartInitialisation();
+      return;
+    }
+    CG.InitialiseJIT();
+    CG.InitialiseModuleAndPassManager();
+  }
 };
 
 #endif // KALEIDOSCOPE_PARSER_H
@@ -0,0 +1,58 @@
+//===- Profiler.h - Sampling profiler of JIT'd code -----------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// A sampling profiler of the code the JIT runs. A CPU time timer interrupts
+// whichever thread is running, and if it is in JIT'd code the signal handler
+// records its program counter and the return addresses of the JIT'd frames
+// below it. Like the task runtime it is only compiled into the host.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_PROFILER_H
+#define KALEIDOSCOPE_PROFILER_H
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+/// Start sampling Hz times per second of CPU time used by the process.
+/// Returns false if the host isn't supported or the timer couldn't be set.
+bool kal_profile_start(unsigned Hz);
+
+/// Make the stack of the calling thread known to the sampler, which only
+/// follows the frames of registered threads. kal_profile_start registers
+/// the thread calling it, and task workers register themselves.
+void kal_profile_register_thread(void);
+
+/// Stop sampling. Samples recorded so far can still be drained.
+void kal_profile_stop(void);
+
+/// Add [Begin, End) to the code that is sampled. Frames are only followed
+/// through return addresses within the ranges added and not removed, which
+/// must keep frame pointers. Ranges added while 8192 are in are ignored.
+void kal_profile_add_code(uint64_t Begin, uint64_t End);
+
+/// Remove a range added before, once its code is freed, so that its memory
+/// isn't taken for code and it makes room for others.
+void kal_profile_remove_code(uint64_t Begin, uint64_t End);
+
+/// Number of words kal_profile_drain may write.
+size_t kal_profile_buffer_words(void);
+
+/// Move the samples recorded since the last drain into Buffer, which must
+/// hold kal_profile_buffer_words words, and return the number written. Each
+/// sample is its depth followed by that many addresses, the program counter
+/// first and then the return addresses of its callers.
+size_t kal_profile_drain(uint64_t *Buffer);
+
+/// Number of samples lost so far as the buffer was full or being drained.
+uint64_t kal_profile_dropped(void);
+
+/// Number of ranges of code ignored so far as 8192 were in already.
+uint64_t kal_profile_dropped_code(void);
+}
+
+#endif // KALEIDOSCOPE_PROFILER_H
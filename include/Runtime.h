@@ -0,0 +1,65 @@
+//===- Runtime.h - Runtime library of JIT'd code --------------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// The builtins JIT'd code calls into. The runtime is compiled into the host
+// and also shipped as bitcode, so that its hot helpers can be inlined into
+// their callers. It must therefore stay free of LLVM and of static
+// constructors.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_RUNTIME_H
+#define KALEIDOSCOPE_RUNTIME_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+
+/// Capacity of the output buffer in bytes.
+#define KAL_OUTPUT_CAPACITY 65536
+
+/// KalOutputBuffer - Output written by JIT'd code, batched into a single
+/// write whenever it reaches the flush threshold. Spawned tasks write to it
+/// concurrently, so every access holds Locked.
+struct KalOutputBuffer {
+  char Data[KAL_OUTPUT_CAPACITY];
+  size_t Size;
+  size_t FlushThreshold;
+  FILE *Stream; // Null discards the output.
+  bool Initialised;
+  std::atomic<bool> Locked;
+};
+
+extern "C" {
+/// The output buffer shared by the host and every inlined copy of the
+/// helpers below.
+extern KalOutputBuffer kal_output;
+
+/// Write out whatever output is buffered.
+void kal_flush(void);
+
+/// Set where output is written, null discards it. Flushes first.
+void kal_set_output(FILE *Stream);
+
+/// Set the buffered size at which output is written out. Zero writes every
+/// character immediately.
+void kal_set_flush_threshold(size_t Threshold);
+
+/// Print a character.
+double putchard(double X);
+
+/// Print a number on its own line.
+double printd(double X);
+
+/// Get the highest instruction set level ahead-of-time compiled functions
+/// are cloned for that the host supports, 0 for the baseline. The levels are
+/// x86-64-v2, v3 and v4 on x86-64, and dot product, then dot product and
+/// SVE, on AArch64. Called from the resolvers picking the clones,
+/// possibly before the process is fully relocated.
+int kal_isa_level(void);
+}
+
+#endif // KALEIDOSCOPE_RUNTIME_H
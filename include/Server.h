@@ -0,0 +1,56 @@
+//===- Server.h - Kaleidoscope sessions over a local socket ---------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Serves interactive sessions over a Unix domain socket. Every session
+// compiles into a dylib of its own, while the JIT engine, its compile
+// threads and the prelude are shared between them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_SERVER_H
+#define KALEIDOSCOPE_SERVER_H
+
+#include "Parser.h"
+#include "llvm/Support/ThreadPool.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+class SessionServer {
+public:
+  /// Create a server whose sessions compile with Opts and parse with
+  /// ParseOpts, running at most MaxSessions of them at once (0 for one per
+  /// hardware thread). Further connections wait for a session to end.
+  SessionServer(CodeGenOptions Opts, ParserOptions ParseOpts,
+                unsigned MaxSessions = 0);
+
+  /// Compile Source into the prelude, whose definitions, externs and
+  /// operators every session starts with.
+  void loadPrelude(std::string_view Source);
+
+  /// Accept sessions on a socket at Path until accepting fails. Returns
+  /// false if the socket could not be set up.
+  bool serve(const std::string &Path);
+
+private:
+  /// Run the session of a connection, reading its input from and writing
+  /// its results to the connection.
+  void runSession(int Fd);
+
+  CodeGenOptions Opts;
+  ParserOptions ParseOpts;
+
+  /// Compiles the prelude into the shared engine.
+  std::unique_ptr<Parser> Prelude;
+
+  /// Taken by sessions while their JIT'd code runs.
+  std::mutex RuntimeLock;
+
+  llvm::ThreadPool Sessions;
+};
+
+#endif // KALEIDOSCOPE_SERVER_H
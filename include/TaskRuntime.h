@@ -0,0 +1,64 @@
+//===- TaskRuntime.h - Task runtime of spawn/await ------------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// The work-stealing task pool behind spawn and await. Unlike the builtins in
+// Runtime.h it is only compiled into the host, as it owns threads and
+// process-wide state that inlined copies must not duplicate.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_TASKRUNTIME_H
+#define KALEIDOSCOPE_TASKRUNTIME_H
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+/// The function a task runs, called with its copy of the environment.
+typedef double (*KalTaskFn)(void *Env);
+
+/// Set the number of worker threads, zero for one per hardware thread. Only
+/// takes effect before the first task is spawned.
+void kal_set_task_threads(unsigned Threads);
+
+/// Start running Fn on a copy of the EnvSize bytes at Env, and return the
+/// future of its result. A worker queues the tasks it spawns itself, and
+/// idle workers steal from the other end of its queue.
+int64_t kal_spawn(KalTaskFn Fn, const void *Env, size_t EnvSize);
+
+/// Wait for the task behind a future and return its result, running other
+/// tasks meanwhile. A future can be awaited once, the task of one that never
+/// is stays allocated. Awaiting anything else, such as a future awaited
+/// already, reports an error and returns NaN.
+double kal_await(int64_t Future);
+
+/// The function a parallel reduction runs on each chunk of its range, with
+/// the environment of the reduction and the chunk from First below Last.
+typedef double (*KalRangeFn)(const void *Env, int64_t First, int64_t Last);
+
+/// How a parallel reduction combines the results of its chunks. min and max
+/// propagate NaNs and order -0 below +0.
+enum KalReduceKind {
+  KAL_REDUCE_SUM,
+  KAL_REDUCE_PROD,
+  KAL_REDUCE_MIN,
+  KAL_REDUCE_MAX,
+};
+
+/// Reduce the range from Begin below End by Step, a positive step, with Fn.
+/// Ranges of at least twice MinIterations iterations are split into chunks
+/// of at least MinIterations, run as tasks, and their results combined in
+/// order, so the result doesn't depend on the number of threads.
+double kal_parallel_reduce(KalRangeFn Fn, const void *Env, int64_t Begin,
+                           int64_t End, int64_t Step, int32_t Kind,
+                           int64_t MinIterations);
+
+/// Wait until every task spawned so far has finished, including those whose
+/// futures were dropped, running tasks meanwhile.
+void kal_wait_tasks(void);
+}
+
+#endif // KALEIDOSCOPE_TASKRUNTIME_H
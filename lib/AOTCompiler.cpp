@@ -0,0 +1,284 @@
+//===- AOTCompiler.cpp - Ahead-of-time compilation to object files --------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements ahead-of-time compilation with function multiversioning.
+//
+//===----------------------------------------------------------------------===//
+
+#include "AOTCompiler.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+AOTCompiler::AOTCompiler(AOTOptions Opts)
+    : Opts(std::move(Opts)),
+      Module(std::make_unique<llvm::Module>("KaleidoscopeAOT", Context)) {}
+
+void AOTCompiler::addModule(const llvm::Module &M, llvm::StringRef Skip) {
+  // Modules only move between contexts as bitcode.
+  llvm::SmallVector<char, 0> Bitcode;
+  llvm::raw_svector_ostream OS(Bitcode);
+  llvm::WriteBitcodeToFile(M, OS);
+  auto Copy = llvm::parseBitcodeFile(
+      llvm::MemoryBufferRef(llvm::StringRef(Bitcode.data(), Bitcode.size()),
+                            M.getModuleIdentifier()),
+      Context);
+  if (!Copy) {
+    llvm::errs() << "Warning: definitions not added to the object: "
+                 << Copy.takeError() << "\n";
+    return;
+  }
+
+  if (llvm::Function *Skipped = (*Copy)->getFunction(Skip))
+    Skipped->deleteBody();
+
+  for (llvm::Function &F : **Copy) {
+    if (F.isDeclaration() || F.hasAvailableExternallyLinkage())
+      continue;
+    llvm::Function *Earlier = Module->getFunction(F.getName());
+    if (Earlier && !Earlier->isDeclaration())
+      Earlier->deleteBody();
+  }
+
+  if (llvm::Linker::linkModules(*Module, std::move(*Copy)))
+    fprintf(stderr, "Warning: definitions not added to the object\n");
+}
+
+llvm::ArrayRef<ISALevel> AOTCompiler::getISALevels(const llvm::Triple &T) {
+  // Keep in sync with kal_isa_level. The x86-64 levels are defined by their
+  // features, which kal_isa_level checks.
+  static const ISALevel X86_64[] = {
+      {"x86-64-v2", "x86-64-v2", "x86-64-v2", ""},
+      {"x86-64-v3", "x86-64-v3", "x86-64-v3", ""},
+      {"x86-64-v4", "x86-64-v4", "x86-64-v4", ""}};
+  static const ISALevel AArch64[] = {
+      {"dotprod", "generic", "neoverse-n1", "+dotprod"},
+      {"sve", "generic", "neoverse-v1", "+dotprod,+sve"}};
+  if (T.getArch() == llvm::Triple::x86_64)
+    return X86_64;
+  if (T.isAArch64())
+    return AArch64;
+  return {};
+}
+
+bool AOTCompiler::shouldMultiversion(const llvm::Function &F) const {
+  if (F.isDeclaration() || F.hasAvailableExternallyLinkage() ||
+      !F.hasExternalLinkage() ||
+      F.hasFnAttribute(llvm::Attribute::AlwaysInline))
+    return false;
+  if (llvm::is_contained(Opts.Multiversion, F.getName()))
+    return true;
+  if (!Opts.MultiversionLoops)
+    return false;
+
+  llvm::SmallVector<
+      std::pair<const llvm::BasicBlock *, const llvm::BasicBlock *>>
+      Backedges;
+  llvm::FindFunctionBackedges(F, Backedges);
+  return !Backedges.empty();
+}
+
+void AOTCompiler::multiversion(llvm::ArrayRef<llvm::Function *> Functions,
+                               llvm::ArrayRef<ISALevel> Levels,
+                               const llvm::Triple &T) {
+  // Create every clone before filling any in, so that calls between
+  // multiversioned functions can go straight to the clone of the same level.
+  std::vector<llvm::SmallVector<llvm::Function *, 4>> Versions;
+  for (llvm::Function *F : Functions) {
+    Versions.emplace_back();
+    Versions.back().push_back(F);
+    for (const ISALevel &Level : Levels)
+      Versions.back().push_back(llvm::Function::Create(
+          F->getFunctionType(), llvm::GlobalValue::InternalLinkage,
+          F->getName() + "." + Level.Name, *Module));
+  }
+
+  for (unsigned Level = 1; Level <= Levels.size(); ++Level) {
+    llvm::ValueToValueMapTy VMap;
+    for (unsigned I = 0; I != Functions.size(); ++I)
+      VMap[Functions[I]] = Versions[I][Level];
+
+    for (unsigned I = 0; I != Functions.size(); ++I) {
+      llvm::Function *F = Functions[I];
+      llvm::Function *Clone = Versions[I][Level];
+      auto CloneArg = Clone->arg_begin();
+      for (llvm::Argument &Arg : F->args()) {
+        CloneArg->setName(Arg.getName());
+        VMap[&Arg] = &*CloneArg++;
+      }
+
+      llvm::SmallVector<llvm::ReturnInst *, 4> Returns;
+      llvm::CloneFunctionInto(Clone, F, VMap,
+                              llvm::CloneFunctionChangeType::LocalChangesOnly,
+                              Returns);
+      Clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+      Clone->removeFnAttr("target-features");
+      Clone->addFnAttr("target-cpu", Levels[Level - 1].CPU);
+      Clone->addFnAttr("tune-cpu", Levels[Level - 1].TuneCPU);
+      if (*Levels[Level - 1].Features)
+        Clone->addFnAttr("target-features", Levels[Level - 1].Features);
+    }
+  }
+
+  llvm::Type *PtrTy = llvm::PointerType::getUnqual(Context);
+  llvm::FunctionCallee GetISALevel = Module->getOrInsertFunction(
+      "kal_isa_level",
+      llvm::FunctionType::get(llvm::Type::getInt32Ty(Context),
+                              /*isVarArg*/ false));
+
+  // Without ifuncs, a constructor picks the versions once the object is
+  // loaded and dispatchers call through the pointers it sets.
+  llvm::Function *Initialiser = nullptr;
+  if (!T.isOSBinFormatELF()) {
+    Initialiser = llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(Context), false),
+        llvm::GlobalValue::InternalLinkage, "kal.multiversion.init", *Module);
+    llvm::BasicBlock::Create(Context, "entry", Initialiser);
+    // Run ahead of the constructors of the program, which may call the
+    // dispatchers. Priorities up to 100 are reserved for the implementation.
+    llvm::appendToGlobalCtors(*Module, Initialiser, /*Priority*/ 101);
+  }
+
+  for (unsigned I = 0; I != Functions.size(); ++I) {
+    llvm::Function *F = Functions[I];
+    std::string Name = F->getName().str();
+    F->setName(Name + ".default");
+    F->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+    // The resolver picks the version of the highest level the host supports.
+    llvm::Function *Resolver = llvm::Function::Create(
+        llvm::FunctionType::get(PtrTy, false),
+        llvm::GlobalValue::InternalLinkage, Name + ".resolver", *Module);
+    llvm::IRBuilder<> Builder(
+        llvm::BasicBlock::Create(Context, "entry", Resolver));
+    llvm::Value *HostLevel = Builder.CreateCall(GetISALevel);
+    llvm::Value *Chosen = F;
+    for (unsigned Level = 1; Level != Versions[I].size(); ++Level)
+      Chosen = Builder.CreateSelect(
+          Builder.CreateICmpSGE(HostLevel, Builder.getInt32(Level)),
+          Versions[I][Level], Chosen);
+    Builder.CreateRet(Chosen);
+
+    llvm::Constant *Dispatcher;
+    if (!Initialiser) {
+      Dispatcher = llvm::GlobalIFunc::create(
+          F->getFunctionType(), 0, llvm::GlobalValue::ExternalLinkage, Name,
+          Resolver, Module.get());
+    } else {
+      auto *Pointer = new llvm::GlobalVariable(
+          *Module, PtrTy, /*isConstant*/ false,
+          llvm::GlobalValue::InternalLinkage,
+          llvm::ConstantPointerNull::get(llvm::PointerType::getUnqual(Context)),
+          Name + ".ptr");
+      Builder.SetInsertPoint(&Initialiser->getEntryBlock());
+      Builder.CreateStore(Builder.CreateCall(Resolver), Pointer);
+
+      llvm::Function *Trampoline =
+          llvm::Function::Create(F->getFunctionType(),
+                                 llvm::GlobalValue::ExternalLinkage, Name,
+                                 *Module);
+      Builder.SetInsertPoint(
+          llvm::BasicBlock::Create(Context, "entry", Trampoline));
+      llvm::SmallVector<llvm::Value *, 4> Args;
+      for (llvm::Argument &Arg : Trampoline->args())
+        Args.push_back(&Arg);
+      llvm::CallInst *Call =
+          Builder.CreateCall(F->getFunctionType(),
+                             Builder.CreateLoad(PtrTy, Pointer), Args);
+      Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+      Builder.CreateRet(Call);
+      Dispatcher = Trampoline;
+    }
+
+    // Everything but the clones and the resolver calls the dispatcher.
+    F->replaceUsesWithIf(Dispatcher, [&](llvm::Use &U) {
+      auto *Inst = llvm::dyn_cast<llvm::Instruction>(U.getUser());
+      return !Inst || Inst->getFunction() != Resolver;
+    });
+  }
+
+  if (Initialiser)
+    llvm::ReturnInst::Create(Context, &Initialiser->getEntryBlock());
+}
+
+bool AOTCompiler::emit(llvm::StringRef Path) {
+  llvm::Triple T(llvm::sys::getProcessTriple());
+  std::string Error;
+  const llvm::Target *Target =
+      llvm::TargetRegistry::lookupTarget(T.str(), Error);
+  if (!Target) {
+    fprintf(stderr, "Error: %s\n", Error.c_str());
+    return false;
+  }
+
+  std::string CPU = Opts.CPU.empty() ? "generic" : Opts.CPU;
+  std::unique_ptr<llvm::TargetMachine> TM(Target->createTargetMachine(
+      T.str(), CPU, "", Opts.TargetOpts, llvm::Reloc::PIC_));
+  Module->setTargetTriple(T.str());
+  Module->setDataLayout(TM->createDataLayout());
+
+  std::vector<llvm::Function *> Hot;
+  for (llvm::Function &F : *Module)
+    if (shouldMultiversion(F))
+      Hot.push_back(&F);
+  llvm::ArrayRef<ISALevel> Levels = getISALevels(T);
+  if (!Hot.empty() && !Levels.empty())
+    multiversion(Hot, Levels, T);
+
+  if (llvm::verifyModule(*Module, &llvm::errs())) {
+    fprintf(stderr, "Error: object module is broken\n");
+    return false;
+  }
+
+  // Optimise every version for the CPU it is built for.
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassBuilder PB(TM.get());
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  PB.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2)
+      .run(*Module, MAM);
+
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+  if (EC) {
+    fprintf(stderr, "Error: cannot write '%s': %s\n", Path.str().c_str(),
+            EC.message().c_str());
+    return false;
+  }
+
+  llvm::legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM, OS, nullptr,
+                              llvm::CodeGenFileType::ObjectFile)) {
+    fprintf(stderr, "Error: the target can't emit object files\n");
+    return false;
+  }
+  PM.run(*Module);
+  OS.flush();
+
+  fprintf(stderr, "Wrote %s, %zu functions multiversioned for %zu levels\n",
+          Path.str().c_str(), Levels.empty() ? 0 : Hot.size(), Levels.size());
+  return true;
+}
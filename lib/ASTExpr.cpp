@@ -11,12 +11,406 @@
 #include "ASTExpr.h"
 #include "CodeGen.h"
 #include "Logger.h"
+#include "MathBuiltins.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Value.h"
+#include <cstring>
+#include <limits>
+
+llvm::Function *getFunction(CodeGen &CG, std::string Name);
+
+/// The worklist of the outermost releaseChildren on this thread. Destructors
+/// of the nodes it releases append their children to it instead of recursing.
+static thread_local std::vector<std::unique_ptr<ExprAST>> *PendingRelease =
+    nullptr;
+
+void ExprAST::releaseChildren() {
+  if (PendingRelease) {
+    takeChildren(*PendingRelease);
+    return;
+  }
+
+  std::vector<std::unique_ptr<ExprAST>> Worklist;
+  takeChildren(Worklist);
+  PendingRelease = &Worklist;
+  while (!Worklist.empty()) {
+    std::unique_ptr<ExprAST> Node = std::move(Worklist.back());
+    Worklist.pop_back();
+    Node.reset();
+  }
+  PendingRelease = nullptr;
+}
+
+/// Check whether E is integral whenever Var is, walking it without recursion.
+static bool isIntegralGiven(const ExprAST &E, const std::string &Var) {
+  std::vector<const ExprAST *> Worklist = {&E};
+  while (!Worklist.empty()) {
+    const ExprAST *Node = Worklist.back();
+    Worklist.pop_back();
+    if (!Node)
+      continue;
+    if (!Node->keepsIntegral(Var))
+      return false;
+    Node->getChildren(Worklist);
+  }
+  return true;
+}
+
+/// Check whether every value the expressions in Scope assign to Var is
+/// integral as long as Var is, so that Var can be kept in an integer. An
+/// assignment of anything else, such as Var + 0.5, would be truncated.
+/// Assignments to other variables named Var are counted too.
+static bool assignsOnlyIntegers(llvm::ArrayRef<const ExprAST *> Scope,
+                                const std::string &Var) {
+  std::vector<const ExprAST *> Worklist(Scope.begin(), Scope.end());
+  while (!Worklist.empty()) {
+    const ExprAST *Node = Worklist.back();
+    Worklist.pop_back();
+    if (!Node)
+      continue;
+    if (const ExprAST *Value = Node->getAssignedValueOf(Var))
+      if (!isIntegralGiven(*Value, Var))
+        return false;
+    Node->getChildren(Worklist);
+  }
+  return true;
+}
+
+/// Check whether the result of Call is returned unchanged, either by the
+/// return right after it or through the phis of the blocks it branches to.
+static bool isInTailPosition(llvm::CallInst *Call) {
+  llvm::Value *V = Call;
+  llvm::Instruction *I = Call->getNextNode();
+  // Follow at most as many branches as there are blocks, to stop at loops.
+  for (size_t Steps = Call->getFunction()->size(); I; --Steps) {
+    if (auto *Ret = llvm::dyn_cast<llvm::ReturnInst>(I))
+      return Ret->getReturnValue() == V;
+
+    auto *Br = llvm::dyn_cast<llvm::BranchInst>(I);
+    if (!Br || Br->isConditional())
+      return false;
+
+    // Follow V into the phi that receives it in the successor, if any.
+    llvm::BasicBlock *From = Br->getParent();
+    llvm::BasicBlock *To = Br->getSuccessor(0);
+    if (!Steps)
+      return false;
+    llvm::Value *Next = nullptr;
+    for (llvm::PHINode &Phi : To->phis()) {
+      if (Phi.getIncomingValueForBlock(From) != V)
+        continue;
+      if (Next)
+        return false;
+      Next = &Phi;
+    }
+    if (Next)
+      V = Next;
+    I = To->getFirstNonPHI();
+  }
+  return false;
+}
+
+/// Count the self-recursive calls of a function that are in tail position.
+/// Calls that the tail call elimination pass only marked tail, because they
+/// don't access the frame of the caller, are not counted.
+static unsigned countSelfTailCalls(llvm::Function *Function) {
+  unsigned Count = 0;
+  for (auto &BB : *Function)
+    for (auto &I : BB)
+      if (auto *Call = llvm::dyn_cast<llvm::CallInst>(&I))
+        if (Call->getCalledFunction() == Function && isInTailPosition(Call))
+          ++Count;
+  return Count;
+}
+
+/// Upgrade the tail calls that directly feed a return to musttail, so that
+/// the backend guarantees they don't grow the stack. Returns the number of
+/// calls upgraded.
+static unsigned guaranteeTailCalls(llvm::Function *Function) {
+  unsigned Count = 0;
+  for (auto &BB : *Function) {
+    auto *Ret = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator());
+    if (!Ret || Ret == &BB.front())
+      continue;
+
+    auto *Call = llvm::dyn_cast<llvm::CallInst>(Ret->getPrevNode());
+    if (!Call || !Call->isTailCall() || Ret->getReturnValue() != Call)
+      continue;
+
+    // musttail requires the prototypes of caller and callee to match.
+    if (Call->getFunctionType() != Function->getFunctionType() ||
+        Call->getCallingConv() != Function->getCallingConv())
+      continue;
+
+    Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    ++Count;
+  }
+  return Count;
+}
+
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+/// Mark the calls whose result a function lowered through MLIR returns as
+/// tail calls, like markTailPosition does for the ones emitted directly.
+/// Calls only pass numbers, so they never access the frame of the caller.
+static void markTailCalls(llvm::Function *Function) {
+  for (auto &BB : *Function)
+    for (auto &I : BB)
+      if (auto *Call = llvm::dyn_cast<llvm::CallInst>(&I))
+        if (isInTailPosition(Call))
+          Call->setTailCall();
+}
+#endif
+
+/// Create an alloca instruction in the entry block of the function. This is
+/// used for mutable variables etc.
+static llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *Function,
+                                                llvm::StringRef VarName,
+                                                llvm::Type *Ty) {
+  llvm::IRBuilder<> TmpB(&Function->getEntryBlock(),
+                         Function->getEntryBlock().begin());
+  return TmpB.CreateAlloca(Ty, nullptr, VarName);
+}
+
+/// Add the cost of E to Cost. Returns false once the estimate is settled,
+/// because the cost exceeds Limit or something can't be speculated.
+static bool addCost(const ExprAST &E, CodeGen &CG, unsigned Limit,
+                    ExprCost &Cost) {
+  if (!Cost.Speculatable || Cost.Cost > Limit)
+    return false;
+  E.estimateCost(CG, Limit, Cost);
+  return Cost.Speculatable && Cost.Cost <= Limit;
+}
+
+/// Add the cost of the user defined operator Name, which is always inlined
+/// and so costs what its retained body does.
+static bool addOperatorCost(const std::string &Name, CodeGen &CG,
+                            unsigned Limit, ExprCost &Cost) {
+  auto It = CG.ImportableFunctions.find(Name);
+  if (It == CG.ImportableFunctions.end()) {
+    Cost.Speculatable = false;
+    return false;
+  }
+  // Count the operator itself, so that operators defined in terms of
+  // themselves still run into the limit.
+  Cost.Cost += 1;
+  return addCost(It->second->getBody(), CG, Limit, Cost);
+}
+
+void IfExprAST::estimateCost(CodeGen &CG, unsigned Limit,
+                             ExprCost &Cost) const {
+  // Speculated, it selects between both of its arms.
+  Cost.Cost += 1;
+  addCost(*Cond, CG, Limit, Cost) && addCost(*Then, CG, Limit, Cost) &&
+      addCost(*Else, CG, Limit, Cost);
+}
+
+void VarExprAST::estimateCost(CodeGen &CG, unsigned Limit,
+                              ExprCost &Cost) const {
+  // The variables live in registers once promoted.
+  for (const VarBinding &Binding : VarNames)
+    if (Binding.Init && !addCost(*Binding.Init, CG, Limit, Cost))
+      return;
+  addCost(*Body, CG, Limit, Cost);
+}
+
+void UnaryExprAST::estimateCost(CodeGen &CG, unsigned Limit,
+                                ExprCost &Cost) const {
+  addOperatorCost(std::string("unary") + Opcode, CG, Limit, Cost) &&
+      addCost(*Operand, CG, Limit, Cost);
+}
+
+void BinaryExprAST::estimateCost(CodeGen &CG, unsigned Limit,
+                                 ExprCost &Cost) const {
+  switch (Op) {
+  case '=':
+    // Assignments are side effects, even to variables of the arm itself.
+    Cost.Speculatable = false;
+    return;
+  case '+':
+  case '-':
+  case '<':
+    Cost.Cost += 1;
+    break;
+  case '*':
+    Cost.Cost += 2;
+    break;
+  case '/':
+    // Division is always in floating point, so it can't trap.
+    Cost.Cost += 4;
+    break;
+  default:
+    if (!addOperatorCost(std::string("binary") + Op, CG, Limit, Cost))
+      return;
+    break;
+  }
+  addCost(*LHS, CG, Limit, Cost) && addCost(*RHS, CG, Limit, Cost);
+}
+
+void CallExprAST::estimateCost(CodeGen &CG, unsigned Limit,
+                               ExprCost &Cost) const {
+  // Only the math builtins are known to be free of side effects.
+  auto ID = MathBuiltins::lookup(Callee, Args.size());
+  if (!ID || CG.Definitions.count(Callee)) {
+    Cost.Speculatable = false;
+    return;
+  }
+  Cost.Cost += MathBuiltins::getCost(*ID);
+  for (const auto &Arg : Args)
+    if (!addCost(*Arg, CG, Limit, Cost))
+      return;
+}
+
+void StructuralKey::add(const ExprAST &E) {
+  if (!Valid)
+    return;
+  if (++Depth > MaxDepth)
+    Valid = false;
+  else
+    E.profile(*this);
+  --Depth;
+}
+
+void StructuralKey::addName(const std::string &Name) {
+  Key += std::to_string(Name.size());
+  Key += ':';
+  Key += Name;
+}
+
+void StructuralKey::addNumber(double Val) {
+  // The bits tell apart what == doesn't, such as 0.0 and -0.0.
+  uint64_t Bits;
+  memcpy(&Bits, &Val, sizeof(Bits));
+  Key += std::to_string(Bits);
+  Key += ';';
+}
+
+void StructuralKey::addType(std::optional<ValueType> Type) {
+  Key += Type ? static_cast<char>('0' + static_cast<int>(*Type)) : '-';
+}
+
+void StructuralKey::addVariable(const std::string &Name) {
+  // Bound variables are numbered from the outermost, so the same binding
+  // gets the same number whatever it is called.
+  for (size_t I = Scope.size(); I--;) {
+    if (Scope[I] == Name) {
+      Key += 'v';
+      Key += std::to_string(I);
+      Key += ';';
+      return;
+    }
+  }
+  Key += 'g';
+  addName(Name);
+}
+
+void StructuralKey::addCallee(const std::string &Name) {
+  if (Name == Self) {
+    Key += '@';
+    return;
+  }
+  addName(Name);
+}
+
+void ExprAST::profile(StructuralKey &Key) const { Key.invalidate(); }
+
+void NumberExprAST::profile(StructuralKey &Key) const {
+  Key.addTag('n');
+  Key.addNumber(Val);
+}
+
+void VariableExprAST::profile(StructuralKey &Key) const {
+  Key.addVariable(Name);
+}
+
+void IfExprAST::profile(StructuralKey &Key) const {
+  Key.addTag('i');
+  Key.add(*Cond);
+  Key.add(*Then);
+  Key.add(*Else);
+}
+
+void ForExprAST::profile(StructuralKey &Key) const {
+  // Only the start is evaluated without the variable in scope.
+  Key.addTag('f');
+  Key.add(*Start);
+  Key.bind(VarName);
+  Key.add(*End);
+  if (Step)
+    Key.add(*Step);
+  else
+    Key.addTag('-');
+  Key.add(*Body);
+  Key.unbind();
+}
+
+void ReduceExprAST::profile(StructuralKey &Key) const {
+  Key.addTag('r');
+  Key.addNumber(Kind);
+  Key.add(*Start);
+  Key.bind(VarName);
+  Key.add(*End);
+  if (Step)
+    Key.add(*Step);
+  else
+    Key.addTag('-');
+  Key.add(*Body);
+  Key.unbind();
+}
+
+void VarExprAST::profile(StructuralKey &Key) const {
+  // Each initializer sees the variables bound before it.
+  Key.addTag('l');
+  Key.addNumber(VarNames.size());
+  for (const VarBinding &Binding : VarNames) {
+    Key.addType(Binding.Type);
+    if (Binding.Init)
+      Key.add(*Binding.Init);
+    else
+      Key.addTag('-');
+    Key.bind(Binding.Name);
+  }
+  Key.add(*Body);
+  Key.unbind(VarNames.size());
+}
+
+void UnaryExprAST::profile(StructuralKey &Key) const {
+  Key.addTag('u');
+  Key.addTag(Opcode);
+  Key.add(*Operand);
+}
+
+void BinaryExprAST::profile(StructuralKey &Key) const {
+  Key.addTag('b');
+  Key.addTag(Op);
+  Key.add(*LHS);
+  Key.add(*RHS);
+}
+
+void CallExprAST::profile(StructuralKey &Key) const {
+  Key.addTag('c');
+  Key.addCallee(Callee);
+  for (const auto &Arg : Args)
+    Key.add(*Arg);
+  Key.addTag(')');
+}
+
+void SpawnExprAST::profile(StructuralKey &Key) const {
+  Key.addTag('s');
+  Key.addCallee(Callee);
+  for (const auto &Arg : Args)
+    Key.add(*Arg);
+  Key.addTag(')');
+}
+
+void AwaitExprAST::profile(StructuralKey &Key) const {
+  Key.addTag('a');
+  Key.add(*Future);
+}
 
 llvm::Value *NumberExprAST::codegen(CodeGen &CG) {
   return llvm::ConstantFP::get(*CG.Context, llvm::APFloat(Val));
@@ -24,10 +418,12 @@ llvm::Value *NumberExprAST::codegen(CodeGen &CG) {
 
 llvm::Value *VariableExprAST::codegen(CodeGen &CG) {
   // Lookup variable in the function.
-  llvm::Value *V = CG.NamedValues[Name];
-  if (!V)
+  llvm::AllocaInst *A = CG.NamedValues[Name];
+  if (!A)
     return Logger::LogErrorV("Unknown variable name");
-  return V;
+
+  // Load the value.
+  return CG.Builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
 }
 
 llvm::Value *IfExprAST::codegen(CodeGen &CG) {
@@ -35,11 +431,48 @@ llvm::Value *IfExprAST::codegen(CodeGen &CG) {
   if (!CondV)
     return nullptr;
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  CondV = CG.Builder->CreateFCmpONE(
-      CondV, llvm::ConstantFP::get(*CG.Context, llvm::APFloat(0.0)), "ifcond");
+  // Convert condition to a bool by comparing non-equal to zero.
+  CondV = CG.CreateCast(CondV, llvm::Type::getInt1Ty(*CG.Context));
   llvm::Function *Function = CG.Builder->GetInsertBlock()->getParent();
 
+  // Evaluate both arms and select between them when they are cheap and safe
+  // to evaluate either way, rather than branch on a condition that may be
+  // hard to predict.
+  unsigned Limit = CG.Opts.SelectCostThreshold;
+  ExprCost ThenCost, ElseCost;
+  addCost(*Then, CG, Limit, ThenCost);
+  addCost(*Else, CG, Limit, ElseCost);
+  bool Speculatable = ThenCost.Speculatable && ElseCost.Speculatable;
+  bool Select = Speculatable && ThenCost.Cost + ElseCost.Cost <= Limit;
+
+  if (CG.Opts.ReportSelects) {
+    std::string FnName = Function->getName().str();
+    FILE *Stream = Logger::getStream();
+    if (Select)
+      fprintf(Stream, "If in %s lowered to select, arms cost %u\n",
+              FnName.c_str(), ThenCost.Cost + ElseCost.Cost);
+    else if (!Speculatable)
+      fprintf(Stream,
+              "If in %s kept as branch, %s arm may have side effects\n",
+              FnName.c_str(), ThenCost.Speculatable ? "else" : "then");
+    else
+      fprintf(Stream, "If in %s kept as branch, arms cost more than %u\n",
+              FnName.c_str(), Limit);
+  }
+
+  if (Select) {
+    llvm::Value *ThenV = Then->codegen(CG);
+    if (!ThenV)
+      return nullptr;
+    llvm::Value *ElseV = Else->codegen(CG);
+    if (!ElseV)
+      return nullptr;
+
+    llvm::Type *Ty = CG.getCommonType(ThenV, ElseV);
+    return CG.Builder->CreateSelect(CondV, CG.CreateCast(ThenV, Ty),
+                                    CG.CreateCast(ElseV, Ty), "iftmp");
+  }
+
   // Create blocks for the then and else cases. Insert the 'then' block at the
   // end of the function.
   llvm::BasicBlock *ThenBB =
@@ -56,9 +489,9 @@ llvm::Value *IfExprAST::codegen(CodeGen &CG) {
   if (!ThenV)
     return nullptr;
 
-  CG.Builder->CreateBr(MergeBB);
   // Codegen of 'Then' can change the current block, update the ThenBB for the
-  // PHI.
+  // PHI. Its branch to the merge block is emitted once the type of the result
+  // is known.
   ThenBB = CG.Builder->GetInsertBlock();
 
   Function->insert(Function->end(), ElseBB);
@@ -68,16 +501,22 @@ llvm::Value *IfExprAST::codegen(CodeGen &CG) {
   if (!ElseV)
     return nullptr;
 
+  // Both arms are converted to a common type at the end of their block.
+  llvm::Type *Ty = CG.getCommonType(ThenV, ElseV);
+  ElseV = CG.CreateCast(ElseV, Ty);
   CG.Builder->CreateBr(MergeBB);
   // Codegen of 'Else' can change the current block, update the ElseBB for the
   // PHI.
   ElseBB = CG.Builder->GetInsertBlock();
 
+  CG.Builder->SetInsertPoint(ThenBB);
+  ThenV = CG.CreateCast(ThenV, Ty);
+  CG.Builder->CreateBr(MergeBB);
+
   // Emit merge block.
   Function->insert(Function->end(), MergeBB);
   CG.Builder->SetInsertPoint(MergeBB);
-  llvm::PHINode *PN =
-      CG.Builder->CreatePHI(llvm::Type::getDoubleTy(*CG.Context), 2, "iftmp");
+  llvm::PHINode *PN = CG.Builder->CreatePHI(Ty, 2, "iftmp");
 
   PN->addIncoming(ThenV, ThenBB);
   PN->addIncoming(ElseV, ElseBB);
@@ -85,15 +524,34 @@ llvm::Value *IfExprAST::codegen(CodeGen &CG) {
 }
 
 llvm::Value *ForExprAST::codegen(CodeGen &CG) {
+  llvm::Function *Function = CG.Builder->GetInsertBlock()->getParent();
+
   // Emit the start code first, without 'variable' in scope.
   llvm::Value *StartV = Start->codegen(CG);
   if (!StartV)
     return nullptr;
 
+  // Count with an integer when the variable only ever takes integral values,
+  // that is when it starts at an integer, steps by an integer literal and
+  // is assigned nothing but integers.
+  llvm::Type *VarTy = StartV->getType();
+  llvm::Type *IntTy = llvm::Type::getInt64Ty(*CG.Context);
+  bool IntegralStep = !Step || Step->isIntegerLiteral();
+  bool IntegralStart = VarTy->isIntegerTy() || Start->isIntegerLiteral();
+  if (IntegralStep && IntegralStart &&
+      assignsOnlyIntegers({End.get(), Step.get(), Body.get()}, VarName))
+    VarTy = IntTy;
+  else
+    VarTy = llvm::Type::getDoubleTy(*CG.Context);
+  StartV = CG.CreateCast(StartV, VarTy);
+
+  // Create an alloca for the variable in the entry block, and store the
+  // start value into it.
+  llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(Function, VarName, VarTy);
+  CG.Builder->CreateStore(StartV, Alloca);
+
   // Make the new basic block for the loop header, inserting after current
   // block.
-  llvm::Function *Function = CG.Builder->GetInsertBlock()->getParent();
-  llvm::BasicBlock *PreheaderBB = CG.Builder->GetInsertBlock();
   llvm::BasicBlock *LoopBB =
       llvm::BasicBlock::Create(*CG.Context, "loop", Function);
 
@@ -103,14 +561,9 @@ llvm::Value *ForExprAST::codegen(CodeGen &CG) {
   // Start insertion in LoopBB.
   CG.Builder->SetInsertPoint(LoopBB);
 
-  // PHI node with an entry for Start.
-  llvm::PHINode *Variable =
-      CG.Builder->CreatePHI(llvm::Type::getDoubleTy(*CG.Context), 2, VarName);
-  Variable->addIncoming(StartV, PreheaderBB);
-
   // Restore any shadowed existing variable within the loop.
-  llvm::Value *OldVal = CG.NamedValues[VarName];
-  CG.NamedValues[VarName] = Variable;
+  llvm::AllocaInst *OldVal = CG.NamedValues[VarName];
+  CG.NamedValues[VarName] = Alloca;
 
   // Emit body of the loop, ignoring value computed by it.
   if (!Body->codegen(CG))
@@ -120,39 +573,42 @@ llvm::Value *ForExprAST::codegen(CodeGen &CG) {
   llvm::Value *StepV = nullptr;
   if (Step) {
     StepV = Step->codegen(CG);
-    if (StepV)
+    if (!StepV)
       return nullptr;
   } else {
     // Default to using 1.0.
     StepV = llvm::ConstantFP::get(*CG.Context, llvm::APFloat(1.0));
   }
-
-  llvm::Value *NextVar = CG.Builder->CreateFAdd(Variable, StepV, "nextvar");
+  StepV = CG.CreateCast(StepV, VarTy);
 
   // Compute the end condition.
   llvm::Value *EndCond = End->codegen(CG);
   if (!EndCond)
     return nullptr;
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  EndCond = CG.Builder->CreateFCmpONE(
-      EndCond, llvm::ConstantFP::get(*CG.Context, llvm::APFloat(0.0)),
-      "loopcond");
+  // Reload, increment, and restore the alloca. This handles the case where
+  // the body of the loop mutates the variable.
+  llvm::Value *CurVar = CG.Builder->CreateLoad(Alloca->getAllocatedType(),
+                                               Alloca, VarName.c_str());
+  llvm::Value *NextVar =
+      VarTy->isIntegerTy()
+          ? CG.Builder->CreateNSWAdd(CurVar, StepV, "nextvar")
+          : CG.Builder->CreateFAdd(CurVar, StepV, "nextvar");
+  CG.Builder->CreateStore(NextVar, Alloca);
+
+  // Convert condition to a bool by comparing non-equal to zero.
+  EndCond = CG.CreateCast(EndCond, llvm::Type::getInt1Ty(*CG.Context));
 
   // Create the "after loop" block and insert it.
-  llvm::BasicBlock *LoopEndBB = CG.Builder->GetInsertBlock();
   llvm::BasicBlock *AfterBB =
       llvm::BasicBlock::Create(*CG.Context, "afterloop", Function);
 
-  // Insert conditional branch into the end of LoopEndBB.
+  // Insert conditional branch into the end of the loop.
   CG.Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
 
   // Any new code will be inserted in AfterBB.
   CG.Builder->SetInsertPoint(AfterBB);
 
-  // Add a new entry to the PHI node for the backedge.
-  Variable->addIncoming(NextVar, LoopEndBB);
-
   // Restore the unshadowed variable.
   if (OldVal)
     CG.NamedValues[VarName] = OldVal;
@@ -163,27 +619,470 @@ llvm::Value *ForExprAST::codegen(CodeGen &CG) {
   return llvm::Constant::getNullValue(llvm::Type::getDoubleTy((*CG.Context)));
 }
 
+std::optional<ReduceExprAST::ReduceKind>
+ReduceExprAST::getKind(const std::string &Name) {
+  if (Name == "sum")
+    return Sum;
+  if (Name == "prod")
+    return Prod;
+  if (Name == "min")
+    return Min;
+  if (Name == "max")
+    return Max;
+  return std::nullopt;
+}
+
+llvm::Value *ReduceExprAST::codegen(CodeGen &CG) {
+  llvm::Value *StartV = Start->codegen(CG);
+  if (!StartV)
+    return nullptr;
+
+  // Count with an integer under the same conditions as for.
+  llvm::Type *VarTy = StartV->getType();
+  bool IntegralStep = !Step || Step->isIntegerLiteral();
+  bool IntegralStart = VarTy->isIntegerTy() || Start->isIntegerLiteral();
+  if (IntegralStep && IntegralStart &&
+      assignsOnlyIntegers({End.get(), Step.get(), Body.get()}, VarName))
+    VarTy = llvm::Type::getInt64Ty(*CG.Context);
+  else
+    VarTy = llvm::Type::getDoubleTy(*CG.Context);
+  StartV = CG.CreateCast(StartV, VarTy);
+
+  llvm::Value *Result;
+  if (CG.Opts.ParallelReduceMin && VarTy->isIntegerTy() &&
+      emitParallel(CG, StartV, Result))
+    return Result;
+  return emitLoop(CG, StartV, VarTy, nullptr);
+}
+
+/// Get the first integer the counted variable of a reduction can't reach
+/// while it is below BoundV, so that the loop compares integers and its trip
+/// count is known to the vectoriser.
+static llvm::Value *emitLimit(CodeGen &CG, llvm::Value *BoundV) {
+  llvm::Type *IntTy = CG.Builder->getInt64Ty();
+  if (!BoundV->getType()->isFloatingPointTy())
+    return CG.CreateCast(BoundV, IntTy);
+
+  // The condition compares unordered, so Var < NaN holds like it does in
+  // for, and a NaN bound is above any variable like an infinite one.
+  llvm::Value *Ceil = CG.Builder->CreateUnaryIntrinsic(llvm::Intrinsic::ceil,
+                                                       BoundV, nullptr, "ceil");
+  llvm::Value *Limit = CG.Builder->CreateIntrinsic(
+      llvm::Intrinsic::fptosi_sat, {IntTy, BoundV->getType()}, {Ceil},
+      nullptr, "limit");
+  llvm::Value *IsNaN = CG.Builder->CreateFCmpUNO(BoundV, BoundV, "isnan");
+  return CG.Builder->CreateSelect(
+      IsNaN,
+      llvm::ConstantInt::get(IntTy, std::numeric_limits<int64_t>::max()),
+      Limit);
+}
+
+llvm::Value *ReduceExprAST::combine(CodeGen &CG, llvm::Value *Acc,
+                                    llvm::Value *V) {
+  llvm::Value *Combined;
+  switch (Kind) {
+  case Sum:
+    Combined = CG.Builder->CreateFAdd(Acc, V, "sumtmp");
+    break;
+  case Prod:
+    Combined = CG.Builder->CreateFMul(Acc, V, "prodtmp");
+    break;
+  case Min:
+    return CG.Builder->CreateMinimum(Acc, V, "mintmp");
+  case Max:
+    return CG.Builder->CreateMaximum(Acc, V, "maxtmp");
+  }
+
+  // The order values are combined in is unspecified, which lets the loop
+  // keep several partial sums or products, in vector lanes or not.
+  if (auto *I = llvm::dyn_cast<llvm::Instruction>(Combined))
+    I->setHasAllowReassoc(true);
+  return Combined;
+}
+
+llvm::Value *ReduceExprAST::emitLoop(CodeGen &CG, llvm::Value *StartV,
+                                     llvm::Type *VarTy, llvm::Value *Limit,
+                                     bool *AssignsVar) {
+  llvm::Function *Function = CG.Builder->GetInsertBlock()->getParent();
+  llvm::Type *DoubleTy = CG.Builder->getDoubleTy();
+
+  llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(Function, VarName, VarTy);
+  llvm::StoreInst *StartStore = CG.Builder->CreateStore(StartV, Alloca);
+
+  // min starts from +inf and max from -inf, so that they are their own
+  // identities like sum and prod.
+  double Identity = 0;
+  switch (Kind) {
+  case Sum:
+    Identity = 0;
+    break;
+  case Prod:
+    Identity = 1;
+    break;
+  case Min:
+    Identity = INFINITY;
+    break;
+  case Max:
+    Identity = -INFINITY;
+    break;
+  }
+  llvm::AllocaInst *Acc = CreateEntryBlockAlloca(Function, "acc", DoubleTy);
+  CG.Builder->CreateStore(llvm::ConstantFP::get(DoubleTy, Identity), Acc);
+
+  llvm::BasicBlock *CondBB =
+      llvm::BasicBlock::Create(*CG.Context, "reducecond", Function);
+  llvm::BasicBlock *BodyBB =
+      llvm::BasicBlock::Create(*CG.Context, "reducebody", Function);
+  llvm::BasicBlock *AfterBB =
+      llvm::BasicBlock::Create(*CG.Context, "afterreduce", Function);
+  CG.Builder->CreateBr(CondBB);
+  CG.Builder->SetInsertPoint(CondBB);
+
+  // Restore any shadowed existing variable after the loop.
+  llvm::AllocaInst *OldVal = CG.NamedValues[VarName];
+  CG.NamedValues[VarName] = Alloca;
+
+  // A counted condition, Var < Bound, compares integers when the variable
+  // is one.
+  llvm::Value *Cond;
+  ExprAST *Bound = getBound();
+  if (!Limit && VarTy->isIntegerTy() && Bound) {
+    llvm::Value *BoundV = Bound->codegen(CG);
+    if (!BoundV)
+      return nullptr;
+    Limit = emitLimit(CG, BoundV);
+  }
+  if (Limit) {
+    llvm::Value *CurVar = CG.Builder->CreateLoad(VarTy, Alloca, VarName);
+    Cond = CG.Builder->CreateICmpSLT(CurVar, Limit, "reducecond");
+  } else {
+    Cond = End->codegen(CG);
+    if (!Cond)
+      return nullptr;
+    Cond = CG.CreateCast(Cond, llvm::Type::getInt1Ty(*CG.Context));
+  }
+  CG.Builder->CreateCondBr(Cond, BodyBB, AfterBB);
+
+  CG.Builder->SetInsertPoint(BodyBB);
+  llvm::Value *BodyV = Body->codegen(CG);
+  if (!BodyV)
+    return nullptr;
+  llvm::Value *AccV = CG.Builder->CreateLoad(DoubleTy, Acc, "acc");
+  CG.Builder->CreateStore(combine(CG, AccV, CG.CreateCast(BodyV, DoubleTy)),
+                          Acc);
+
+  // Step the variable as for does, defaulting to 1.0.
+  llvm::Value *StepV = nullptr;
+  if (Step) {
+    StepV = Step->codegen(CG);
+    if (!StepV)
+      return nullptr;
+  } else {
+    StepV = llvm::ConstantFP::get(*CG.Context, llvm::APFloat(1.0));
+  }
+  StepV = CG.CreateCast(StepV, VarTy);
+  llvm::Value *CurVar = CG.Builder->CreateLoad(VarTy, Alloca, VarName);
+  llvm::Value *NextVar =
+      VarTy->isIntegerTy()
+          ? CG.Builder->CreateNSWAdd(CurVar, StepV, "nextvar")
+          : CG.Builder->CreateFAdd(CurVar, StepV, "nextvar");
+  llvm::StoreInst *StepStore = CG.Builder->CreateStore(NextVar, Alloca);
+  CG.Builder->CreateBr(CondBB);
+
+  // Any other store to the variable comes from the body.
+  if (AssignsVar)
+    *AssignsVar = llvm::any_of(Alloca->users(), [&](llvm::User *U) {
+      return llvm::isa<llvm::StoreInst>(U) && U != StartStore &&
+             U != StepStore;
+    });
+
+  CG.Builder->SetInsertPoint(AfterBB);
+  if (OldVal)
+    CG.NamedValues[VarName] = OldVal;
+  else
+    CG.NamedValues.erase(VarName);
+
+  return CG.Builder->CreateLoad(DoubleTy, Acc, "reduced");
+}
+
+bool ReduceExprAST::emitParallel(CodeGen &CG, llvm::Value *StartV,
+                                 llvm::Value *&Result) {
+  // Only counted reductions are split: the variable steps by a positive
+  // literal while below a literal or a variable, which is read once.
+  ExprAST *Bound = getBound();
+  if (!Bound || (Step && !Step->isIntegerLiteral()))
+    return false;
+  int64_t StepV = Step ? *Step->getLiteralValue() : 1;
+  const std::string *BoundVar = Bound->getAssignableName();
+  if (StepV <= 0 || (!Bound->getLiteralValue() && !BoundVar) ||
+      (BoundVar && *BoundVar == VarName))
+    return false;
+
+  llvm::Function *Parent = CG.Builder->GetInsertBlock()->getParent();
+  llvm::Type *IntTy = CG.Builder->getInt64Ty();
+  llvm::Type *PtrTy = CG.Builder->getPtrTy();
+
+  // Tasks get a copy of every variable in scope.
+  std::vector<std::pair<std::string, llvm::AllocaInst *>> Captured;
+  std::vector<llvm::Type *> CapturedTypes;
+  for (const auto &[Name, Alloca] : CG.NamedValues) {
+    if (!Alloca || Name == VarName)
+      continue;
+    Captured.emplace_back(Name, Alloca);
+    CapturedTypes.push_back(Alloca->getAllocatedType());
+  }
+  llvm::StructType *EnvTy = llvm::StructType::get(*CG.Context, CapturedTypes);
+
+  // The chunk function runs the loop from First below Last.
+  llvm::Function *Chunk = llvm::Function::Create(
+      llvm::FunctionType::get(CG.Builder->getDoubleTy(),
+                              {PtrTy, IntTy, IntTy}, false),
+      llvm::Function::InternalLinkage, Parent->getName() + ".reduce",
+      CG.Module.get());
+  Chunk->addFnAttrs(
+      llvm::AttrBuilder(*CG.Context, Parent->getAttributes().getFnAttrs()));
+  Chunk->removeFnAttr(llvm::Attribute::AlwaysInline);
+
+  bool Assigns = false;
+  {
+    llvm::IRBuilderBase::InsertPointGuard Guard(*CG.Builder);
+    auto ParentNamedValues = std::move(CG.NamedValues);
+    CG.NamedValues.clear();
+
+    CG.Builder->SetInsertPoint(
+        llvm::BasicBlock::Create(*CG.Context, "entry", Chunk));
+    llvm::Value *Env = Chunk->getArg(0);
+    std::vector<llvm::AllocaInst *> Copies;
+    for (unsigned I = 0, E = Captured.size(); I != E; ++I) {
+      llvm::AllocaInst *Copy = CreateEntryBlockAlloca(
+          Chunk, Captured[I].first, CapturedTypes[I]);
+      CG.Builder->CreateStore(
+          CG.Builder->CreateLoad(CapturedTypes[I],
+                                 CG.Builder->CreateStructGEP(EnvTy, Env, I)),
+          Copy);
+      CG.NamedValues[Captured[I].first] = Copy;
+      Copies.push_back(Copy);
+    }
+
+    // Assignments to the copies would be lost, and assignments to the
+    // variable would move it across chunks, such bodies stay sequential.
+    Result =
+        emitLoop(CG, Chunk->getArg(1), IntTy, Chunk->getArg(2), &Assigns);
+    if (Result)
+      CG.Builder->CreateRet(Result);
+
+    for (llvm::AllocaInst *Copy : Copies)
+      for (llvm::User *U : Copy->users())
+        if (auto *Store = llvm::dyn_cast<llvm::StoreInst>(U))
+          Assigns |= Store->getPointerOperand() == Copy &&
+                     Store->getParent() != &Chunk->getEntryBlock();
+
+    // So do bodies with other side effects, such as printing, which must
+    // happen in order.
+    Assigns |= !CG.callsOnlyPureFunctions(*Chunk);
+
+    CG.NamedValues = std::move(ParentNamedValues);
+  }
+
+  // Errors in the body have been reported already. A body that assigns or
+  // has side effects is emitted again into the parent.
+  if (!Result || Assigns) {
+    Chunk->eraseFromParent();
+    return !Result;
+  }
+
+  llvm::Value *BoundV = Bound->codegen(CG);
+  if (!BoundV) {
+    Result = nullptr;
+    return true;
+  }
+  llvm::Value *Limit = emitLimit(CG, BoundV);
+
+  llvm::AllocaInst *Env = CreateEntryBlockAlloca(Parent, "reduceenv", EnvTy);
+  for (unsigned I = 0, E = Captured.size(); I != E; ++I)
+    CG.Builder->CreateStore(
+        CG.Builder->CreateLoad(CapturedTypes[I], Captured[I].second),
+        CG.Builder->CreateStructGEP(EnvTy, Env, I));
+
+  llvm::FunctionCallee Reduce = CG.Module->getOrInsertFunction(
+      "kal_parallel_reduce", CG.Builder->getDoubleTy(), PtrTy, PtrTy, IntTy,
+      IntTy, IntTy, CG.Builder->getInt32Ty(), IntTy);
+  Result = CG.Builder->CreateCall(
+      Reduce,
+      {Chunk, Env, StartV, Limit, llvm::ConstantInt::get(IntTy, StepV),
+       CG.Builder->getInt32(Kind),
+       llvm::ConstantInt::get(IntTy, CG.Opts.ParallelReduceMin)},
+      "reduced");
+  return true;
+}
+
+llvm::Value *VarExprAST::codegen(CodeGen &CG) {
+  std::vector<llvm::AllocaInst *> OldBindings;
+
+  llvm::Function *Function = CG.Builder->GetInsertBlock()->getParent();
+
+  // Register all variables and emit their initializer.
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    const std::string &VarName = VarNames[i].Name;
+    ExprAST *Init = VarNames[i].Init.get();
+
+    // Emit the initializer before adding the variable to scope, this prevents
+    // the initializer from referencing the variable itself, and permits stuff
+    // like this:
+    //  var a = 1 in
+    //    var a = a in ...   # refers to outer 'a'.
+    llvm::Value *InitVal;
+    if (Init) {
+      InitVal = Init->codegen(CG);
+      if (!InitVal)
+        return nullptr;
+    } else { // If not specified, use 0.0.
+      InitVal = llvm::ConstantFP::get(*CG.Context, llvm::APFloat(0.0));
+    }
+
+    // Without an annotation the variable takes the type of its initializer,
+    // unless that is an integer and the variable may be assigned fractions,
+    // by the body or the initializers after its own.
+    llvm::Type *VarTy = InitVal->getType();
+    if (VarNames[i].Type) {
+      VarTy = CG.getType(*VarNames[i].Type);
+    } else if (VarTy->isIntegerTy()) {
+      std::vector<const ExprAST *> Scope = {Body.get()};
+      for (unsigned j = i + 1; j != e; ++j)
+        Scope.push_back(VarNames[j].Init.get());
+      if (!assignsOnlyIntegers(Scope, VarName))
+        VarTy = llvm::Type::getDoubleTy(*CG.Context);
+    }
+    InitVal = CG.CreateCast(InitVal, VarTy);
+
+    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(Function, VarName, VarTy);
+    CG.Builder->CreateStore(InitVal, Alloca);
+
+    // Remember the old variable binding so that we can restore the binding
+    // when we unrecurse.
+    OldBindings.push_back(CG.NamedValues[VarName]);
+
+    // Remember this binding.
+    CG.NamedValues[VarName] = Alloca;
+  }
+
+  // Codegen the body, now that all vars are in scope.
+  llvm::Value *BodyVal = Body->codegen(CG);
+  if (!BodyVal)
+    return nullptr;
+
+  // Pop all our variables from scope.
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
+    CG.NamedValues[VarNames[i].Name] = OldBindings[i];
+
+  // Return the body computation.
+  return BodyVal;
+}
+
+llvm::Value *UnaryExprAST::codegen(CodeGen &CG) {
+  llvm::Value *OperandV = Operand->codegen(CG);
+  if (!OperandV)
+    return nullptr;
+
+  llvm::Function *F = getFunction(CG, std::string("unary") + Opcode);
+  if (!F)
+    return Logger::LogErrorV("Unknown unary operator");
+
+  OperandV = CG.CreateCast(OperandV, F->getFunctionType()->getParamType(0));
+  return CG.Builder->CreateCall(F, OperandV, "unop");
+}
+
 llvm::Value *BinaryExprAST::codegen(CodeGen &CG) {
-  llvm::Value *L = LHS->codegen(CG);
-  llvm::Value *R = RHS->codegen(CG);
-  if (!L || !R)
+  // Special case '=' because we don't want to emit the LHS as an expression.
+  if (Op == '=') {
+    const std::string *Name = LHS->getAssignableName();
+    if (!Name)
+      return Logger::LogErrorV("destination of '=' must be a variable");
+
+    // Codegen the RHS.
+    llvm::Value *Val = RHS->codegen(CG);
+    if (!Val)
+      return nullptr;
+
+    // Look up the name.
+    llvm::AllocaInst *Variable = CG.NamedValues[*Name];
+    if (!Variable)
+      return Logger::LogErrorV("Unknown variable name");
+
+    Val = CG.CreateCast(Val, Variable->getAllocatedType());
+    CG.Builder->CreateStore(Val, Variable);
+    return Val;
+  }
+
+  // Emit the operators of a chain bottom up from its leftmost operand,
+  // rather than recursing down the left operands.
+  std::vector<const BinaryExprAST *> Spine = getLeftSpine();
+  llvm::Value *L = Spine.back()->LHS->codegen(CG);
+  if (!L)
     return nullptr;
+  for (auto I = Spine.rbegin(), E = Spine.rend(); I != E; ++I) {
+    llvm::Value *R = (*I)->RHS->codegen(CG);
+    if (!R)
+      return nullptr;
+    L = (*I)->emitOperator(CG, L, R);
+    if (!L)
+      return nullptr;
+  }
+  return L;
+}
+
+llvm::Value *BinaryExprAST::emitOperator(CodeGen &CG, llvm::Value *L,
+                                         llvm::Value *R) const {
+  // Builtin operators work on the common type of their operands, except for
+  // division which always divides in floating point.
+  llvm::Type *Ty = CG.getCommonType(L, R);
+  if (Op == '/' && Ty->isIntegerTy())
+    Ty = llvm::Type::getDoubleTy(*CG.Context);
+  bool IsFP = Ty->isFloatingPointTy();
 
   switch (Op) {
   case '+':
-    return CG.Builder->CreateFAdd(L, R, "addtmp");
   case '-':
-    return CG.Builder->CreateFSub(L, R, "subtmp");
   case '*':
-    return CG.Builder->CreateFMul(L, R, "multmp");
+  case '/':
   case '<':
-    L = CG.Builder->CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0/1.0
-    return CG.Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*CG.Context),
-                                    "booltmp");
+    L = CG.CreateCast(L, Ty);
+    R = CG.CreateCast(R, Ty);
+    break;
   default:
-    return Logger::LogErrorV("invalid binary operator");
+    break;
   }
+
+  switch (Op) {
+  case '+':
+    return IsFP ? CG.Builder->CreateFAdd(L, R, "addtmp")
+                : CG.Builder->CreateNSWAdd(L, R, "addtmp");
+  case '-':
+    return IsFP ? CG.Builder->CreateFSub(L, R, "subtmp")
+                : CG.Builder->CreateNSWSub(L, R, "subtmp");
+  case '*':
+    return IsFP ? CG.Builder->CreateFMul(L, R, "multmp")
+                : CG.Builder->CreateNSWMul(L, R, "multmp");
+  case '/':
+    return CG.Builder->CreateFDiv(L, R, "divtmp");
+  case '<':
+    // Comparisons produce a bool, converted by the context that uses it.
+    return IsFP ? CG.Builder->CreateFCmpULT(L, R, "cmptmp")
+                : CG.Builder->CreateICmpSLT(L, R, "cmptmp");
+  default:
+    break;
+  }
+
+  // If it wasn't a builtin binary operator, it must be a user defined one.
+  // Emit a call to it, its body is inlined once the module is optimised.
+  llvm::Function *F = getFunction(CG, std::string("binary") + Op);
+  if (!F)
+    return Logger::LogErrorV("invalid binary operator");
+
+  llvm::FunctionType *FT = F->getFunctionType();
+  llvm::Value *Ops[] = {CG.CreateCast(L, FT->getParamType(0)),
+                        CG.CreateCast(R, FT->getParamType(1))};
+  return CG.Builder->CreateCall(F, Ops, "binop");
 }
 
 llvm::Function *getFunction(CodeGen &CG, std::string Name) {
@@ -191,6 +1090,10 @@ llvm::Function *getFunction(CodeGen &CG, std::string Name) {
   if (auto *F = CG.Module->getFunction(Name))
     return F;
 
+  // If a body was retained for import, make it available for inlining.
+  if (CG.shouldImport(Name))
+    return CG.ImportableFunctions[Name]->codegenImport(CG);
+
   // If not, check if there is an existing prototype.
   auto FI = CG.FunctionProtos.find(Name);
   if (FI != CG.FunctionProtos.end())
@@ -204,6 +1107,8 @@ llvm::Value *CallExprAST::codegen(CodeGen &CG) {
   llvm::Function *CalleeF = getFunction(CG, Callee);
   if (!CalleeF)
     return Logger::LogErrorV("Unknown function referenced");
+  ++CG.CallSiteCounts[Callee];
+  CG.RecordCall(Callee);
 
   // If argument mismatch error.
   if (CalleeF->arg_size() != Args.size())
@@ -211,22 +1116,126 @@ llvm::Value *CallExprAST::codegen(CodeGen &CG) {
 
   std::vector<llvm::Value *> ArgsV;
   for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen(CG));
-    if (!ArgsV.back())
+    llvm::Value *ArgV = Args[i]->codegen(CG);
+    if (!ArgV)
+      return nullptr;
+    ArgsV.push_back(CG.CreateCast(ArgV, CalleeF->getArg(i)->getType()));
+  }
+
+  // Well-known math externs are emitted as the equivalent intrinsic, unless
+  // the session defines its own function of that name.
+  llvm::Type *RetTy = CalleeF->getReturnType();
+  bool AllArgsRetTy = llvm::all_of(
+      ArgsV, [&](llvm::Value *V) { return V->getType() == RetTy; });
+  if (RetTy->isFloatingPointTy() && AllArgsRetTy &&
+      !CG.Definitions.count(Callee) && CalleeF->isDeclaration())
+    if (auto ID = MathBuiltins::lookup(Callee, ArgsV.size()))
+      return CG.Builder->CreateIntrinsic(*ID, {RetTy}, ArgsV);
+
+  // Constant arguments are bound in a clone of the callee specialized on
+  // them, which only takes the others.
+  if (llvm::Function *Clone = CG.getSpecialization(Callee, ArgsV))
+    CalleeF = Clone;
+
+  llvm::CallInst *Call = CG.Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  if (IsTailCall)
+    Call->setTailCall();
+  return Call;
+}
+
+/// Get the task function that spawn starts for calls to Callee, which reads
+/// the arguments from an environment of type EnvTy and makes the call.
+static llvm::Function *getSpawnTask(CodeGen &CG, llvm::Function *Callee,
+                                    llvm::StructType *EnvTy) {
+  std::string Name = ("spawn." + Callee->getName()).str();
+  if (llvm::Function *Task = CG.Module->getFunction(Name))
+    return Task;
+
+  auto *TaskTy = llvm::FunctionType::get(CG.Builder->getDoubleTy(),
+                                         {CG.Builder->getPtrTy()}, false);
+  auto *Task = llvm::Function::Create(TaskTy, llvm::Function::InternalLinkage,
+                                      Name, CG.Module.get());
+  // Samples taken in the callee are attributed through the task's frame.
+  if (CG.Opts.Profile)
+    Task->addFnAttr("frame-pointer", "all");
+
+  // The task is emitted half way through the body of its spawner.
+  llvm::IRBuilderBase::InsertPointGuard Guard(*CG.Builder);
+  CG.Builder->SetInsertPoint(
+      llvm::BasicBlock::Create(*CG.Context, "entry", Task));
+  std::vector<llvm::Value *> ArgsV;
+  for (unsigned i = 0, e = EnvTy->getNumElements(); i != e; ++i)
+    ArgsV.push_back(CG.Builder->CreateLoad(
+        EnvTy->getElementType(i),
+        CG.Builder->CreateStructGEP(EnvTy, Task->getArg(0), i)));
+  llvm::Value *Result = CG.Builder->CreateCall(Callee, ArgsV, "calltmp");
+  CG.Builder->CreateRet(CG.CreateCast(Result, CG.Builder->getDoubleTy()));
+  return Task;
+}
+
+llvm::Value *SpawnExprAST::codegen(CodeGen &CG) {
+  llvm::Function *CalleeF = getFunction(CG, Callee);
+  if (!CalleeF)
+    return Logger::LogErrorV("Unknown function referenced");
+  ++CG.CallSiteCounts[Callee];
+  CG.RecordCall(Callee);
+
+  if (CalleeF->arg_size() != Args.size())
+    return Logger::LogErrorV("Incorrect # arguments passed");
+
+  // The arguments are evaluated by the spawner, into an environment that the
+  // runtime copies for the task.
+  llvm::StructType *EnvTy = llvm::StructType::get(
+      *CG.Context, CalleeF->getFunctionType()->params());
+  llvm::AllocaInst *Env = CreateEntryBlockAlloca(
+      CG.Builder->GetInsertBlock()->getParent(), "env", EnvTy);
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    llvm::Value *ArgV = Args[i]->codegen(CG);
+    if (!ArgV)
       return nullptr;
+    CG.Builder->CreateStore(
+        CG.CreateCast(ArgV, EnvTy->getElementType(i)),
+        CG.Builder->CreateStructGEP(EnvTy, Env, i));
   }
 
-  return CG.Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  const llvm::DataLayout &DL = CG.Module->getDataLayout();
+  llvm::Type *SizeTy = DL.getIntPtrType(*CG.Context);
+  llvm::FunctionCallee Spawn = CG.Module->getOrInsertFunction(
+      "kal_spawn", CG.Builder->getInt64Ty(), CG.Builder->getPtrTy(),
+      CG.Builder->getPtrTy(), SizeTy);
+  return CG.Builder->CreateCall(
+      Spawn,
+      {getSpawnTask(CG, CalleeF, EnvTy), Env,
+       llvm::ConstantInt::get(SizeTy, DL.getTypeAllocSize(EnvTy))},
+      "future");
+}
+
+llvm::Value *AwaitExprAST::codegen(CodeGen &CG) {
+  llvm::Value *FutureV = Future->codegen(CG);
+  if (!FutureV)
+    return nullptr;
+
+  // Futures are below 2^53, so they survive a trip through a double, such
+  // as an unannotated argument. kal_await rejects anything that isn't one.
+  llvm::FunctionCallee Await = CG.Module->getOrInsertFunction(
+      "kal_await", CG.Builder->getDoubleTy(), CG.Builder->getInt64Ty());
+  return CG.Builder->CreateCall(
+      Await, {CG.CreateCast(FutureV, CG.Builder->getInt64Ty())}, "awaittmp");
 }
 
 const std::string &ProtoTypeAST::getName() const { return Name; }
 
+bool ProtoTypeAST::hasSameSignature(const ProtoTypeAST &Other) const {
+  return ArgTypes == Other.ArgTypes && RetType == Other.RetType;
+}
+
 llvm::Function *ProtoTypeAST::codegen(CodeGen &CG) {
   // Make the function type: double(double, double) etc.
-  std::vector<llvm::Type *> Doubles(Args.size(),
-                                    llvm::Type::getDoubleTy(*CG.Context));
-  llvm::FunctionType *FT = llvm::FunctionType::get(
-      llvm::Type::getDoubleTy(*CG.Context), Doubles, false);
+  std::vector<llvm::Type *> Types;
+  for (ValueType Ty : ArgTypes)
+    Types.push_back(CG.getType(Ty));
+  llvm::FunctionType *FT =
+      llvm::FunctionType::get(CG.getType(RetType), Types, false);
 
   llvm::Function *F = llvm::Function::Create(
       FT, llvm::Function::ExternalLinkage, Name, CG.Module.get());
@@ -239,10 +1248,17 @@ llvm::Function *ProtoTypeAST::codegen(CodeGen &CG) {
   return F;
 }
 
+const ProtoTypeAST &FunctionAST::getProto() const { return *Proto; }
+
 llvm::Function *FunctionAST::codegen(CodeGen &CG) {
   auto &P = *Proto;
-  CG.FunctionProtos[Proto->getName()] = std::move(Proto);
-  llvm::Function *Function = getFunction(CG, P.getName());
+  CG.FunctionProtos[P.getName()] = std::make_unique<ProtoTypeAST>(P);
+
+  // Don't go through getFunction here, a retained body of an earlier
+  // definition must not be imported as the body of this one.
+  llvm::Function *Function = CG.Module->getFunction(P.getName());
+  if (!Function)
+    Function = P.codegen(CG);
 
   if (!Function)
     return nullptr;
@@ -250,6 +1266,120 @@ llvm::Function *FunctionAST::codegen(CodeGen &CG) {
   if (!Function->empty())
     return (llvm::Function *)Logger::LogErrorV("Function cannot be redefined");
 
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+  // Loop nests may be lowered through MLIR, which leaves whatever it doesn't
+  // cover to the direct path.
+  if (CG.Opts.MLIR)
+    if (llvm::Function *Lowered = CG.getMLIRGen().lower(*this)) {
+      markTailCalls(Lowered);
+      optimiseBody(CG, Lowered);
+      return Lowered;
+    }
+#endif
+
+  if (emitBody(CG, Function))
+    return Function;
+
+  // Error reading body.
+  Function->eraseFromParent();
+  return nullptr;
+}
+
+std::optional<std::string> FunctionAST::getStructuralKey() const {
+  StructuralKey Key(Proto->getName());
+
+  // Functions are only interchangeable if they are called the same way and
+  // compiled under the same fast-math policy.
+  Key.addType(Proto->getRetType());
+  Key.addNumber(Proto->getArgs().size());
+  for (ValueType Type : Proto->getArgTypes())
+    Key.addType(Type);
+  if (FastMath) {
+    Key.addTag('F');
+    for (bool Flag : {FastMath->Reassoc, FastMath->NoNaNs, FastMath->NoInfs,
+                      FastMath->NoSignedZeros, FastMath->Contract,
+                      FastMath->FuseFMA})
+      Key.addTag(Flag ? '1' : '0');
+  }
+
+  for (const std::string &Arg : Proto->getArgs())
+    Key.bind(Arg);
+  Key.addTag('=');
+  Key.add(*Body);
+  return Key.take();
+}
+
+llvm::Function *FunctionAST::codegenImport(CodeGen &CG) {
+  llvm::Function *Function = Proto->codegen(CG);
+  Function->setLinkage(llvm::Function::AvailableExternallyLinkage);
+
+  // The import can be triggered half way through the body of a caller, so
+  // restore the builder and the caller's variables afterwards.
+  llvm::IRBuilderBase::InsertPointGuard Guard(*CG.Builder);
+  auto CallerNamedValues = std::move(CG.NamedValues);
+
+  if (!emitBody(CG, Function)) {
+    // Fall back to a plain declaration, which can't be available_externally.
+    Function->deleteBody();
+    Function->setLinkage(llvm::Function::ExternalLinkage);
+  }
+
+  CG.NamedValues = std::move(CallerNamedValues);
+  return Function;
+}
+
+llvm::Function *
+FunctionAST::codegenSpecialization(CodeGen &CG, const std::string &Name,
+                                   llvm::ArrayRef<llvm::Constant *> Bound) {
+  const std::vector<std::string> &ArgNames = Proto->getArgs();
+  llvm::Function *Generic = CG.Module->getFunction(Proto->getName());
+  std::vector<llvm::Type *> Types;
+  std::vector<std::string> Names;
+  for (unsigned i = 0, e = ArgNames.size(); i != e; ++i) {
+    if (Bound[i])
+      continue;
+    Types.push_back(Generic->getArg(i)->getType());
+    Names.push_back(ArgNames[i]);
+  }
+  llvm::FunctionType *FT =
+      llvm::FunctionType::get(Generic->getReturnType(), Types, false);
+  llvm::Function *Function = llvm::Function::Create(
+      FT, llvm::Function::ExternalLinkage, Name, CG.Module.get());
+  unsigned Idx = 0;
+  for (auto &Arg : Function->args())
+    Arg.setName(Names[Idx++]);
+
+  // Like imports, specializations are emitted half way through a caller.
+  llvm::IRBuilderBase::InsertPointGuard Guard(*CG.Builder);
+  auto CallerNamedValues = std::move(CG.NamedValues);
+
+  if (!emitBody(CG, Function, Bound)) {
+    Function->eraseFromParent();
+    Function = nullptr;
+  }
+
+  CG.NamedValues = std::move(CallerNamedValues);
+  return Function;
+}
+
+bool FunctionAST::emitBody(CodeGen &CG, llvm::Function *Function,
+                           llvm::ArrayRef<llvm::Constant *> Bound) {
+  // Operators are always inlined, so that they cost no more than the builtin
+  // ones in hot expressions.
+  if (Proto->isOperator())
+    Function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+  // The profiler walks the stacks of JIT'd code by its frame pointers.
+  if (CG.Opts.Profile)
+    Function->addFnAttr("frame-pointer", "all");
+
+  // Emit floating point operations under the fast-math policy of the
+  // function, and let the backend know about it too.
+  const FastMathPolicy &Policy = FastMath ? *FastMath : CG.Opts.FastMath;
+  llvm::IRBuilderBase::FastMathFlagGuard FMFGuard(*CG.Builder);
+  CG.Builder->setFastMathFlags(Policy.getFlags());
+  Policy.applyTo(*Function);
+
   // Create a new basic block to start insertion into.
   llvm::BasicBlock *BB =
       llvm::BasicBlock::Create(*CG.Context, "entry", Function);
@@ -257,23 +1387,70 @@ llvm::Function *FunctionAST::codegen(CodeGen &CG) {
 
   // Record the function arguments in the NamedValues map.
   CG.NamedValues.clear();
-  for (auto &Arg : Function->args())
-    CG.NamedValues[std::string(Arg.getName())] = &Arg;
+  const std::vector<std::string> &ArgNames = Proto->getArgs();
+  auto Arg = Function->arg_begin();
+  for (unsigned i = 0, e = ArgNames.size(); i != e; ++i) {
+    llvm::Value *Init;
+    if (i < Bound.size() && Bound[i])
+      Init = Bound[i];
+    else
+      Init = &*Arg++;
 
-  if (llvm::Value *RetVal = Body->codegen(CG)) {
-    // Finish off the function.
-    CG.Builder->CreateRet(RetVal);
+    // Create an alloca for this variable.
+    llvm::AllocaInst *Alloca =
+        CreateEntryBlockAlloca(Function, ArgNames[i], Init->getType());
 
-    // Validate the generated code, checking for consistency.
-    llvm::verifyFunction(*Function);
+    // Store the initial value into the alloca.
+    CG.Builder->CreateStore(Init, Alloca);
 
-    // Optimize the function.
-    CG.FPM->run(*Function, *CG.FAM);
-
-    return Function;
+    // Add arguments to variable symbol table.
+    CG.NamedValues[ArgNames[i]] = Alloca;
   }
 
-  // Error reading body.
-  Function->eraseFromParent();
-  return nullptr;
+  // Count the entries into definitions that may be evicted, imported copies
+  // are dropped or inlined and never entered themselves, and specializations
+  // live outside the budget.
+  if (!Proto->isOperator() && !Function->hasAvailableExternallyLinkage() &&
+      Bound.empty())
+    CG.EmitEntryCount(Proto->getName());
+
+  // The value of the body is returned, so calls in its tail position can
+  // reuse the frame of this function.
+  Body->markTailPosition();
+
+  llvm::Value *RetVal = Body->codegen(CG);
+  if (!RetVal)
+    return false;
+
+  // Finish off the function.
+  CG.Builder->CreateRet(CG.CreateCast(RetVal, Function->getReturnType()));
+
+  optimiseBody(CG, Function);
+  return true;
+}
+
+void FunctionAST::optimiseBody(CodeGen &CG, llvm::Function *Function) {
+  // Validate the generated code, checking for consistency.
+  llvm::verifyFunction(*Function);
+
+  unsigned SelfTailCalls = countSelfTailCalls(Function);
+
+  // Optimize the function.
+  CG.FPM->run(*Function, *CG.FAM);
+
+  unsigned Guaranteed = guaranteeTailCalls(Function);
+
+  if (CG.Opts.ReportTailCalls) {
+    // Nothing in FPM inlines, but InstCombine and GVN can fold away what a
+    // self call's result went through on its way to the return, putting
+    // the call in tail position only now. Clamp so that such calls, when
+    // TailCallElim can't turn them into a loop, don't make the count wrap.
+    unsigned Kept = countSelfTailCalls(Function);
+    unsigned Eliminated = SelfTailCalls > Kept ? SelfTailCalls - Kept : 0;
+    fprintf(stderr,
+            "Tail calls in %s: %u of %u self-recursive calls eliminated, "
+            "%u calls guaranteed as musttail\n",
+            Function->getName().str().c_str(), Eliminated, SelfTailCalls,
+            Guaranteed);
+  }
 }
@@ -0,0 +1,140 @@
+//===- ChunkedParser.cpp - Parallel parsing of large sources --------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements splitting and parallel parsing of large sources.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ChunkedParser.h"
+#include "Lexer.h"
+#include "Logger.h"
+#include "llvm/Support/Parallel.h"
+#include <algorithm>
+#include <cctype>
+#include <optional>
+
+/// Read the operator and precedence of the definition at the start of Def if
+/// it defines a binary operator, the same way ParseDefinition would.
+static std::optional<std::pair<char, unsigned>>
+scanBinaryOp(std::string_view Def) {
+  Lexer L(Def);
+  L.getNextTok(); // def.
+
+  if (L.getNextTok() == TOK_FASTMATH && L.getNextTok() == '(') {
+    while (L.getNextTok() != ')' && L.getCurTok() != TOK_EOF)
+      ;
+    L.getNextTok(); // eat ).
+  }
+  if (L.getCurTok() != TOK_BINARY)
+    return std::nullopt;
+
+  int Op = L.getNextTok();
+  if (!isascii(Op))
+    return std::nullopt;
+
+  unsigned Precedence = 30;
+  if (L.getNextTok() == TOK_NUMBER) {
+    if (L.getNumVal() < 1 || L.getNumVal() > 100)
+      return std::nullopt;
+    Precedence = (unsigned)L.getNumVal();
+  }
+  return std::make_pair(static_cast<char>(Op), Precedence);
+}
+
+std::vector<SourceChunk> ChunkedParser::split(std::string_view Source,
+                                              unsigned NumChunks) {
+  size_t TargetSize =
+      std::max(Source.size() / std::max(NumChunks, 1u), MinChunkSize);
+
+  std::vector<SourceChunk> Chunks(1);
+  size_t ChunkStart = 0;
+  unsigned Depth = 0;
+
+  // Walk the source token by token like the lexer, so that keywords are only
+  // recognised where the lexer would see them.
+  size_t I = 0, E = Source.size();
+  while (I < E) {
+    unsigned char C = Source[I];
+
+    if (C == '#') {
+      while (I < E && Source[I] != '\n' && Source[I] != '\r')
+        ++I;
+      continue;
+    }
+
+    if (isdigit(C) || C == '.') {
+      while (I < E && (isdigit(static_cast<unsigned char>(Source[I])) ||
+                       Source[I] == '.'))
+        ++I;
+      continue;
+    }
+
+    if (!isalpha(C)) {
+      if (C == '(')
+        ++Depth;
+      else if (C == ')' && Depth)
+        --Depth;
+      ++I;
+      continue;
+    }
+
+    size_t Start = I;
+    while (I < E && isalnum(static_cast<unsigned char>(Source[I])))
+      ++I;
+    std::string_view Word = Source.substr(Start, I - Start);
+    if (Depth || (Word != "def" && Word != "extern"))
+      continue;
+
+    // A new top-level item starts here, begin a new chunk with it once the
+    // current one is large enough.
+    if (Start - ChunkStart >= TargetSize) {
+      Chunks.back().Text = Source.substr(ChunkStart, Start - ChunkStart);
+      Chunks.emplace_back();
+      ChunkStart = Start;
+    }
+
+    if (Word == "def")
+      if (auto Op = scanBinaryOp(Source.substr(Start)))
+        Chunks.back().BinaryOps.push_back(*Op);
+  }
+  Chunks.back().Text = Source.substr(ChunkStart);
+  return Chunks;
+}
+
+std::vector<TopLevelItem> ChunkedParser::parse(std::string_view Source,
+                                               unsigned NumChunks,
+                                               ParserOptions Opts) {
+  std::vector<SourceChunk> Chunks = split(Source, NumChunks);
+  std::vector<std::vector<TopLevelItem>> ChunkItems(Chunks.size());
+  std::vector<std::string> Diagnostics(Chunks.size());
+
+  Opts.ParseOnly = true;
+  llvm::parallelFor(0, Chunks.size(), [&](size_t Idx) {
+    Parser P(CodeGenOptions(), Opts);
+
+    // Operators defined in earlier chunks are already known to this one.
+    for (size_t Prev = 0; Prev != Idx; ++Prev)
+      for (auto [Op, Precedence] : Chunks[Prev].BinaryOps)
+        if (!P.BinOpPrecedence.IsBuiltinBinOp(Op))
+          P.BinOpPrecedence.SetBinOpPrecedence(Op, Precedence);
+
+    Logger::getDiagnosticBuffer() = &Diagnostics[Idx];
+    unsigned FirstLine =
+        1 + std::count(Source.data(), Chunks[Idx].Text.data(), '\n');
+    P.CurLexer = Lexer(Chunks[Idx].Text, FirstLine);
+    P.CurLexer.getNextTok();
+    ChunkItems[Idx] = P.ParseTopLevelItems();
+    Logger::getDiagnosticBuffer() = nullptr;
+  });
+
+  std::vector<TopLevelItem> Items;
+  for (size_t Idx = 0; Idx != Chunks.size(); ++Idx) {
+    fputs(Diagnostics[Idx].c_str(), stderr);
+    std::move(ChunkItems[Idx].begin(), ChunkItems[Idx].end(),
+              std::back_inserter(Items));
+  }
+  return Items;
+}
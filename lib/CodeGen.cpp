@@ -0,0 +1,886 @@
+//===- CodeGen.cpp - Code Generation support code -------------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements the type helpers used while generating code for the AST nodes,
+// and the registration and import of the runtime.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CodeGen.h"
+#include "Logger.h"
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+#include "MLIRGen.h"
+#endif
+#include "Profiler.h"
+#include "Runtime.h"
+#include "TaskRuntime.h"
+#include "llvm/ADT/APSInt.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <algorithm>
+
+CodeGen::~CodeGen() {
+  EnsureInitialised();
+  WaitForSpeculation();
+}
+
+#ifdef KALEIDOSCOPE_HAVE_MLIR
+MLIRGen &CodeGen::getMLIRGen() {
+  if (!MLIRLowering)
+    MLIRLowering = std::make_unique<MLIRGen>(*this);
+  return *MLIRLowering;
+}
+#endif
+
+llvm::Type *CodeGen::getType(ValueType Ty) {
+  switch (Ty) {
+  case ValueType::Double:
+    return llvm::Type::getDoubleTy(*Context);
+  case ValueType::Float:
+    return llvm::Type::getFloatTy(*Context);
+  case ValueType::Int:
+    return llvm::Type::getInt64Ty(*Context);
+  case ValueType::Bool:
+    return llvm::Type::getInt1Ty(*Context);
+  }
+  llvm_unreachable("unknown value type");
+}
+
+llvm::Value *CodeGen::CreateCast(llvm::Value *V, llvm::Type *DestTy) {
+  llvm::Type *SrcTy = V->getType();
+  if (SrcTy == DestTy)
+    return V;
+
+  // Anything converts to a bool by comparing non-equal to zero.
+  if (DestTy->isIntegerTy(1)) {
+    if (SrcTy->isFloatingPointTy())
+      return Builder->CreateFCmpONE(V, llvm::ConstantFP::get(SrcTy, 0.0),
+                                    "tobool");
+    return Builder->CreateICmpNE(V, llvm::ConstantInt::get(SrcTy, 0),
+                                 "tobool");
+  }
+
+  // Convert bool 0/1 to 0/1 of the destination type.
+  if (SrcTy->isIntegerTy(1)) {
+    if (DestTy->isFloatingPointTy())
+      return Builder->CreateUIToFP(V, DestTy, "booltmp");
+    return Builder->CreateZExt(V, DestTy, "booltmp");
+  }
+
+  if (SrcTy->isIntegerTy())
+    return Builder->CreateSIToFP(V, DestTy, "inttmp");
+  if (DestTy->isIntegerTy())
+    return Builder->CreateFPToSI(V, DestTy, "fptmp");
+  return Builder->CreateFPCast(V, DestTy, "fptmp");
+}
+
+/// Returns true if the constant C keeps its value when converted to Ty.
+/// Floating point constants are allowed to round when narrowed to float, so
+/// that literals don't force float arithmetic up to double.
+static bool fitsType(llvm::Constant *C, llvm::Type *Ty) {
+  if (!Ty->isIntegerTy())
+    return true;
+
+  if (llvm::isa<llvm::ConstantInt>(C))
+    return true;
+  auto *FP = llvm::dyn_cast<llvm::ConstantFP>(C);
+  if (!FP)
+    return false;
+
+  bool IsExact = false;
+  llvm::APSInt Int(64, /*isUnsigned=*/false);
+  FP->getValueAPF().convertToInteger(Int, llvm::APFloat::rmTowardZero,
+                                     &IsExact);
+  return IsExact;
+}
+
+/// Rank of the arithmetic types, values are widened to the higher rank.
+static unsigned getTypeRank(llvm::Type *Ty) {
+  if (Ty->isIntegerTy())
+    return 0;
+  if (Ty->isFloatTy())
+    return 1;
+  return 2;
+}
+
+llvm::Type *CodeGen::getCommonType(llvm::Value *L, llvm::Value *R) {
+  llvm::Type *LTy = L->getType();
+  llvm::Type *RTy = R->getType();
+
+  // Booleans take part in arithmetic as integers.
+  if (LTy->isIntegerTy(1))
+    LTy = llvm::Type::getInt64Ty(*Context);
+  if (RTy->isIntegerTy(1))
+    RTy = llvm::Type::getInt64Ty(*Context);
+  if (LTy == RTy)
+    return LTy;
+
+  // A constant operand adopts the type of the other one if it fits.
+  auto *LC = llvm::dyn_cast<llvm::Constant>(L);
+  auto *RC = llvm::dyn_cast<llvm::Constant>(R);
+  if (LC && !RC && fitsType(LC, RTy))
+    return RTy;
+  if (RC && !LC && fitsType(RC, LTy))
+    return LTy;
+
+  return getTypeRank(LTy) > getTypeRank(RTy) ? LTy : RTy;
+}
+
+void CodeGen::RegisterRuntime() {
+  using llvm::orc::ExecutorAddr;
+  auto Callable =
+      llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+  ExitOnError(JIT->addAbsoluteSymbols({
+      {"kal_output",
+       {ExecutorAddr::fromPtr(&kal_output), llvm::JITSymbolFlags::Exported}},
+      {"kal_flush", {ExecutorAddr::fromPtr(&kal_flush), Callable}},
+      {"putchard", {ExecutorAddr::fromPtr(&putchard), Callable}},
+      {"printd", {ExecutorAddr::fromPtr(&printd), Callable}},
+      {"kal_spawn", {ExecutorAddr::fromPtr(&kal_spawn), Callable}},
+      {"kal_await", {ExecutorAddr::fromPtr(&kal_await), Callable}},
+      {"kal_parallel_reduce",
+       {ExecutorAddr::fromPtr(&kal_parallel_reduce), Callable}},
+  }));
+
+  if (!Opts.InlineRuntime)
+    return;
+
+  std::string Path = Opts.RuntimeBitcode;
+#ifdef KALEIDOSCOPE_RUNTIME_BITCODE
+  if (Path.empty())
+    Path = KALEIDOSCOPE_RUNTIME_BITCODE;
+#endif
+  if (Path.empty())
+    return;
+
+  auto BufferOrErr = llvm::MemoryBuffer::getFile(Path);
+  if (!BufferOrErr) {
+    fprintf(stderr, "Warning: runtime bitcode '%s' not loaded: %s\n",
+            Path.c_str(), BufferOrErr.getError().message().c_str());
+    return;
+  }
+
+  // Remember which functions the bitcode defines, so that only modules
+  // calling one of them pay for parsing it. Loading it lazily only reads
+  // the function headers, which keeps it off the startup path.
+  llvm::LLVMContext ScratchContext;
+  auto RuntimeOrErr =
+      llvm::getLazyBitcodeModule(**BufferOrErr, ScratchContext);
+  if (!RuntimeOrErr) {
+    llvm::errs() << "Warning: runtime bitcode '" << Path
+                 << "' not loaded: " << RuntimeOrErr.takeError() << "\n";
+    return;
+  }
+  for (llvm::Function &F : **RuntimeOrErr)
+    if (!F.isDeclaration())
+      RuntimeFunctions.insert(F.getName());
+  RuntimeBitcode = std::move(*BufferOrErr);
+}
+
+void CodeGen::ImportRuntime() {
+  if (!RuntimeBitcode)
+    return;
+
+  bool CallsRuntime = llvm::any_of(*Module, [&](llvm::Function &F) {
+    return F.isDeclaration() && RuntimeFunctions.contains(F.getName());
+  });
+  if (!CallsRuntime)
+    return;
+
+  auto Runtime = ExitOnError(
+      llvm::parseBitcodeFile(RuntimeBitcode->getMemBufferRef(), *Context));
+  Runtime->setDataLayout(Module->getDataLayout());
+  Runtime->setTargetTriple(Module->getTargetTriple());
+
+  // Every definition stays with the host copy, the bodies are only there to
+  // be inlined and are dropped after the module pipeline.
+  for (llvm::Function &F : *Runtime) {
+    if (F.isDeclaration())
+      continue;
+    llvm::Function *Existing = Module->getFunction(F.getName());
+    if (Existing && Existing->getFunctionType() != F.getFunctionType()) {
+      F.deleteBody();
+      continue;
+    }
+    F.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+    // Compile for the JIT's target rather than the one the bitcode was
+    // built for.
+    F.removeFnAttr("target-cpu");
+    F.removeFnAttr("target-features");
+    F.removeFnAttr("tune-cpu");
+  }
+  for (llvm::GlobalVariable &GV : Runtime->globals()) {
+    if (GV.isDeclaration())
+      continue;
+    GV.setInitializer(nullptr);
+    GV.setLinkage(llvm::GlobalValue::ExternalLinkage);
+  }
+
+  if (llvm::Linker::linkModules(*Module, std::move(Runtime),
+                                llvm::Linker::Flags::LinkOnlyNeeded))
+    fprintf(stderr, "Warning: runtime bitcode could not be imported\n");
+}
+
+void CodeGen::EmitEntryCount(const std::string &Name) {
+  // Top-level expressions are removed as soon as they have run.
+  if ((!Opts.MemoryBudget && !Opts.Speculate) || Name == "__anon_expr")
+    return;
+
+  // The counter lives in the compiler and the code bumps it through its
+  // address. A relaxed load and store is enough, as an increment lost to a
+  // concurrent entry still leaves the count changed.
+  std::atomic<uint64_t> &Counter =
+      EntryCounts.try_emplace(Name, 0).first->second;
+  llvm::Value *Addr = Builder->CreateIntToPtr(
+      Builder->getInt64(reinterpret_cast<uintptr_t>(&Counter)),
+      Builder->getPtrTy());
+  llvm::LoadInst *Count =
+      Builder->CreateAlignedLoad(Builder->getInt64Ty(), Addr, llvm::Align(8));
+  Count->setAtomic(llvm::AtomicOrdering::Monotonic);
+  llvm::StoreInst *Store = Builder->CreateAlignedStore(
+      Builder->CreateAdd(Count, Builder->getInt64(1)), Addr, llvm::Align(8));
+  Store->setAtomic(llvm::AtomicOrdering::Monotonic);
+}
+
+void CodeGen::TrackResidency(
+    const std::string &Name, const std::string &ImplName, uint64_t CodeSize,
+    std::shared_ptr<const llvm::SmallVector<char, 0>> Bitcode) {
+  std::lock_guard<std::mutex> Lock(ResidencyMutex);
+  FunctionResidency &R = Residency[Name];
+  R.ImplName = ImplName;
+  R.CodeSize = CodeSize;
+  R.Bitcode = std::move(Bitcode);
+  R.Resident = true;
+  R.LastEntries = EntryCounts.try_emplace(Name, 0).first->second;
+  // A new definition counts as used by the next sweep.
+  R.LastUsed = ResidencyEpoch + 1;
+}
+
+void CodeGen::EnforceMemoryBudget() {
+  if (!Opts.MemoryBudget || ActiveCalls)
+    return;
+
+  std::unique_lock<std::mutex> Lock(ResidencyMutex);
+
+  // Definitions entered since the previous sweep are used in this one.
+  ++ResidencyEpoch;
+  uint64_t ResidentBytes = 0;
+  std::vector<std::pair<uint64_t, std::string>> Candidates;
+  for (auto &[Name, R] : Residency) {
+    uint64_t Entries = EntryCounts[Name].load(std::memory_order_relaxed);
+    if (Entries != R.LastEntries) {
+      R.LastEntries = Entries;
+      R.LastUsed = ResidencyEpoch;
+    }
+    if (!R.Resident)
+      continue;
+    ResidentBytes += R.CodeSize;
+    if (R.LastUsed != ResidencyEpoch)
+      Candidates.emplace_back(R.LastUsed, Name);
+  }
+  if (ResidentBytes <= Opts.MemoryBudget)
+    return;
+
+  // Evict the least recently used definitions first.
+  llvm::stable_sort(Candidates, [](const auto &L, const auto &R) {
+    return L.first < R.first;
+  });
+  uint64_t EvictedBefore = Evictions;
+  for (auto &[LastUsed, Name] : Candidates) {
+    if (ResidentBytes <= Opts.MemoryBudget)
+      break;
+    FunctionResidency &R = Residency[Name];
+    ResidentBytes -= R.CodeSize;
+    Evict(Name, R);
+  }
+  Lock.unlock();
+
+  if (Opts.ReportResidency && Evictions != EvictedBefore)
+    ReportResidency();
+}
+
+void CodeGen::Evict(const std::string &Name, FunctionResidency &R) {
+  FunctionVersion &Def = Definitions[Name];
+  ExitOnError(Def.RT->remove());
+
+  // Define the live version again from its bitcode, compiled only once the
+  // trampoline the stub now points at is called. The trampoline then hands
+  // the stub over to the compiled code, unless the definition was replaced
+  // in the meantime.
+  auto RT = JIT->getMainJITDylib().createResourceTracker();
+  ExitOnError(JIT->addBitcode(RT, R.ImplName, R.Bitcode));
+  auto Trampoline = ExitOnError(JIT->createCallThrough(
+      R.ImplName,
+      [this, Name, ImplName = R.ImplName](
+          llvm::orc::ExecutorAddr Addr) -> llvm::Error {
+        // Hold the lock until the stub is updated, so that a sweep can't
+        // evict the definition again in between.
+        std::lock_guard<std::mutex> Lock(ResidencyMutex);
+        auto It = Residency.find(Name);
+        if (It == Residency.end() || It->second.ImplName != ImplName)
+          return llvm::Error::success();
+        It->second.Resident = true;
+        ++Rematerializations;
+        return JIT->updateStub(Name, Addr);
+      }));
+  ExitOnError(JIT->updateStub(Name, Trampoline));
+
+  Def.RT = std::move(RT);
+  R.Resident = false;
+  // The bitcode is all that is kept of a cold definition, so later modules
+  // call it rather than import its body.
+  ImportableFunctions.erase(Name);
+  ++Evictions;
+}
+
+void CodeGen::ReportResidency() {
+  std::lock_guard<std::mutex> Lock(ResidencyMutex);
+  unsigned ResidentFunctions = 0;
+  uint64_t ResidentBytes = 0, BitcodeBytes = 0;
+  for (auto &[Name, R] : Residency) {
+    if (R.Resident) {
+      ++ResidentFunctions;
+      ResidentBytes += R.CodeSize;
+    }
+    BitcodeBytes += R.Bitcode->size();
+  }
+  fprintf(stderr,
+          "Residency: %u of %zu definitions resident in %llu bytes of code "
+          "(budget %llu), %llu evictions, %llu rematerializations, %llu "
+          "bytes of bitcode retained\n",
+          ResidentFunctions, Residency.size(),
+          static_cast<unsigned long long>(ResidentBytes),
+          static_cast<unsigned long long>(Opts.MemoryBudget),
+          static_cast<unsigned long long>(Evictions),
+          static_cast<unsigned long long>(Rematerializations.load()),
+          static_cast<unsigned long long>(BitcodeBytes));
+}
+
+llvm::Function *CodeGen::getSpecialization(const std::string &Name,
+                                           std::vector<llvm::Value *> &Args) {
+  if (!Opts.SpecializationBudget)
+    return nullptr;
+
+  // Only retained definitions can be cloned, and the constants already
+  // propagate into those imported for inlining.
+  auto It = ImportableFunctions.find(Name);
+  if (It == ImportableFunctions.end() ||
+      It->second->getProto().isOperator() || shouldImport(Name))
+    return nullptr;
+
+  // Calls passing the same constants in the same places share a clone.
+  std::vector<llvm::Constant *> Bound;
+  std::vector<llvm::Value *> Rest;
+  std::vector<llvm::Type *> RestTypes;
+  std::string Key;
+  llvm::raw_string_ostream OS(Key);
+  OS << Name << '(';
+  for (llvm::Value *V : Args) {
+    auto *C = llvm::dyn_cast<llvm::Constant>(V);
+    if (C && !llvm::isa<llvm::ConstantFP>(C) &&
+        !llvm::isa<llvm::ConstantInt>(C))
+      C = nullptr;
+    if (!Bound.empty())
+      OS << ", ";
+    Bound.push_back(C);
+    if (C) {
+      C->printAsOperand(OS, /*PrintType*/ false);
+    } else {
+      OS << '_';
+      Rest.push_back(V);
+      RestTypes.push_back(V->getType());
+    }
+  }
+  OS << ')';
+  if (Rest.size() == Args.size())
+    return nullptr;
+
+  llvm::Function *Clone;
+  auto Cached = Specializations.find(Key);
+  if (Cached != Specializations.end()) {
+    Clone = Module->getFunction(Cached->second);
+    if (!Clone)
+      Clone = llvm::Function::Create(
+          llvm::FunctionType::get(Module->getFunction(Name)->getReturnType(),
+                                  RestTypes, false),
+          llvm::Function::ExternalLinkage, Cached->second, Module.get());
+  } else {
+    if (SpecializedInstructions + FunctionSizes[Name] >
+        Opts.SpecializationBudget)
+      return nullptr;
+
+    // Calls in the body making the same specialization call the clone
+    // itself, so it is known before the body is emitted.
+    std::string CloneName =
+        Name + ".spec" + std::to_string(NumSpecializations++);
+    Specializations[Key] = CloneName;
+    Clone = It->second->codegenSpecialization(*this, CloneName, Bound);
+    if (!Clone) {
+      Specializations.erase(Key);
+      return nullptr;
+    }
+    PendingSpecializations.push_back(CloneName);
+    SpecializedInstructions += Clone->getInstructionCount();
+    if (callsOnlyPureFunctions(*Clone))
+      PureFunctions.insert(CloneName);
+
+    if (Opts.ReportSpecializations)
+      fprintf(Logger::getStream(), "Specialized %s as %s, %u instructions\n",
+              Key.c_str(), CloneName.c_str(), Clone->getInstructionCount());
+  }
+
+  Args = std::move(Rest);
+  return Clone;
+}
+
+/// Collect the local functions and constants Root refers to, directly or
+/// through each other, into Locals. These aren't visible outside of their
+/// module, such as the tasks of spawns and the chunks of reductions, so a
+/// module of Root's own needs copies. Returns false if Root refers to a
+/// local variable, whose copy wouldn't share its value.
+static bool collectLocalDependencies(
+    const llvm::Function &Root,
+    llvm::SmallPtrSetImpl<const llvm::GlobalValue *> &Locals) {
+  std::vector<const llvm::User *> Worklist = {&Root};
+  llvm::SmallPtrSet<const llvm::Constant *, 16> Visited;
+  auto Visit = [&](const llvm::Value *V) {
+    const auto *C = llvm::dyn_cast<llvm::Constant>(V);
+    if (!C)
+      return true;
+    const auto *GV = llvm::dyn_cast<llvm::GlobalValue>(C);
+    if (!GV) {
+      if (Visited.insert(C).second)
+        Worklist.push_back(C);
+      return true;
+    }
+    if (!GV->hasLocalLinkage() || GV == &Root)
+      return true;
+    const auto *Var = llvm::dyn_cast<llvm::GlobalVariable>(GV);
+    if (!llvm::isa<llvm::Function>(GV) && !(Var && Var->isConstant()))
+      return false;
+    if (Locals.insert(GV).second)
+      Worklist.push_back(GV);
+    return true;
+  };
+
+  while (!Worklist.empty()) {
+    const llvm::User *U = Worklist.back();
+    Worklist.pop_back();
+    if (const auto *F = llvm::dyn_cast<llvm::Function>(U)) {
+      for (const llvm::BasicBlock &BB : *F)
+        for (const llvm::Instruction &I : BB)
+          for (const llvm::Value *Op : I.operands())
+            if (!Visit(Op))
+              return false;
+    } else if (const auto *Var = llvm::dyn_cast<llvm::GlobalVariable>(U)) {
+      if (Var->hasInitializer() && !Visit(Var->getInitializer()))
+        return false;
+    } else {
+      for (const llvm::Value *Op : U->operands())
+        if (!Visit(Op))
+          return false;
+    }
+  }
+  return true;
+}
+
+void CodeGen::SplitSpecializations() {
+  for (const std::string &CloneName : PendingSpecializations) {
+    llvm::Function *Clone = Module->getFunction(CloneName);
+    if (!Clone || Clone->isDeclaration())
+      continue;
+
+    // A clone sharing local variables with the module stays local to it,
+    // and later modules make a specialization of their own.
+    llvm::SmallPtrSet<const llvm::GlobalValue *, 8> Locals;
+    if (!collectLocalDependencies(*Clone, Locals)) {
+      Clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+      for (auto It = Specializations.begin(); It != Specializations.end();)
+        It = It->second == CloneName ? Specializations.erase(It) : ++It;
+      continue;
+    }
+
+    // The clone is compiled from its own bitcode once it is first called,
+    // along with copies of the local functions it uses, and the current
+    // module keeps calling it through a declaration.
+    llvm::ValueToValueMapTy VMap;
+    std::unique_ptr<llvm::Module> Split = llvm::CloneModule(
+        *Module, VMap, [Clone, &Locals](const llvm::GlobalValue *GV) {
+          return GV == Clone || Locals.count(GV);
+        });
+    auto Bitcode = std::make_shared<llvm::SmallVector<char, 0>>();
+    llvm::raw_svector_ostream BitcodeOS(*Bitcode);
+    llvm::WriteBitcodeToFile(*Split, BitcodeOS);
+    ExitOnError(JIT->addBitcode(
+        JIT->getMainJITDylib().getDefaultResourceTracker(), CloneName,
+        std::move(Bitcode)));
+    Clone->deleteBody();
+  }
+  PendingSpecializations.clear();
+}
+
+void CodeGen::RecordCall(const std::string &Callee) {
+  if (!Opts.Speculate)
+    return;
+  std::string Caller =
+      Builder->GetInsertBlock()->getParent()->getName().str();
+  std::lock_guard<std::mutex> Lock(SpeculationMutex);
+  CallGraph[Caller].insert(Callee);
+}
+
+void CodeGen::ForgetCalls(const std::string &Caller) {
+  std::lock_guard<std::mutex> Lock(SpeculationMutex);
+  CallGraph.erase(Caller);
+}
+
+bool CodeGen::callsOnlyPureFunctions(const llvm::Function &F) const {
+  for (const llvm::BasicBlock &BB : F)
+    for (const llvm::Instruction &I : BB) {
+      const auto *Call = llvm::dyn_cast<llvm::CallBase>(&I);
+      if (!Call)
+        continue;
+      const llvm::Function *Callee = Call->getCalledFunction();
+      if (!Callee)
+        return false;
+      if (Callee == &F || PureFunctions.contains(Callee->getName()) ||
+          (Callee->isIntrinsic() && Callee->doesNotAccessMemory()))
+        continue;
+      return false;
+    }
+  return true;
+}
+
+llvm::orc::ExecutorAddr CodeGen::DeferCompile(const std::string &Name,
+                                              const std::string &ImplName,
+                                              unsigned Instructions) {
+  {
+    std::lock_guard<std::mutex> Lock(SpeculationMutex);
+    LazyFunction &F = LazyFunctions[Name];
+    F = LazyFunction();
+    F.ImplName = ImplName;
+    F.Instructions = Instructions;
+  }
+
+  // The trampoline compiles the definition unless a background compile got
+  // there first, and hands the stub over to it, unless it was replaced in
+  // the meantime.
+  return ExitOnError(JIT->createCallThrough(
+      ImplName,
+      [this, Name, ImplName](llvm::orc::ExecutorAddr Addr) -> llvm::Error {
+        {
+          std::lock_guard<std::mutex> Lock(SpeculationMutex);
+          auto It = LazyFunctions.find(Name);
+          if (It == LazyFunctions.end() || It->second.ImplName != ImplName)
+            return llvm::Error::success();
+          ++FirstCallStalls;
+          It->second.Stalled = true;
+          It->second.State = LazyFunction::Compiled;
+          if (!LastFirstCall.empty() && LastFirstCall != Name)
+            ObservedNext[LastFirstCall].insert(Name);
+          LastFirstCall = Name;
+          if (auto Err = JIT->updateStub(Name, Addr))
+            return Err;
+        }
+        Speculate(Name, Opts.SpeculationDepth);
+        return llvm::Error::success();
+      }));
+}
+
+void CodeGen::Speculate(const std::string &Caller, unsigned Depth) {
+  if (!Opts.Speculate || !Depth)
+    return;
+
+  std::vector<std::pair<std::string, std::string>> Targets;
+  {
+    std::lock_guard<std::mutex> Lock(SpeculationMutex);
+    auto Collect = [&](const std::map<std::string, std::set<std::string>>
+                           &Edges) {
+      auto Callees = Edges.find(Caller);
+      if (Callees == Edges.end())
+        return;
+      for (const std::string &Callee : Callees->second) {
+        auto It = LazyFunctions.find(Callee);
+        if (It == LazyFunctions.end() ||
+            It->second.State != LazyFunction::Pending)
+          continue;
+        It->second.State = LazyFunction::Speculating;
+        It->second.Speculated = true;
+        Targets.emplace_back(Callee, It->second.ImplName);
+      }
+    };
+    Collect(CallGraph);
+    Collect(ObservedNext);
+    SpeculationsInFlight += Targets.size();
+  }
+
+  for (auto &[Name, ImplName] : Targets)
+    JIT->lookupAsync(
+        ImplName,
+        [this, Name = Name, ImplName = ImplName, Depth](
+            llvm::Expected<llvm::orc::ExecutorSymbolDef> Symbol) {
+          std::unique_lock<std::mutex> Lock(SpeculationMutex);
+          bool Ready = false;
+          auto It = LazyFunctions.find(Name);
+          bool Current = It != LazyFunctions.end() &&
+                         It->second.ImplName == ImplName;
+          if (!Symbol) {
+            // A replaced version may be removed while it compiles.
+            if (Current)
+              llvm::logAllUnhandledErrors(Symbol.takeError(), llvm::errs(),
+                                          "Speculative compile failed: ");
+            else
+              llvm::consumeError(Symbol.takeError());
+          } else if (Current &&
+                     It->second.State == LazyFunction::Speculating) {
+            // Unless the first call beat it to the stub.
+            It->second.State = LazyFunction::Compiled;
+            if (auto Err = JIT->updateStub(Name, Symbol->getAddress()))
+              llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(),
+                                          "Speculative compile failed: ");
+            else
+              Ready = true;
+          }
+          Lock.unlock();
+
+          // Its callees are likely next, and no trampoline will ask for
+          // them when it is entered.
+          if (Ready)
+            Speculate(Name, Depth - 1);
+
+          Lock.lock();
+          if (--SpeculationsInFlight == 0)
+            SpeculationDone.notify_all();
+        });
+}
+
+void CodeGen::WaitForSpeculation() {
+  std::unique_lock<std::mutex> Lock(SpeculationMutex);
+  SpeculationDone.wait(Lock, [this] { return SpeculationsInFlight == 0; });
+}
+
+void CodeGen::ReportSpeculation() {
+  WaitForSpeculation();
+  std::lock_guard<std::mutex> Lock(SpeculationMutex);
+  unsigned Speculated = 0, Avoided = 0, Late = 0, Wasted = 0;
+  uint64_t WastedInstructions = 0;
+  for (auto &[Name, F] : LazyFunctions) {
+    if (!F.Speculated)
+      continue;
+    ++Speculated;
+    if (F.Stalled) {
+      ++Late;
+      continue;
+    }
+    auto Entries = EntryCounts.find(Name);
+    if (Entries != EntryCounts.end() && Entries->second.load()) {
+      ++Avoided;
+    } else {
+      ++Wasted;
+      WastedInstructions += F.Instructions;
+    }
+  }
+  fprintf(stderr,
+          "Speculation: %llu first calls waited for the compiler, %u "
+          "speculative compiles of which %u avoided a wait, %u finished too "
+          "late and %u were wasted (%llu instructions)\n",
+          static_cast<unsigned long long>(FirstCallStalls), Speculated,
+          Avoided, Late, Wasted,
+          static_cast<unsigned long long>(WastedInstructions));
+}
+
+bool CodeGen::ReuseDefinition(const std::string &Key,
+                              std::unique_ptr<FunctionAST> &FnAST) {
+  ++KeyedDefinitions;
+  auto It = CompiledFunctions.find(Key);
+  if (It == CompiledFunctions.end())
+    return false;
+
+  std::string Name = FnAST->getProto().getName();
+  const std::string &Original = It->second;
+  ExitOnError(JIT->addAlias(Name, Original));
+  FunctionProtos[Name] = std::make_unique<ProtoTypeAST>(FnAST->getProto());
+  Definitions[Name] = FunctionVersion();
+  ++DuplicateDefinitions;
+
+  // Callers may inline it wherever they may inline the original.
+  FunctionSizes[Name] = FunctionSizes.lookup(Original);
+  if (ImportableFunctions.count(Original))
+    ImportableFunctions[Name] = std::move(FnAST);
+  return true;
+}
+
+std::optional<llvm::orc::ExecutorAddr>
+CodeGen::findCachedExpression(const std::string &Key) {
+  ++KeyedExpressions;
+  auto It = CompiledExpressions.find(Key);
+  if (It == CompiledExpressions.end())
+    return std::nullopt;
+  ++DuplicateExpressions;
+  return It->second.Addr;
+}
+
+void CodeGen::CacheExpression(const std::string &Key,
+                              llvm::orc::ExecutorAddr Addr,
+                              llvm::orc::ResourceTrackerSP RT) {
+  if (!Opts.ExpressionCacheSize) {
+    RetiredTrackers.push_back(std::move(RT));
+    return;
+  }
+  if (ExpressionOrder.size() == Opts.ExpressionCacheSize) {
+    auto Oldest = CompiledExpressions.find(ExpressionOrder.front());
+    RetiredTrackers.push_back(std::move(Oldest->second.RT));
+    CompiledExpressions.erase(Oldest);
+    ExpressionOrder.pop_front();
+  }
+  CompiledExpressions[Key] = {Addr, std::move(RT)};
+  ExpressionOrder.push_back(Key);
+}
+
+void CodeGen::ReportDedup() {
+  unsigned Keyed = KeyedDefinitions + KeyedExpressions;
+  unsigned Duplicates = DuplicateDefinitions + DuplicateExpressions;
+  fprintf(Logger::getStream(),
+          "Dedup: %u of %u definitions and %u of %u expressions reused "
+          "compiled code, a hit rate of %.1f%%\n",
+          DuplicateDefinitions, KeyedDefinitions, DuplicateExpressions,
+          KeyedExpressions, Keyed ? 100.0 * Duplicates / Keyed : 0.0);
+}
+
+/// Strip the suffix Symbol was given as version Prefix<N> of a definition,
+/// if it has one.
+static bool stripVersion(llvm::StringRef &Symbol, llvm::StringRef Prefix) {
+  auto [Base, Suffix] = Symbol.rsplit('.');
+  if (Suffix == Symbol || !Suffix.consume_front(Prefix) || Suffix.empty() ||
+      !llvm::all_of(Suffix, llvm::isDigit))
+    return false;
+  Symbol = Base;
+  return true;
+}
+
+void CodeGen::CollectSamples(unsigned Line) {
+  if (!Opts.Profile)
+    return;
+  if (SampleBuffer.empty())
+    SampleBuffer.resize(kal_profile_buffer_words());
+  size_t Words = kal_profile_drain(SampleBuffer.data());
+
+  // Frames are named after the definition, as all versions of a stub
+  // definition and every cached expression are one in the source, along
+  // with the line the definition starts on.
+  auto getFrameName = [&](llvm::StringRef Symbol) {
+    if (Symbol.starts_with("__anon_expr"))
+      return "__anon_expr:" + std::to_string(Line);
+    stripVersion(Symbol, "v");
+    std::string Name = Symbol.str();
+    stripVersion(Symbol, "spec");
+    auto It = SourceLines.find(Symbol);
+    if (It != SourceLines.end() && It->second)
+      Name += ":" + std::to_string(It->second);
+    return Name;
+  };
+
+  for (size_t I = 0; I != Words; I += 1 + SampleBuffer[I]) {
+    uint64_t Depth = SampleBuffer[I];
+    std::string Stack;
+    std::set<std::string> OnStack;
+    for (uint64_t J = Depth; J != 0; --J) {
+      // Return addresses follow the call, which is what they are sampled in.
+      uint64_t Addr = SampleBuffer[I + J];
+      bool Leaf = J == 1;
+      auto Function = JIT->findFunction(Leaf ? Addr : Addr - 1);
+      std::string Frame =
+          Function ? getFrameName(Function->first) : "[unknown]";
+
+      FunctionProfile &Profile = FunctionProfiles[Frame];
+      if (OnStack.insert(Frame).second)
+        ++Profile.Total;
+      if (Leaf) {
+        ++Profile.Self;
+        if (Function)
+          ++Profile.Offsets[Function->second];
+      }
+
+      if (!Stack.empty())
+        Stack += ';';
+      Stack += Frame;
+    }
+    ++SampledStacks[Stack];
+    ++Samples;
+  }
+}
+
+void CodeGen::ReportProfile(const std::string &Path) {
+  CollectSamples(0);
+
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    fprintf(stderr, "Error: could not write %s: %s\n", Path.c_str(),
+            EC.message().c_str());
+    return;
+  }
+  for (const auto &[Stack, Count] : SampledStacks)
+    OS << Stack << ' ' << Count << '\n';
+
+  fprintf(stderr,
+          "Profile: %llu samples in JIT'd code, %llu dropped, stacks "
+          "written to %s\n",
+          static_cast<unsigned long long>(Samples),
+          static_cast<unsigned long long>(kal_profile_dropped()),
+          Path.c_str());
+  if (uint64_t DroppedCode = kal_profile_dropped_code())
+    fprintf(stderr,
+            "Profile: %llu ranges of JIT'd code not sampled, over the "
+            "limit of ranges loaded at once\n",
+            static_cast<unsigned long long>(DroppedCode));
+  if (!Samples)
+    return;
+
+  std::vector<std::pair<std::string, const FunctionProfile *>> Hottest;
+  for (const auto &[Name, Profile] : FunctionProfiles)
+    Hottest.emplace_back(Name, &Profile);
+  std::sort(Hottest.begin(), Hottest.end(), [](const auto &L, const auto &R) {
+    return L.second->Self > R.second->Self;
+  });
+  if (Hottest.size() > 10)
+    Hottest.resize(10);
+
+  fprintf(stderr, "   self  total  function\n");
+  for (const auto &[Name, Profile] : Hottest) {
+    fprintf(stderr, " %5.1f%% %5.1f%%  %s", 100.0 * Profile->Self / Samples,
+            100.0 * Profile->Total / Samples, Name.c_str());
+    auto Offset = std::max_element(
+        Profile->Offsets.begin(), Profile->Offsets.end(),
+        [](const auto &L, const auto &R) { return L.second < R.second; });
+    if (Offset != Profile->Offsets.end())
+      fprintf(stderr, " (hottest at +0x%llx, %.1f%% of its samples)",
+              static_cast<unsigned long long>(Offset->first),
+              100.0 * Offset->second / Profile->Self);
+    fprintf(stderr, "\n");
+  }
+}
+
+void CodeGen::ReportStartup() {
+  EnsureInitialised();
+  auto Millis = [this](std::chrono::steady_clock::time_point Time) {
+    return std::chrono::duration<double, std::milli>(Time - StartTime).count();
+  };
+  // When only parsing, nothing is compiled and the JIT is never initialised.
+  if (JITReadyTime == std::chrono::steady_clock::time_point()) {
+    fprintf(stderr, "Startup: JIT not initialised\n");
+    return;
+  }
+  fprintf(stderr, "Startup: JIT ready after %.2f ms", Millis(JITReadyTime));
+  if (FirstResultTime != std::chrono::steady_clock::time_point())
+    fprintf(stderr, ", first result after %.2f ms", Millis(FirstResultTime));
+  fprintf(stderr, "\n");
+}
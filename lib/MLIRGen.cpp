@@ -0,0 +1,471 @@
+//===- MLIRGen.cpp - Lowering of loop nests through MLIR ------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements the MLIR path for definitions with loops, and the mlirgen
+// methods of the AST nodes.
+//
+//===----------------------------------------------------------------------===//
+
+#include "MLIRGen.h"
+#include "CodeGen.h"
+#include "mlir/Conversion/Passes.h"
+#include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/LoopUtils.h"
+#include "mlir/Dialect/Affine/Passes.h"
+#include "mlir/Dialect/Arith/IR/Arith.h"
+#include "mlir/Dialect/ControlFlow/IR/ControlFlow.h"
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/Dialect/LLVMIR/LLVMDialect.h"
+#include "mlir/Dialect/Math/IR/Math.h"
+#include "mlir/Dialect/MemRef/IR/MemRef.h"
+#include "mlir/Dialect/SCF/IR/SCF.h"
+#include "mlir/IR/Verifier.h"
+#include "mlir/Pass/PassManager.h"
+#include "mlir/Target/LLVMIR/Dialect/Builtin/BuiltinToLLVMIRTranslation.h"
+#include "mlir/Target/LLVMIR/Dialect/LLVMIR/LLVMToLLVMIRTranslation.h"
+#include "mlir/Target/LLVMIR/Export.h"
+#include "mlir/Transforms/Passes.h"
+#include "llvm/Linker/Linker.h"
+#include <algorithm>
+
+llvm::Function *getFunction(CodeGen &CG, std::string Name);
+
+MLIRGen::MLIRGen(CodeGen &CG) : CG(CG), Builder(&Context) {
+  Context.loadDialect<mlir::affine::AffineDialect, mlir::arith::ArithDialect,
+                      mlir::cf::ControlFlowDialect, mlir::func::FuncDialect,
+                      mlir::LLVM::LLVMDialect, mlir::math::MathDialect,
+                      mlir::memref::MemRefDialect, mlir::scf::SCFDialect>();
+  mlir::registerBuiltinDialectTranslation(Context);
+  mlir::registerLLVMDialectTranslation(Context);
+}
+
+mlir::Value MLIRGen::getConstant(double Val) {
+  return Builder.create<mlir::arith::ConstantOp>(getLoc(),
+                                                 Builder.getF64FloatAttr(Val));
+}
+
+mlir::Value MLIRGen::toBool(mlir::Value V) {
+  return Builder.create<mlir::arith::CmpFOp>(
+      getLoc(), mlir::arith::CmpFPredicate::ONE, V, getConstant(0.0));
+}
+
+mlir::Value MLIRGen::fromBool(mlir::Value V) {
+  return Builder.create<mlir::arith::UIToFPOp>(getLoc(), Builder.getF64Type(),
+                                               V);
+}
+
+MLIRGen::MLIRVariable *MLIRGen::lookup(const std::string &Name) {
+  for (size_t I = Scope.size(); I--;)
+    if (Scope[I].Name == Name)
+      return &Scope[I];
+  return nullptr;
+}
+
+mlir::Value MLIRGen::read(const std::string &Name) {
+  MLIRVariable *Var = lookup(Name);
+  if (!Var)
+    return {};
+  if (Var->IsInduction)
+    return Var->Value;
+  return Builder.create<mlir::affine::AffineLoadOp>(getLoc(), Var->Value,
+                                                    mlir::ValueRange());
+}
+
+mlir::Value MLIRGen::write(const std::string &Name, mlir::Value V) {
+  MLIRVariable *Var = lookup(Name);
+  if (!Var || Var->IsInduction)
+    return {};
+  ++Var->Writes;
+  Builder.create<mlir::affine::AffineStoreOp>(getLoc(), V, Var->Value,
+                                              mlir::ValueRange());
+  return V;
+}
+
+unsigned MLIRGen::getWrites(const std::string &Name) {
+  MLIRVariable *Var = lookup(Name);
+  return Var ? Var->Writes : 0;
+}
+
+void MLIRGen::bind(const std::string &Name, mlir::Value Init) {
+  // Slots are allocated in the entry block, like the allocas of the direct
+  // path, so that loops don't allocate them again on every iteration.
+  mlir::Value Slot;
+  {
+    mlir::OpBuilder::InsertionGuard Guard(Builder);
+    Builder.setInsertionPointToStart(EntryBlock);
+    Slot = Builder.create<mlir::memref::AllocaOp>(
+        getLoc(), mlir::MemRefType::get({}, Builder.getF64Type()));
+  }
+  Builder.create<mlir::affine::AffineStoreOp>(getLoc(), Init, Slot,
+                                              mlir::ValueRange());
+  Scope.push_back({Name, Slot});
+}
+
+void MLIRGen::unbind(size_t N) { Scope.resize(Scope.size() - N); }
+
+mlir::Value MLIRGen::call(const std::string &Callee,
+                          llvm::ArrayRef<mlir::Value> Args) {
+  // Make the callee available in the current module as the direct path
+  // would, importing its body for inlining, and check it takes and returns
+  // doubles.
+  llvm::Function *F = getFunction(CG, Callee);
+  if (!F || F->arg_size() != Args.size() ||
+      !F->getReturnType()->isDoubleTy())
+    return {};
+  for (const llvm::Argument &Arg : F->args())
+    if (!Arg.getType()->isDoubleTy())
+      return {};
+
+  mlir::Type F64 = Builder.getF64Type();
+  if (!Unit->lookupSymbol<mlir::func::FuncOp>(Callee)) {
+    mlir::OpBuilder::InsertionGuard Guard(Builder);
+    Builder.setInsertionPointToEnd(Unit->getBody());
+    llvm::SmallVector<mlir::Type> ArgTypes(Args.size(), F64);
+    auto Decl = Builder.create<mlir::func::FuncOp>(
+        getLoc(), Callee, Builder.getFunctionType(ArgTypes, F64));
+    Decl.setPrivate();
+  }
+  return Builder.create<mlir::func::CallOp>(getLoc(), Callee, F64, Args)
+      .getResult(0);
+}
+
+bool MLIRGen::emitLoop(const std::string &VarName, mlir::Value Lower,
+                       mlir::Value Upper, int64_t Step,
+                       llvm::function_ref<bool()> EmitBody) {
+  ++Loops;
+  mlir::OpBuilder::InsertionGuard Guard(Builder);
+
+  // Bounds computed outside of any loop, or from constants, are affine
+  // symbols. Loops bounded by values computed in an enclosing loop can only
+  // be scf loops, which the affine transformations leave alone.
+  mlir::Value IV;
+  if (mlir::affine::isValidSymbol(Lower) &&
+      mlir::affine::isValidSymbol(Upper)) {
+    mlir::AffineMap Map =
+        mlir::AffineMap::get(0, 1, Builder.getAffineSymbolExpr(0));
+    auto For = Builder.create<mlir::affine::AffineForOp>(
+        getLoc(), mlir::ValueRange(Lower), Map, mlir::ValueRange(Upper), Map,
+        Step);
+    Builder.setInsertionPointToStart(For.getBody());
+    IV = For.getInductionVar();
+  } else {
+    mlir::Value StepV =
+        Builder.create<mlir::arith::ConstantIndexOp>(getLoc(), Step);
+    auto For = Builder.create<mlir::scf::ForOp>(getLoc(), Lower, Upper, StepV);
+    Builder.setInsertionPointToStart(For.getBody());
+    IV = For.getInductionVar();
+  }
+
+  mlir::Value Index = Builder.create<mlir::arith::IndexCastOp>(
+      getLoc(), Builder.getI64Type(), IV);
+  mlir::Value Var = Builder.create<mlir::arith::SIToFPOp>(
+      getLoc(), Builder.getF64Type(), Index);
+  Scope.push_back({VarName, Var, /*IsInduction*/ true});
+  bool Emitted = EmitBody();
+  Scope.pop_back();
+  return Emitted;
+}
+
+/// Interchange the loops of each perfect nest so that the parallel ones are
+/// outermost, and the ones carrying a dependence innermost where what they
+/// carry stays in registers and cache.
+static void interchangeLoops(mlir::func::FuncOp Function) {
+  llvm::SmallVector<mlir::affine::AffineForOp> Outermost;
+  Function.walk([&](mlir::affine::AffineForOp For) {
+    if (!For->getParentOfType<mlir::affine::AffineForOp>())
+      Outermost.push_back(For);
+  });
+  for (mlir::affine::AffineForOp For : Outermost)
+    mlir::affine::sinkSequentialLoops(For);
+}
+
+bool MLIRGen::optimise() {
+  // Forward the loads and stores of variables first, so that loops only
+  // depend on each other through what they really share.
+  mlir::PassManager LoopPM(&Context);
+  mlir::OpPassManager &LoopFPM = LoopPM.nest<mlir::func::FuncOp>();
+  LoopFPM.addPass(mlir::affine::createAffineScalarReplacementPass());
+  LoopFPM.addPass(mlir::affine::createLoopFusionPass());
+  LoopFPM.addPass(mlir::createCanonicalizerPass());
+  if (mlir::failed(LoopPM.run(*Unit)))
+    return false;
+
+  Unit->walk([](mlir::func::FuncOp Function) { interchangeLoops(Function); });
+
+  mlir::PassManager LowerPM(&Context);
+  mlir::OpPassManager &LowerFPM = LowerPM.nest<mlir::func::FuncOp>();
+  LowerFPM.addPass(mlir::affine::createLoopTilingPass());
+  LowerFPM.addPass(mlir::createCanonicalizerPass());
+  LowerPM.addPass(mlir::createLowerAffinePass());
+  LowerPM.addPass(mlir::createConvertSCFToCFPass());
+  LowerPM.addPass(mlir::createConvertMathToLLVMPass());
+  LowerPM.addPass(mlir::createArithToLLVMConversionPass());
+  LowerPM.addPass(mlir::createFinalizeMemRefToLLVMConversionPass());
+  LowerPM.addPass(mlir::createConvertFuncToLLVMPass());
+  LowerPM.addPass(mlir::createConvertControlFlowToLLVMPass());
+  LowerPM.addPass(mlir::createReconcileUnrealizedCastsPass());
+  return mlir::succeeded(LowerPM.run(*Unit));
+}
+
+llvm::Function *MLIRGen::lower(const FunctionAST &Function) {
+  // Operators are inlined, and definitions that count their entries need
+  // the direct path.
+  const ProtoTypeAST &Proto = Function.getProto();
+  if (Proto.isOperator() || CG.Opts.MemoryBudget || CG.Opts.Speculate ||
+      Proto.getRetType() != ValueType::Double)
+    return nullptr;
+  for (ValueType Type : Proto.getArgTypes())
+    if (Type != ValueType::Double)
+      return nullptr;
+
+  Unit = mlir::ModuleOp::create(getLoc());
+  Builder.setInsertionPointToEnd(Unit->getBody());
+  Scope.clear();
+  Loops = 0;
+
+  mlir::Type F64 = Builder.getF64Type();
+  llvm::SmallVector<mlir::Type> ArgTypes(Proto.getArgs().size(), F64);
+  auto Func = Builder.create<mlir::func::FuncOp>(
+      getLoc(), Proto.getName(), Builder.getFunctionType(ArgTypes, F64));
+  EntryBlock = Func.addEntryBlock();
+  Builder.setInsertionPointToStart(EntryBlock);
+
+  const std::vector<std::string> &ArgNames = Proto.getArgs();
+  for (unsigned i = 0, e = ArgNames.size(); i != e; ++i)
+    bind(ArgNames[i], EntryBlock->getArgument(i));
+
+  mlir::Value RetVal = Function.getBody().mlirgen(*this);
+  if (!RetVal || !Loops)
+    return nullptr;
+  Builder.create<mlir::func::ReturnOp>(getLoc(), RetVal);
+
+  if (mlir::failed(mlir::verify(*Unit)) || !optimise())
+    return nullptr;
+
+  std::unique_ptr<llvm::Module> Lowered =
+      mlir::translateModuleToLLVMIR(*Unit, *CG.Context, "KaleidoscopeMLIR");
+  if (!Lowered)
+    return nullptr;
+  Lowered->setDataLayout(CG.Module->getDataLayout());
+  Lowered->setTargetTriple(CG.Module->getTargetTriple());
+  if (CG.Opts.Profile)
+    for (llvm::Function &F : *Lowered)
+      if (!F.isDeclaration())
+        F.addFnAttr("frame-pointer", "all");
+
+  // The definition replaces the declaration of the function in the module,
+  // and its calls resolve to the callees already there.
+  if (llvm::Linker::linkModules(*CG.Module, std::move(Lowered)))
+    return nullptr;
+  llvm::Function *Defined = CG.Module->getFunction(Proto.getName());
+
+  // The passes above don't rely on any fast-math assumption, so the policy
+  // of the function is applied to what they produced, as the direct path
+  // applies it while emitting.
+  const FastMathPolicy &Policy =
+      Function.getFastMath() ? *Function.getFastMath() : CG.Opts.FastMath;
+  Policy.applyTo(*Defined);
+  for (llvm::BasicBlock &BB : *Defined)
+    for (llvm::Instruction &I : BB)
+      if (llvm::isa<llvm::FPMathOperator>(I))
+        I.setFastMathFlags(Policy.getFlags());
+  return Defined;
+}
+
+mlir::Value ExprAST::mlirgen(MLIRGen &Gen) const { return {}; }
+
+mlir::Value NumberExprAST::mlirgen(MLIRGen &Gen) const {
+  return Gen.getConstant(Val);
+}
+
+mlir::Value VariableExprAST::mlirgen(MLIRGen &Gen) const {
+  return Gen.read(Name);
+}
+
+mlir::Value IfExprAST::mlirgen(MLIRGen &Gen) const {
+  mlir::Value CondV = Cond->mlirgen(Gen);
+  if (!CondV)
+    return {};
+
+  mlir::OpBuilder &Builder = Gen.getBuilder();
+  auto If = Builder.create<mlir::scf::IfOp>(
+      Gen.getLoc(), Builder.getF64Type(), Gen.toBool(CondV),
+      /*withElseRegion*/ true);
+
+  mlir::OpBuilder::InsertionGuard Guard(Builder);
+  Builder.setInsertionPointToStart(&If.getThenRegion().front());
+  mlir::Value ThenV = Then->mlirgen(Gen);
+  if (!ThenV)
+    return {};
+  Builder.create<mlir::scf::YieldOp>(Gen.getLoc(), ThenV);
+
+  Builder.setInsertionPointToStart(&If.getElseRegion().front());
+  mlir::Value ElseV = Else->mlirgen(Gen);
+  if (!ElseV)
+    return {};
+  Builder.create<mlir::scf::YieldOp>(Gen.getLoc(), ElseV);
+
+  return If.getResult(0);
+}
+
+mlir::Value ForExprAST::mlirgen(MLIRGen &Gen) const {
+  // Only counted loops are covered: the variable starts at an integer and
+  // steps by a positive integer literal while it is below a bound the body
+  // doesn't assign. The condition is checked after the body, so the body
+  // runs at least once.
+  const ExprAST *Bound = End->getUpperBoundOf(VarName);
+  if (!Bound || !Start->isIntegerLiteral() ||
+      (Step && !Step->isIntegerLiteral()))
+    return {};
+  int64_t StartV = *Start->getLiteralValue();
+  int64_t StepV = Step ? *Step->getLiteralValue() : 1;
+  if (StepV <= 0)
+    return {};
+
+  const std::string *BoundVar = Bound->getAssignableName();
+  std::optional<double> BoundLiteral = Bound->getLiteralValue();
+  if ((!BoundVar && !BoundLiteral) || (BoundVar && *BoundVar == VarName))
+    return {};
+
+  // The condition is checked on the value the body ran with, so the body
+  // also runs for the first value at or past the bound: the loop runs up to
+  // a step past the bound rounded up, and at least once.
+  mlir::OpBuilder &Builder = Gen.getBuilder();
+  mlir::Location Loc = Gen.getLoc();
+  mlir::Value Lower =
+      Builder.create<mlir::arith::ConstantIndexOp>(Loc, StartV);
+  mlir::Value Upper;
+  if (BoundLiteral) {
+    if (std::fabs(*BoundLiteral) >= 0x1p53)
+      return {};
+    int64_t UpperV =
+        std::max<int64_t>(std::ceil(*BoundLiteral) + StepV, StartV + 1);
+    Upper = Builder.create<mlir::arith::ConstantIndexOp>(Loc, UpperV);
+  } else {
+    mlir::Value BoundV = Gen.read(*BoundVar);
+    if (!BoundV)
+      return {};
+    // Saturate the bound before converting it, which is poison out of range.
+    // Like emitLimit, a NaN bound is above any variable, as Var < NaN holds.
+    // 2^62 iterations never end in practice, and leave room for the step.
+    mlir::Value Ceil = Builder.create<mlir::math::CeilOp>(Loc, BoundV);
+    mlir::Value Max = Gen.getConstant(0x1p62), Min = Gen.getConstant(-0x1p62);
+    mlir::Value AboveOrNaN = Builder.create<mlir::arith::CmpFOp>(
+        Loc, mlir::arith::CmpFPredicate::UGT, Ceil, Max);
+    Ceil = Builder.create<mlir::arith::SelectOp>(Loc, AboveOrNaN, Max, Ceil);
+    mlir::Value Below = Builder.create<mlir::arith::CmpFOp>(
+        Loc, mlir::arith::CmpFPredicate::OLT, Ceil, Min);
+    Ceil = Builder.create<mlir::arith::SelectOp>(Loc, Below, Min, Ceil);
+    mlir::Value Int = Builder.create<mlir::arith::FPToSIOp>(
+        Loc, Builder.getI64Type(), Ceil);
+    mlir::Value Index = Builder.create<mlir::arith::IndexCastOp>(
+        Loc, Builder.getIndexType(), Int);
+    mlir::Value Past = Builder.create<mlir::arith::AddIOp>(
+        Loc, Index, Builder.create<mlir::arith::ConstantIndexOp>(Loc, StepV));
+    mlir::Value Once =
+        Builder.create<mlir::arith::ConstantIndexOp>(Loc, StartV + 1);
+    Upper = Builder.create<mlir::arith::MaxSIOp>(Loc, Past, Once);
+  }
+
+  unsigned BoundWrites = BoundVar ? Gen.getWrites(*BoundVar) : 0;
+  bool Emitted = Gen.emitLoop(VarName, Lower, Upper, StepV,
+                              [&] { return Body->mlirgen(Gen) != nullptr; });
+  if (!Emitted || (BoundVar && Gen.getWrites(*BoundVar) != BoundWrites))
+    return {};
+
+  // for expr always returns 0.0.
+  return Gen.getConstant(0.0);
+}
+
+mlir::Value VarExprAST::mlirgen(MLIRGen &Gen) const {
+  // Each initializer is emitted before its variable is in scope.
+  for (const VarBinding &Binding : VarNames) {
+    if (Binding.Type && *Binding.Type != ValueType::Double)
+      return {};
+    mlir::Value InitV =
+        Binding.Init ? Binding.Init->mlirgen(Gen) : Gen.getConstant(0.0);
+    if (!InitV)
+      return {};
+    Gen.bind(Binding.Name, InitV);
+  }
+
+  mlir::Value BodyV = Body->mlirgen(Gen);
+  Gen.unbind(VarNames.size());
+  return BodyV;
+}
+
+mlir::Value UnaryExprAST::mlirgen(MLIRGen &Gen) const {
+  mlir::Value OperandV = Operand->mlirgen(Gen);
+  if (!OperandV)
+    return {};
+  return Gen.call(std::string("unary") + Opcode, OperandV);
+}
+
+mlir::Value BinaryExprAST::mlirgen(MLIRGen &Gen) const {
+  if (Op == '=') {
+    const std::string *Name = LHS->getAssignableName();
+    if (!Name)
+      return {};
+    mlir::Value Val = RHS->mlirgen(Gen);
+    if (!Val)
+      return {};
+    return Gen.write(*Name, Val);
+  }
+
+  // Emit the operators of a chain bottom up from its leftmost operand,
+  // rather than recursing down the left operands.
+  std::vector<const BinaryExprAST *> Spine = getLeftSpine();
+  mlir::Value L = Spine.back()->LHS->mlirgen(Gen);
+  if (!L)
+    return {};
+  for (auto I = Spine.rbegin(), E = Spine.rend(); I != E; ++I) {
+    mlir::Value R = (*I)->RHS->mlirgen(Gen);
+    if (!R)
+      return {};
+    L = (*I)->emitOperator(Gen, L, R);
+    if (!L)
+      return {};
+  }
+  return L;
+}
+
+mlir::Value BinaryExprAST::emitOperator(MLIRGen &Gen, mlir::Value L,
+                                        mlir::Value R) const {
+  mlir::OpBuilder &Builder = Gen.getBuilder();
+  mlir::Location Loc = Gen.getLoc();
+  switch (Op) {
+  case '+':
+    return Builder.create<mlir::arith::AddFOp>(Loc, L, R);
+  case '-':
+    return Builder.create<mlir::arith::SubFOp>(Loc, L, R);
+  case '*':
+    return Builder.create<mlir::arith::MulFOp>(Loc, L, R);
+  case '/':
+    return Builder.create<mlir::arith::DivFOp>(Loc, L, R);
+  case '<':
+    return Gen.fromBool(Builder.create<mlir::arith::CmpFOp>(
+        Loc, mlir::arith::CmpFPredicate::ULT, L, R));
+  default:
+    break;
+  }
+
+  mlir::Value Ops[] = {L, R};
+  return Gen.call(std::string("binary") + Op, Ops);
+}
+
+mlir::Value CallExprAST::mlirgen(MLIRGen &Gen) const {
+  llvm::SmallVector<mlir::Value> ArgsV;
+  for (const auto &Arg : Args) {
+    ArgsV.push_back(Arg->mlirgen(Gen));
+    if (!ArgsV.back())
+      return {};
+  }
+  return Gen.call(Callee, ArgsV);
+}
+
+mlir::Value SpawnExprAST::mlirgen(MLIRGen &Gen) const { return {}; }
+
+mlir::Value AwaitExprAST::mlirgen(MLIRGen &Gen) const { return {}; }
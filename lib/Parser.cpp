@@ -9,7 +9,13 @@
 //===----------------------------------------------------------------------===//
 
 #include "Parser.h"
+#include "Runtime.h"
+#include "TaskRuntime.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/SaveAndRestore.h"
 #include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <climits>
 
 std::unique_ptr<ExprAST> Parser::ParseNumberExpr() {
   auto Result = std::make_unique<NumberExprAST>(CurLexer.getNumVal());
@@ -34,32 +40,69 @@ std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
 
   CurLexer.getNextTok(); // eat identifier.
 
+  // A reduction names how the values of a for-style loop are combined.
+  if (CurLexer.getCurTok() == TOK_FOR)
+    if (auto Kind = ReduceExprAST::getKind(IdName))
+      return ParseForExpr(Kind);
+
   if (CurLexer.getCurTok() != '(') // Simple variable reference.
     return std::make_unique<VariableExprAST>(IdName);
 
   // Call.
   CurLexer.getNextTok(); // eat (.
   std::vector<std::unique_ptr<ExprAST>> Args;
+  if (!ParseCallArgs(Args))
+    return nullptr;
+
+  return std::make_unique<CallExprAST>(IdName, std::move(Args));
+}
+
+bool Parser::ParseCallArgs(std::vector<std::unique_ptr<ExprAST>> &Args) {
   if (CurLexer.getCurTok() != ')') {
     while (true) {
       if (auto Arg = ParseExpression())
         Args.push_back(std::move(Arg));
       else
-        return nullptr;
+        return false;
 
       if (CurLexer.getCurTok() == ')')
         break;
 
-      if (CurLexer.getCurTok() != ',')
-        return Logger::LogError("Expected ')' or ',' in argument list");
+      if (CurLexer.getCurTok() != ',') {
+        Logger::LogError("Expected ')' or ',' in argument list");
+        return false;
+      }
       CurLexer.getNextTok();
     }
   }
 
   // eat ).
   CurLexer.getNextTok();
+  return true;
+}
 
-  return std::make_unique<CallExprAST>(IdName, std::move(Args));
+std::unique_ptr<ExprAST> Parser::ParseSpawnExpr() {
+  CurLexer.getNextTok(); // eat the spawn.
+  if (CurLexer.getCurTok() != TOK_IDENTIFIER)
+    return Logger::LogError("expected function call after spawn");
+  std::string IdName = CurLexer.getIdentifierStr();
+  CurLexer.getNextTok(); // eat identifier.
+
+  if (CurLexer.getCurTok() != '(')
+    return Logger::LogError("expected function call after spawn");
+  CurLexer.getNextTok(); // eat (.
+  std::vector<std::unique_ptr<ExprAST>> Args;
+  if (!ParseCallArgs(Args))
+    return nullptr;
+
+  return std::make_unique<SpawnExprAST>(IdName, std::move(Args));
+}
+
+std::unique_ptr<ExprAST> Parser::ParseAwaitExpr() {
+  CurLexer.getNextTok(); // eat the await.
+  if (auto Future = ParseUnary())
+    return std::make_unique<AwaitExprAST>(std::move(Future));
+  return nullptr;
 }
 
 std::unique_ptr<ExprAST> Parser::ParsePrimary() {
@@ -76,11 +119,39 @@ std::unique_ptr<ExprAST> Parser::ParsePrimary() {
     return ParseIfExpr();
   case TOK_FOR:
     return ParseForExpr();
+  case TOK_VAR:
+    return ParseVarExpr();
+  case TOK_SPAWN:
+    return ParseSpawnExpr();
+  case TOK_AWAIT:
+    return ParseAwaitExpr();
   }
 }
 
+std::unique_ptr<ExprAST> Parser::ParseUnary() {
+  // Every nested expression passes through here, so this bounds recursion.
+  if (NestingDepth >= Opts.MaxNestingDepth)
+    return Logger::LogError("Expression nesting exceeds the maximum depth");
+  llvm::SaveAndRestore<unsigned> Nested(NestingDepth, NestingDepth + 1);
+
+  // If the current token is not an operator, it must be a primary expr.
+  int Tok = CurLexer.getCurTok();
+  if (!isascii(Tok) || Tok == '(' || Tok == ',')
+    return ParsePrimary();
+
+  // If this is a unary operator, read it.
+  int Opc = Tok;
+  CurLexer.getNextTok();
+  if (auto Operand = ParseUnary())
+    return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+  return nullptr;
+}
+
 std::unique_ptr<ExprAST> Parser::ParseExpression() {
-  auto LHS = ParsePrimary();
+  if (Opts.Iterative)
+    return ParseExpressionIterative();
+
+  auto LHS = ParseUnary();
   if (!LHS)
     return nullptr;
   return ParseBinOpRHS(0, std::move(LHS));
@@ -101,8 +172,8 @@ std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec,
     int BinOp = CurLexer.getCurTok();
     CurLexer.getNextTok(); // eat binary operator.
 
-    // Parse the primary expression after the binary operator.
-    auto RHS = ParsePrimary();
+    // Parse the unary expression after the binary operator.
+    auto RHS = ParseUnary();
     if (!RHS)
       return nullptr;
 
@@ -121,37 +192,497 @@ std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec,
   } // back to the while loop.
 }
 
+namespace {
+/// PendingOp - An operator waiting on the stack for its right operand.
+struct PendingOp {
+  int Op;
+  int Prec; // Unary operators and await bind tighter than any binary one.
+  bool IsUnary;
+};
+
+/// OpenConstruct - A construct whose sub-expressions are being parsed.
+struct OpenConstruct {
+  enum ConstructKind { Root, Paren, Call, Spawn, If, For, Var } Kind;
+  unsigned Stage = 0;  // Which sub-expression is being parsed.
+  size_t OpBase = 0;   // Size of the operator stack when the construct opened.
+  std::string Name;    // Callee or induction variable.
+  std::optional<ReduceExprAST::ReduceKind> Reduction; // Of a reducing for.
+  std::vector<std::unique_ptr<ExprAST>> Parts;
+  std::vector<VarBinding> Bindings;
+};
+} // namespace
+
+std::unique_ptr<ExprAST> Parser::ParseExpressionIterative() {
+  std::vector<std::unique_ptr<ExprAST>> Operands;
+  std::vector<PendingOp> Ops;
+  std::vector<OpenConstruct> Constructs(1);
+  Constructs.back().Kind = OpenConstruct::Root;
+  unsigned Depth = 1;
+
+  // Enter a nested construct, its first sub-expression starts next.
+  auto Open = [&](OpenConstruct::ConstructKind Kind) {
+    if (Depth >= Opts.MaxNestingDepth) {
+      Logger::LogError("Expression nesting exceeds the maximum depth");
+      return false;
+    }
+    ++Depth;
+    Constructs.emplace_back();
+    Constructs.back().Kind = Kind;
+    Constructs.back().OpBase = Ops.size();
+    return true;
+  };
+
+  // Leave the innermost construct, which parsed into Node.
+  auto Close = [&](std::unique_ptr<ExprAST> Node) {
+    Constructs.pop_back();
+    --Depth;
+    Operands.push_back(std::move(Node));
+  };
+
+  // Apply the operator on top of the stack to its operands.
+  auto Reduce = [&]() {
+    PendingOp Top = Ops.back();
+    Ops.pop_back();
+    auto RHS = std::move(Operands.back());
+    Operands.pop_back();
+    if (Top.IsUnary) {
+      --Depth;
+      if (Top.Op == TOK_AWAIT)
+        Operands.push_back(std::make_unique<AwaitExprAST>(std::move(RHS)));
+      else
+        Operands.push_back(
+            std::make_unique<UnaryExprAST>(Top.Op, std::move(RHS)));
+      return;
+    }
+    auto LHS = std::move(Operands.back());
+    Operands.pop_back();
+    Operands.push_back(std::make_unique<BinaryExprAST>(Top.Op, std::move(LHS),
+                                                       std::move(RHS)));
+  };
+
+  // Read var bindings up to the next initializer or the body, both of which
+  // are parsed as sub-expressions of the construct.
+  auto ParseVarBindings = [&](OpenConstruct &C, bool AfterBinding) {
+    while (true) {
+      if (AfterBinding) {
+        if (CurLexer.getCurTok() == TOK_IN) {
+          CurLexer.getNextTok(); // eat 'in'.
+          C.Stage = 1;
+          return true;
+        }
+        if (CurLexer.getCurTok() != ',') {
+          Logger::LogError("expected 'in' keyword after 'var'");
+          return false;
+        }
+        CurLexer.getNextTok(); // eat the ','.
+      }
+      AfterBinding = true;
+
+      if (CurLexer.getCurTok() != TOK_IDENTIFIER) {
+        Logger::LogError("expected identifier list after var");
+        return false;
+      }
+      VarBinding Binding;
+      Binding.Name = CurLexer.getIdentifierStr();
+      CurLexer.getNextTok(); // eat identifier.
+
+      if (CurLexer.getCurTok() == ':') {
+        ValueType Ty;
+        if (!ParseOptionalType(Ty))
+          return false;
+        Binding.Type = Ty;
+      }
+      C.Bindings.push_back(std::move(Binding));
+
+      if (CurLexer.getCurTok() == '=') {
+        CurLexer.getNextTok(); // eat the '='.
+        C.Stage = 0;
+        return true;
+      }
+    }
+  };
+
+  // The reduction named before the for about to be opened, if any.
+  std::optional<ReduceExprAST::ReduceKind> Reduction;
+
+  bool ExpectOperand = true;
+  while (true) {
+    int Tok = CurLexer.getCurTok();
+
+    if (ExpectOperand) {
+      switch (Tok) {
+      case TOK_NUMBER:
+        Operands.push_back(
+            std::make_unique<NumberExprAST>(CurLexer.getNumVal()));
+        CurLexer.getNextTok(); // consume the number
+        ExpectOperand = false;
+        continue;
+      case TOK_IDENTIFIER: {
+        std::string IdName = CurLexer.getIdentifierStr();
+        CurLexer.getNextTok(); // eat identifier.
+        if (CurLexer.getCurTok() == TOK_FOR) {
+          Reduction = ReduceExprAST::getKind(IdName);
+          if (Reduction)
+            continue;
+        }
+        if (CurLexer.getCurTok() != '(') {
+          Operands.push_back(std::make_unique<VariableExprAST>(IdName));
+          ExpectOperand = false;
+          continue;
+        }
+        CurLexer.getNextTok(); // eat (.
+        if (CurLexer.getCurTok() == ')') {
+          CurLexer.getNextTok(); // eat ).
+          Operands.push_back(std::make_unique<CallExprAST>(
+              IdName, std::vector<std::unique_ptr<ExprAST>>()));
+          ExpectOperand = false;
+          continue;
+        }
+        if (!Open(OpenConstruct::Call))
+          return nullptr;
+        Constructs.back().Name = IdName;
+        continue;
+      }
+      case TOK_SPAWN: {
+        CurLexer.getNextTok(); // eat the spawn.
+        if (CurLexer.getCurTok() != TOK_IDENTIFIER)
+          return Logger::LogError("expected function call after spawn");
+        std::string IdName = CurLexer.getIdentifierStr();
+        CurLexer.getNextTok(); // eat identifier.
+        if (CurLexer.getCurTok() != '(')
+          return Logger::LogError("expected function call after spawn");
+        CurLexer.getNextTok(); // eat (.
+        if (CurLexer.getCurTok() == ')') {
+          CurLexer.getNextTok(); // eat ).
+          Operands.push_back(std::make_unique<SpawnExprAST>(
+              IdName, std::vector<std::unique_ptr<ExprAST>>()));
+          ExpectOperand = false;
+          continue;
+        }
+        if (!Open(OpenConstruct::Spawn))
+          return nullptr;
+        Constructs.back().Name = IdName;
+        continue;
+      }
+      case '(':
+        CurLexer.getNextTok(); // eat (.
+        if (!Open(OpenConstruct::Paren))
+          return nullptr;
+        continue;
+      case TOK_IF:
+        CurLexer.getNextTok(); // eat the if.
+        if (!Open(OpenConstruct::If))
+          return nullptr;
+        continue;
+      case TOK_FOR: {
+        CurLexer.getNextTok(); // eat the for.
+        if (CurLexer.getCurTok() != TOK_IDENTIFIER)
+          return Logger::LogError("expected identifier after for");
+        std::string IdName = CurLexer.getIdentifierStr();
+        CurLexer.getNextTok(); // eat identifier.
+        if (CurLexer.getCurTok() != '=')
+          return Logger::LogError("expected '=' after for");
+        CurLexer.getNextTok(); // eat '='.
+        if (!Open(OpenConstruct::For))
+          return nullptr;
+        Constructs.back().Name = IdName;
+        Constructs.back().Reduction = Reduction;
+        Reduction.reset();
+        continue;
+      }
+      case TOK_VAR:
+        CurLexer.getNextTok(); // eat the var.
+        if (CurLexer.getCurTok() != TOK_IDENTIFIER)
+          return Logger::LogError("expected identifier after var");
+        if (!Open(OpenConstruct::Var) ||
+            !ParseVarBindings(Constructs.back(), false))
+          return nullptr;
+        continue;
+      default:
+        // Any other character is a unary operator, as in ParseUnary, and
+        // await parses like one.
+        if ((!isascii(Tok) && Tok != TOK_AWAIT) || Tok == ',')
+          return Logger::LogError(
+              "Unknown token when expecting an expression");
+        if (Depth >= Opts.MaxNestingDepth)
+          return Logger::LogError(
+              "Expression nesting exceeds the maximum depth");
+        ++Depth;
+        Ops.push_back({Tok, INT_MAX, true});
+        CurLexer.getNextTok(); // eat the operator.
+        continue;
+      }
+    }
+
+    OpenConstruct &C = Constructs.back();
+
+    // A binary operator first applies the pending operators that bind at
+    // least as tightly, which makes operators of equal precedence left
+    // associative like ParseBinOpRHS.
+    int TokPrec = BinOpPrecedence.GetBinOpPrecedence(CurLexer);
+    if (TokPrec > 0) {
+      while (Ops.size() > C.OpBase && Ops.back().Prec >= TokPrec)
+        Reduce();
+      Ops.push_back({Tok, TokPrec, false});
+      CurLexer.getNextTok(); // eat binary operator.
+      ExpectOperand = true;
+      continue;
+    }
+
+    // Otherwise the current sub-expression of the innermost construct ends
+    // here, and the construct decides what comes next.
+    while (Ops.size() > C.OpBase)
+      Reduce();
+    auto Result = std::move(Operands.back());
+    Operands.pop_back();
+
+    switch (C.Kind) {
+    case OpenConstruct::Root:
+      return Result;
+    case OpenConstruct::Paren:
+      if (Tok != ')')
+        return Logger::LogError("expected ')'");
+      CurLexer.getNextTok(); // eat ).
+      Close(std::move(Result));
+      continue;
+    case OpenConstruct::Call:
+    case OpenConstruct::Spawn:
+      C.Parts.push_back(std::move(Result));
+      if (Tok == ',') {
+        CurLexer.getNextTok();
+        ExpectOperand = true;
+        continue;
+      }
+      if (Tok != ')')
+        return Logger::LogError("Expected ')' or ',' in argument list");
+      CurLexer.getNextTok(); // eat ).
+      if (C.Kind == OpenConstruct::Spawn)
+        Close(std::make_unique<SpawnExprAST>(C.Name, std::move(C.Parts)));
+      else
+        Close(std::make_unique<CallExprAST>(C.Name, std::move(C.Parts)));
+      continue;
+    case OpenConstruct::If:
+      C.Parts.push_back(std::move(Result));
+      if (C.Stage == 2) {
+        Close(std::make_unique<IfExprAST>(std::move(C.Parts[0]),
+                                          std::move(C.Parts[1]),
+                                          std::move(C.Parts[2])));
+        continue;
+      }
+      if (C.Stage == 0 && Tok != TOK_THEN)
+        return Logger::LogError("expected then");
+      if (C.Stage == 1 && Tok != TOK_ELSE)
+        return Logger::LogError("expected else");
+      CurLexer.getNextTok(); // eat the then/else.
+      ++C.Stage;
+      ExpectOperand = true;
+      continue;
+    case OpenConstruct::For:
+      // Stages are the start, end, step and body.
+      if (C.Stage == 3) {
+        if (C.Reduction)
+          Close(std::make_unique<ReduceExprAST>(
+              *C.Reduction, C.Name, std::move(C.Parts[0]),
+              std::move(C.Parts[1]), std::move(C.Parts[2]),
+              std::move(Result)));
+        else
+          Close(std::make_unique<ForExprAST>(
+              C.Name, std::move(C.Parts[0]), std::move(C.Parts[1]),
+              std::move(C.Parts[2]), std::move(Result)));
+        continue;
+      }
+      C.Parts.push_back(std::move(Result));
+      if (C.Stage == 0) {
+        if (Tok != ',')
+          return Logger::LogError("expected ',' after for start value");
+        CurLexer.getNextTok();
+        C.Stage = 1;
+        ExpectOperand = true;
+        continue;
+      }
+      if (C.Stage == 1) {
+        // The step value is optional.
+        if (Tok == ',') {
+          CurLexer.getNextTok();
+          C.Stage = 2;
+          ExpectOperand = true;
+          continue;
+        }
+        C.Parts.push_back(nullptr);
+      }
+      if (CurLexer.getCurTok() != TOK_IN)
+        return Logger::LogError("expected 'in' after for");
+      CurLexer.getNextTok(); // eat 'in'.
+      C.Stage = 3;
+      ExpectOperand = true;
+      continue;
+    case OpenConstruct::Var:
+      // Stage 0 is the initializer of the last binding, 1 is the body.
+      if (C.Stage == 1) {
+        Close(std::make_unique<VarExprAST>(std::move(C.Bindings),
+                                           std::move(Result)));
+        continue;
+      }
+      C.Bindings.back().Init = std::move(Result);
+      if (!ParseVarBindings(C, true))
+        return nullptr;
+      ExpectOperand = true;
+      continue;
+    }
+  }
+}
+
+bool Parser::ParseOptionalType(ValueType &Ty) {
+  if (CurLexer.getCurTok() != ':')
+    return true;
+  CurLexer.getNextTok(); // eat ':'.
+
+  if (CurLexer.getCurTok() != TOK_IDENTIFIER) {
+    Logger::LogError("Expected type name after ':'");
+    return false;
+  }
+
+  const std::string &Name = CurLexer.getIdentifierStr();
+  if (Name == "double")
+    Ty = ValueType::Double;
+  else if (Name == "float")
+    Ty = ValueType::Float;
+  else if (Name == "int")
+    Ty = ValueType::Int;
+  else if (Name == "bool")
+    Ty = ValueType::Bool;
+  else {
+    Logger::LogError("Unknown type name");
+    return false;
+  }
+
+  CurLexer.getNextTok(); // eat type name.
+  return true;
+}
+
 std::unique_ptr<ProtoTypeAST> Parser::ParseProtoType() {
-  if (CurLexer.getCurTok() != TOK_IDENTIFIER)
+  std::string FnName;
+
+  unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
+  unsigned BinaryPrecedence = 30;
+
+  switch (CurLexer.getCurTok()) {
+  default:
     return Logger::LogErrorP("Expected function name in prototype");
+  case TOK_IDENTIFIER:
+    FnName = CurLexer.getIdentifierStr();
+    Kind = 0;
+    CurLexer.getNextTok();
+    break;
+  case TOK_UNARY:
+    CurLexer.getNextTok();
+    if (!isascii(CurLexer.getCurTok()))
+      return Logger::LogErrorP("Expected unary operator");
+    FnName = "unary";
+    FnName += (char)CurLexer.getCurTok();
+    Kind = 1;
+    CurLexer.getNextTok();
+    break;
+  case TOK_BINARY:
+    CurLexer.getNextTok();
+    if (!isascii(CurLexer.getCurTok()))
+      return Logger::LogErrorP("Expected binary operator");
+    if (OpPrecedence::IsBuiltinBinOp(CurLexer.getCurTok()))
+      return Logger::LogErrorP("Cannot redefine a standard binary operator");
+    FnName = "binary";
+    FnName += (char)CurLexer.getCurTok();
+    Kind = 2;
+    CurLexer.getNextTok();
 
-  std::string FnName = CurLexer.getIdentifierStr();
-  CurLexer.getNextTok();
+    // Read the precedence if present.
+    if (CurLexer.getCurTok() == TOK_NUMBER) {
+      if (CurLexer.getNumVal() < 1 || CurLexer.getNumVal() > 100)
+        return Logger::LogErrorP("Invalid precedence: must be 1..100");
+      BinaryPrecedence = (unsigned)CurLexer.getNumVal();
+      CurLexer.getNextTok();
+    }
+    break;
+  }
 
   if (CurLexer.getCurTok() != '(')
     return Logger::LogErrorP("Expected '(' in prototype");
 
   // Read the argument list.
   std::vector<std::string> ArgNames;
-  while (CurLexer.getNextTok() == TOK_IDENTIFIER)
+  std::vector<ValueType> ArgTypes;
+  CurLexer.getNextTok(); // eat (.
+  while (CurLexer.getCurTok() == TOK_IDENTIFIER) {
     ArgNames.push_back(CurLexer.getIdentifierStr());
+    CurLexer.getNextTok(); // eat identifier.
+
+    ValueType Ty = ValueType::Double;
+    if (!ParseOptionalType(Ty))
+      return nullptr;
+    ArgTypes.push_back(Ty);
+  }
   if (CurLexer.getCurTok() != ')')
     return Logger::LogErrorP("Expected ')' in prototype");
 
   // done.
   CurLexer.getNextTok(); // eat ).
 
-  return std::make_unique<ProtoTypeAST>(FnName, std::move(ArgNames));
+  ValueType RetType = ValueType::Double;
+  if (!ParseOptionalType(RetType))
+    return nullptr;
+
+  // Verify right number of names for operator.
+  if (Kind && ArgNames.size() != Kind)
+    return Logger::LogErrorP("Invalid number of operands for operator");
+
+  return std::make_unique<ProtoTypeAST>(FnName, std::move(ArgNames), Kind != 0,
+                                        BinaryPrecedence, std::move(ArgTypes),
+                                        RetType);
+}
+
+std::optional<FastMathPolicy> Parser::ParseFastMath() {
+  CurLexer.getNextTok(); // eat fastmath.
+
+  // A bare fastmath enables everything.
+  if (CurLexer.getCurTok() != '(')
+    return FastMathPolicy::fast();
+  CurLexer.getNextTok(); // eat (.
+
+  // Otherwise only the listed flags, an empty list means strict semantics.
+  FastMathPolicy Policy;
+  while (CurLexer.getCurTok() == TOK_IDENTIFIER) {
+    if (!Policy.enable(CurLexer.getIdentifierStr())) {
+      Logger::LogError("Unknown fast-math flag");
+      return std::nullopt;
+    }
+    CurLexer.getNextTok(); // eat flag.
+  }
+
+  if (CurLexer.getCurTok() != ')') {
+    Logger::LogError("Expected ')' after fast-math flags");
+    return std::nullopt;
+  }
+  CurLexer.getNextTok(); // eat ).
+  return Policy;
 }
 
 std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
+  unsigned Line = CurLexer.getTokLine();
   CurLexer.getNextTok(); // eat def.
+
+  std::optional<FastMathPolicy> FastMath;
+  if (CurLexer.getCurTok() == TOK_FASTMATH) {
+    FastMath = ParseFastMath();
+    if (!FastMath)
+      return nullptr;
+  }
+
   auto Proto = ParseProtoType();
   if (!Proto)
     return nullptr;
 
   if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E),
+                                         FastMath, Line);
   return nullptr;
 }
 
@@ -161,11 +692,13 @@ std::unique_ptr<ProtoTypeAST> Parser::ParseExtern() {
 }
 
 std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
+  unsigned Line = CurLexer.getTokLine();
   if (auto E = ParseExpression()) {
     // Make anonymous Proto.
     auto Proto = std::make_unique<ProtoTypeAST>("__anon_expr",
                                                 std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E),
+                                         std::nullopt, Line);
   }
   return nullptr;
 }
@@ -198,7 +731,8 @@ std::unique_ptr<ExprAST> Parser::ParseIfExpr() {
                                      std::move(Else));
 }
 
-std::unique_ptr<ExprAST> Parser::ParseForExpr() {
+std::unique_ptr<ExprAST>
+Parser::ParseForExpr(std::optional<ReduceExprAST::ReduceKind> Reduction) {
   CurLexer.getNextTok(); // eat the for.
 
   if (CurLexer.getCurTok() != TOK_IDENTIFIER)
@@ -239,79 +773,443 @@ std::unique_ptr<ExprAST> Parser::ParseForExpr() {
   if (!Body)
     return nullptr;
 
+  if (Reduction)
+    return std::make_unique<ReduceExprAST>(*Reduction, IdName, std::move(Start),
+                                           std::move(End), std::move(Step),
+                                           std::move(Body));
   return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
                                       std::move(Step), std::move(Body));
 }
 
+std::unique_ptr<ExprAST> Parser::ParseVarExpr() {
+  CurLexer.getNextTok(); // eat the var.
+
+  std::vector<VarBinding> VarNames;
+
+  // At least one variable name is required.
+  if (CurLexer.getCurTok() != TOK_IDENTIFIER)
+    return Logger::LogError("expected identifier after var");
+
+  while (true) {
+    std::string Name = CurLexer.getIdentifierStr();
+    CurLexer.getNextTok(); // eat identifier.
+
+    // Read the optional type annotation.
+    std::optional<ValueType> Type;
+    if (CurLexer.getCurTok() == ':') {
+      ValueType Ty;
+      if (!ParseOptionalType(Ty))
+        return nullptr;
+      Type = Ty;
+    }
+
+    // Read the optional initializer.
+    std::unique_ptr<ExprAST> Init = nullptr;
+    if (CurLexer.getCurTok() == '=') {
+      CurLexer.getNextTok(); // eat the '='.
+
+      Init = ParseExpression();
+      if (!Init)
+        return nullptr;
+    }
+
+    VarNames.push_back({Name, Type, std::move(Init)});
+
+    // End of var list, exit loop.
+    if (CurLexer.getCurTok() != ',')
+      break;
+    CurLexer.getNextTok(); // eat the ','.
+
+    if (CurLexer.getCurTok() != TOK_IDENTIFIER)
+      return Logger::LogError("expected identifier list after var");
+  }
+
+  // At this point, we have to have 'in'.
+  if (CurLexer.getCurTok() != TOK_IN)
+    return Logger::LogError("expected 'in' keyword after 'var'");
+  CurLexer.getNextTok(); // eat 'in'.
+
+  auto Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+
+  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+}
+
 void Parser::HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen(CG)) {
+  if (auto FnAST = ParseDefinition())
+    CodegenDefinition(std::move(FnAST));
+  else
+    RecoverFromError();
+}
+
+void Parser::HandleExtern() {
+  if (auto ProtoAST = ParseExtern())
+    CodegenExtern(std::move(ProtoAST));
+  else
+    RecoverFromError();
+}
+
+void Parser::HandleTopLevelExpression() {
+  // Evaluate top-level expressions as an anonymous function.
+  if (auto FnAST = ParseTopLevelExpr())
+    CodegenTopLevelExpression(std::move(FnAST));
+  else
+    RecoverFromError();
+}
+
+void Parser::CodegenDefinition(std::unique_ptr<FunctionAST> FnAST) {
+  CG.EnsureInitialised();
+  std::string Name = FnAST->getProto().getName();
+  auto Start = std::chrono::steady_clock::now();
+
+  // A redefinition replaces the live version behind its stub, so existing
+  // callers must be able to keep calling it the same way.
+  auto Existing = CG.Definitions.find(Name);
+  if (Existing != CG.Definitions.end()) {
+    if (!CG.Opts.HotSwap || FnAST->getProto().isOperator()) {
+      Logger::LogError("Function cannot be redefined");
+      return;
+    }
+    if (!CG.FunctionProtos[Name]->hasSameSignature(FnAST->getProto())) {
+      Logger::LogError("Redefinition must keep the signature");
+      return;
+    }
+  }
+
+  // A definition structurally identical to an earlier one becomes an alias
+  // of its code. Definitions behind stubs may be replaced, and operators
+  // must be installed, so they are always compiled.
+  std::string Key;
+  if (CG.Opts.Dedup && !CG.AOT && !CG.usesStub(FnAST->getProto()) &&
+      !FnAST->getProto().isOperator() && Existing == CG.Definitions.end()) {
+    Key = FnAST->getStructuralKey().value_or("");
+    if (!Key.empty() && CG.ReuseDefinition(Key, FnAST))
+      return;
+  }
+
+  CG.ForgetCalls(Name);
+  if (CG.Opts.Profile)
+    CG.SourceLines[Name] = FnAST->getLine();
+  if (auto *FnIR = FnAST->codegen(CG)) {
+    if (CG.Opts.PrintIR) {
       fprintf(stderr, "Read a function definition:\n");
       FnIR->print(llvm::errs());
       fprintf(stderr, "\n");
+    }
+
+    // The object gets the definition under its own name, before it is
+    // optimised for the JIT's CPU.
+    if (CG.AOT)
+      CG.AOT->addModule(*CG.Module);
+
+    // Install the precedence of a binary operator, so that the expressions
+    // following it can use it.
+    const ProtoTypeAST &Proto = FnAST->getProto();
+    if (!CG.usesStub(Proto) && CG.callsOnlyPureFunctions(*FnIR))
+      CG.PureFunctions.insert(Name);
+    else
+      CG.PureFunctions.erase(Name);
+    if (Proto.isBinaryOp())
+      BinOpPrecedence.SetBinOpPrecedence(Proto.getOperatorName(),
+                                         Proto.getBinaryPrecedence());
+
+    // Retain the definition so that later modules can import its body, unless
+    // it may be replaced.
+    if (!CG.Opts.HotSwap || Proto.isOperator()) {
+      CG.FunctionSizes[Name] = FnIR->getInstructionCount();
+      if (Proto.isOperator() ||
+          CG.FunctionSizes[Name] <= CG.Opts.ImportHotInstrThreshold)
+        CG.ImportableFunctions[Name] = std::move(FnAST);
+    }
 
-      CG.ExitOnError(CG.JIT->addModule(llvm::orc::ThreadSafeModule(
-          std::move(CG.Module), std::move(CG.Context))));
+    if (!CG.usesStub(Proto)) {
+      CG.OptimiseModule();
+      llvm::Error Err = CG.JIT->addModule(llvm::orc::ThreadSafeModule(
+          std::move(CG.Module), std::move(CG.Context)));
       CG.InitialiseModuleAndPassManager();
+      if (Logger::LogError(std::move(Err)))
+        return;
+      CG.Definitions[Name] = FunctionVersion();
+      if (!Key.empty())
+        CG.CompiledFunctions[Key] = Name;
+      return;
     }
-  } else {
-    // Skip token for error recovery.
-    CurLexer.getNextTok();
+
+    // Compile the body under a versioned name, callers only ever see the
+    // stub.
+    unsigned Version = 0;
+    if (Existing != CG.Definitions.end())
+      Version = Existing->second.Version + 1;
+    std::string ImplName = Name + ".v" + std::to_string(Version);
+    FnIR->setName(ImplName);
+
+    auto RT = CG.JIT->getMainJITDylib().createResourceTracker();
+    CG.OptimiseModule();
+
+    // Keep the optimised module so that the definition can be compiled again
+    // once it has been evicted.
+    std::shared_ptr<llvm::SmallVector<char, 0>> Bitcode;
+    if (CG.Opts.MemoryBudget) {
+      Bitcode = std::make_shared<llvm::SmallVector<char, 0>>();
+      llvm::raw_svector_ostream OS(*Bitcode);
+      llvm::WriteBitcodeToFile(*CG.Module, OS);
+    }
+
+    unsigned Instructions = FnIR->getInstructionCount();
+    llvm::Error Err = CG.JIT->addModule(
+        llvm::orc::ThreadSafeModule(std::move(CG.Module),
+                                    std::move(CG.Context)),
+        RT);
+    CG.InitialiseModuleAndPassManager();
+    if (Logger::LogError(std::move(Err))) {
+      Logger::LogError(RT->remove());
+      return;
+    }
+
+    // Looking the body up compiles it, which is all the code it adds. Lazily
+    // compiled bodies are looked up by the trampoline on their first call, or
+    // earlier by speculation.
+    llvm::orc::ExecutorAddr ImplAddr;
+    if (CG.Opts.LazyCompile) {
+      ImplAddr = CG.DeferCompile(Name, ImplName, Instructions);
+    } else {
+      uint64_t CodeSizeBefore = CG.JIT->getCodeSize();
+      auto Impl = CG.JIT->lookup(ImplName);
+      if (Logger::LogError(Impl.takeError())) {
+        Logger::LogError(RT->remove());
+        return;
+      }
+      ImplAddr = Impl->getAddress();
+      if (Bitcode)
+        CG.TrackResidency(Name, ImplName,
+                          CG.JIT->getCodeSize() - CodeSizeBefore,
+                          std::move(Bitcode));
+    }
+
+    if (Existing == CG.Definitions.end()) {
+      if (Logger::LogError(CG.JIT->addStub(Name, ImplAddr))) {
+        Logger::LogError(RT->remove());
+        return;
+      }
+      CG.Definitions[Name] = {Version, RT};
+      CG.EnforceMemoryBudget();
+      return;
+    }
+
+    if (Logger::LogError(CG.JIT->updateStub(Name, ImplAddr))) {
+      Logger::LogError(RT->remove());
+      return;
+    }
+    auto Latency = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - Start);
+    fprintf(Logger::getStream(), "Replaced %s with version %u in %lld us\n",
+            Name.c_str(), Version, static_cast<long long>(Latency.count()));
+
+    CG.RetiredTrackers.push_back(std::move(Existing->second.RT));
+    Existing->second = {Version, RT};
+    CG.ReleaseQuiescentCode();
   }
 }
 
-void Parser::HandleExtern() {
-  if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen(CG)) {
+void Parser::CodegenExtern(std::unique_ptr<ProtoTypeAST> ProtoAST) {
+  CG.EnsureInitialised();
+  if (auto *FnIR = ProtoAST->codegen(CG)) {
+    if (CG.Opts.PrintIR) {
       fprintf(stderr, "Read extern:\n");
       FnIR->print(llvm::errs());
       fprintf(stderr, "\n");
-      CG.FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
     }
-  } else {
-    // Skip token for error recovery.
-    CurLexer.getNextTok();
+    CG.FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
   }
 }
 
-void Parser::HandleTopLevelExpression() {
-  // Evaluate top-level expressions as an anonymous function.
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (auto FnIR = FnAST->codegen(CG)) {
+void Parser::CodegenTopLevelExpression(std::unique_ptr<FunctionAST> FnAST) {
+  CG.EnsureInitialised();
+  unsigned Line = FnAST->getLine();
+
+  // An expression structurally identical to a cached one runs its code.
+  std::string Key;
+  std::optional<llvm::orc::ExecutorAddr> ExprAddr;
+  if (CG.Opts.Dedup) {
+    Key = FnAST->getStructuralKey().value_or("");
+    if (!Key.empty())
+      ExprAddr = CG.findCachedExpression(Key);
+  }
+
+  llvm::orc::ResourceTrackerSP RT;
+  if (!ExprAddr) {
+    auto FnIR = FnAST->codegen(CG);
+    if (!FnIR)
+      return;
+    if (CG.Opts.PrintIR)
       FnIR->print(llvm::errs());
-      auto RT = CG.JIT->getMainJITDylib().createResourceTracker();
 
-      auto TSM = llvm::orc::ThreadSafeModule(std::move(CG.Module),
-                                             std::move(CG.Context));
-      CG.ExitOnError(CG.JIT->addModule(std::move(TSM), RT));
-      CG.InitialiseModuleAndPassManager();
+    // The object gets the specializations the expression made, which later
+    // definitions may call, but not the expression itself.
+    if (CG.AOT)
+      CG.AOT->addModule(*CG.Module, FnIR->getName());
+    CG.OptimiseModule();
 
-      auto ExprSymbol = CG.ExitOnError(CG.JIT->lookup("__anon_expr"));
+    // Cached expressions stay in the JIT, so each gets a name of its own.
+    std::string ExprName = "__anon_expr";
+    if (!Key.empty()) {
+      ExprName += "." + std::to_string(CG.KeyedExpressions);
+      FnIR->setName(ExprName);
+    }
+    RT = CG.JIT->getMainJITDylib().createResourceTracker();
 
-      double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
-      fprintf(stderr, "Evaluated to %f\n", FP());
+    // Errors of the JIT, such as symbols that can't be resolved, fail the
+    // expression rather than the process, which may be serving others.
+    auto TSM = llvm::orc::ThreadSafeModule(std::move(CG.Module),
+                                           std::move(CG.Context));
+    llvm::Error Err = CG.JIT->addModule(std::move(TSM), RT);
+    CG.InitialiseModuleAndPassManager();
+    if (Logger::LogError(std::move(Err))) {
+      Logger::LogError(RT->remove());
+      return;
+    }
 
-      // Without JIT:
-      //
-      // fprintf(stderr, "Read top-level expression:\n");
-      // FnIR->print(llvm::errs());
-      // fprintf(stderr, "\n");
+    // The expression's callees compile in the background while it does.
+    CG.Speculate("__anon_expr", CG.Opts.SpeculationDepth);
+    CG.ForgetCalls("__anon_expr");
 
-      // Remove the anonymous expression.
-      // FnIR->eraseFromParent();
+    auto Expr = CG.JIT->lookup(ExprName);
+    if (Logger::LogError(Expr.takeError())) {
+      Logger::LogError(RT->remove());
+      return;
+    }
+    ExprAddr = Expr->getAddress();
+  }
 
-      CG.ExitOnError(RT->remove());
+  double (*FP)() = ExprAddr->toPtr<double (*)()>();
+  double Result;
+  {
+    // Sessions sharing the runtime take turns, each writing its output to
+    // its own stream.
+    std::unique_lock<std::mutex> Lock;
+    if (CG.Opts.RuntimeLock) {
+      Lock = std::unique_lock<std::mutex>(*CG.Opts.RuntimeLock);
+      kal_set_output(Logger::getStream());
     }
-  } else {
-    // Skip token for error recovery.
+    ++CG.ActiveCalls;
+    Result = FP();
+    // Tasks whose futures the expression dropped may still be running its
+    // code, which is removed below.
+    kal_wait_tasks();
+    --CG.ActiveCalls;
+
+    // Whatever the expression printed comes before its value.
+    kal_flush();
+  }
+  CG.CollectSamples(Line);
+  fprintf(Logger::getStream(), "Evaluated to %f\n", Result);
+  if (CG.FirstResultTime == std::chrono::steady_clock::time_point())
+    CG.FirstResultTime = std::chrono::steady_clock::now();
+
+  // Without JIT:
+  //
+  // fprintf(stderr, "Read top-level expression:\n");
+  // FnIR->print(llvm::errs());
+  // fprintf(stderr, "\n");
+
+  // Remove the anonymous expression, unless it is cached.
+  // FnIR->eraseFromParent();
+  if (RT) {
+    if (!Key.empty())
+      CG.CacheExpression(Key, *ExprAddr, std::move(RT));
+    else
+      Logger::LogError(RT->remove());
+  }
+  CG.ReleaseQuiescentCode();
+}
+
+std::vector<TopLevelItem> Parser::ParseTopLevelItems() {
+  std::vector<TopLevelItem> Items;
+  while (true) {
+    switch (CurLexer.getCurTok()) {
+    case TOK_EOF:
+      return Items;
+    case ';':
+      CurLexer.getNextTok();
+      break;
+    case TOK_DEF:
+      if (auto FnAST = ParseDefinition()) {
+        // Install the precedence of a binary operator right away, as codegen
+        // would have done before the items following it are parsed.
+        const ProtoTypeAST &Proto = FnAST->getProto();
+        if (Proto.isBinaryOp())
+          BinOpPrecedence.SetBinOpPrecedence(Proto.getOperatorName(),
+                                             Proto.getBinaryPrecedence());
+        Items.push_back({TopLevelItem::Definition, std::move(FnAST), nullptr});
+      } else {
+        RecoverFromError();
+      }
+      break;
+    case TOK_EXTERN:
+      if (auto ProtoAST = ParseExtern())
+        Items.push_back({TopLevelItem::Extern, nullptr, std::move(ProtoAST)});
+      else
+        RecoverFromError();
+      break;
+    default:
+      if (auto FnAST = ParseTopLevelExpr())
+        Items.push_back({TopLevelItem::Expression, std::move(FnAST), nullptr});
+      else
+        RecoverFromError();
+      break;
+    }
+  }
+}
+
+void Parser::CodegenItems(std::vector<TopLevelItem> Items) {
+  for (TopLevelItem &Item : Items) {
+    switch (Item.Kind) {
+    case TopLevelItem::Definition:
+      CodegenDefinition(std::move(Item.Function));
+      break;
+    case TopLevelItem::Extern:
+      CodegenExtern(std::move(Item.Proto));
+      break;
+    case TopLevelItem::Expression:
+      CodegenTopLevelExpression(std::move(Item.Function));
+      break;
+    }
+  }
+}
+
+void Parser::RecoverFromError() {
+  // Recursive descent skips a single token.
+  if (!Opts.Iterative) {
     CurLexer.getNextTok();
+    return;
+  }
+
+  // Otherwise synchronise on the start of the next top-level item, so that a
+  // single error in generated input doesn't cascade into one per token.
+  auto AtItemBoundary = [&]() {
+    int Tok = CurLexer.getCurTok();
+    return Tok == TOK_EOF || Tok == ';' || Tok == TOK_DEF ||
+           Tok == TOK_EXTERN;
+  };
+  while (!AtItemBoundary())
+    CurLexer.getNextTok();
+}
+
+void Parser::ImportPrelude(const Parser &Prelude) {
+  for (const auto &Entry : Prelude.CG.FunctionProtos) {
+    const ProtoTypeAST *Proto = Entry.getValue().get();
+    CG.FunctionProtos[Entry.getKey()] = std::make_unique<ProtoTypeAST>(*Proto);
+    if (Proto->isBinaryOp())
+      BinOpPrecedence.SetBinOpPrecedence(Proto->getOperatorName(),
+                                         Proto->getBinaryPrecedence());
   }
 }
 
 void Parser::MainLoop(Lexer &Lexer) {
   CurLexer = Lexer;
   while (true) {
-    fprintf(stderr, "ready> ");
+    fprintf(Logger::getStream(), "ready> ");
     switch (CurLexer.getCurTok()) {
     case TOK_EOF:
       return;
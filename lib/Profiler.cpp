@@ -0,0 +1,312 @@
+//===- Profiler.cpp - Sampling profiler of JIT'd code ---------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements the SIGPROF sampler. The handler only touches preallocated
+// lock-free atomics, so it is safe whatever it interrupts, and everything
+// else, such as resolving the addresses, is left to the drain.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Profiler.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <sys/time.h>
+#include <thread>
+
+#if (defined(__linux__) || defined(__APPLE__)) &&                              \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define KALEIDOSCOPE_HAVE_SAMPLER 1
+#include <ucontext.h>
+#endif
+
+namespace {
+/// Frames recorded per sample, and samples held between drains.
+constexpr unsigned MaxDepth = 32;
+constexpr size_t RecordWords = MaxDepth + 1;
+constexpr size_t MaxSamples = 16384;
+
+/// Ranges of code that can be sampled at once.
+constexpr size_t MaxRanges = 8192;
+
+/// The samples, each a record of its depth and addresses. Handlers of any
+/// thread reserve a record through NextRecord and commit it by storing its
+/// depth last, the drain clears the depth again.
+std::atomic<uint64_t> Records[MaxSamples * RecordWords];
+std::atomic<size_t> NextRecord{0};
+std::atomic<uint64_t> Dropped{0};
+
+/// Handlers stay out while the drain reads the records, and the drain
+/// waits for those already in.
+std::atomic<bool> Draining{false};
+std::atomic<unsigned> InHandler{0};
+
+/// The code added and not removed yet, sorted by address. Handlers search
+/// the active one of two tables, and updates fill the other one and then
+/// swap them, so that handlers never see a table half written.
+struct RangeTable {
+  std::atomic<uint64_t> Begin[MaxRanges];
+  std::atomic<uint64_t> End[MaxRanges];
+  std::atomic<size_t> Size{0};
+};
+RangeTable Tables[2];
+std::atomic<unsigned> ActiveTable{0};
+
+/// The ranges the tables are built from, by start address, and the number
+/// of those added while MaxRanges were in already, which aren't sampled.
+std::mutex RangeMutex;
+std::map<uint64_t, uint64_t> Ranges;
+std::atomic<uint64_t> DroppedRanges{0};
+
+/// Bounds of the stack of the thread, zero unless it was registered.
+/// Finding them isn't async-signal-safe, so the handler only reads them.
+struct StackBounds {
+  uint64_t Low = 0;
+  uint64_t High = 0;
+};
+thread_local StackBounds ThreadStack;
+
+/// Fill the inactive table from Ranges and make it the active one. Called
+/// with RangeMutex held.
+void publishRanges() {
+  unsigned Next = 1 - ActiveTable.load(std::memory_order_relaxed);
+  RangeTable &Table = Tables[Next];
+  size_t Size = 0;
+  for (const auto &[Begin, End] : Ranges) {
+    Table.Begin[Size].store(Begin, std::memory_order_relaxed);
+    Table.End[Size].store(End, std::memory_order_relaxed);
+    ++Size;
+  }
+  Table.Size.store(Size, std::memory_order_relaxed);
+  ActiveTable.store(Next);
+
+  // Handlers that came in before the swap may still search the table that
+  // was active, which the next update fills.
+  while (InHandler)
+    std::this_thread::yield();
+}
+
+#ifdef KALEIDOSCOPE_HAVE_SAMPLER
+/// Read the program counter, frame pointer and stack pointer of the
+/// interrupted thread.
+void getRegisters(void *Context, uint64_t &PC, uint64_t &FP, uint64_t &SP) {
+  auto *UC = static_cast<ucontext_t *>(Context);
+#if defined(__linux__) && defined(__x86_64__)
+  PC = UC->uc_mcontext.gregs[REG_RIP];
+  FP = UC->uc_mcontext.gregs[REG_RBP];
+  SP = UC->uc_mcontext.gregs[REG_RSP];
+#elif defined(__linux__)
+  PC = UC->uc_mcontext.pc;
+  FP = UC->uc_mcontext.regs[29];
+  SP = UC->uc_mcontext.sp;
+#elif defined(__x86_64__)
+  PC = UC->uc_mcontext->__ss.__rip;
+  FP = UC->uc_mcontext->__ss.__rbp;
+  SP = UC->uc_mcontext->__ss.__rsp;
+#else
+  PC = UC->uc_mcontext->__ss.__pc;
+  FP = UC->uc_mcontext->__ss.__fp;
+  SP = UC->uc_mcontext->__ss.__sp;
+#endif
+}
+
+/// Binary search the active table for the range holding Addr, so that the
+/// cost of a frame is logarithmic in the code loaded.
+bool isCode(uint64_t Addr) {
+  const RangeTable &Table = Tables[ActiveTable.load()];
+  size_t Low = 0, High = Table.Size.load(std::memory_order_relaxed);
+  while (Low != High) {
+    size_t Mid = Low + (High - Low) / 2;
+    if (Table.Begin[Mid].load(std::memory_order_relaxed) <= Addr)
+      Low = Mid + 1;
+    else
+      High = Mid;
+  }
+  return Low && Addr < Table.End[Low - 1].load(std::memory_order_relaxed);
+}
+
+/// Frame records hold the caller's frame pointer and then the return
+/// address, and are 16-byte aligned on both targets. Anything else, or
+/// outside the part of the stack of the thread above Low, isn't one.
+bool isFrame(uint64_t FP, uint64_t Low) {
+  return FP % 16 == 0 && FP >= Low && FP < ThreadStack.High &&
+         ThreadStack.High - FP >= 16;
+}
+
+void recordSample(uint64_t PC, uint64_t FP, uint64_t SP) {
+  // Time spent outside JIT'd code, such as in the compiler, isn't sampled.
+  // Only JIT'd code is known to keep frame pointers, so outside of it the
+  // frame pointer register may hold anything.
+  if (!isCode(PC))
+    return;
+
+  size_t Index = NextRecord.fetch_add(1, std::memory_order_relaxed);
+  if (Index >= MaxSamples) {
+    Dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  std::atomic<uint64_t> *Record = &Records[Index * RecordWords];
+  unsigned Depth = 0;
+  Record[1 + Depth++].store(PC, std::memory_order_relaxed);
+
+  // Frames are only followed on registered threads, from the stack pointer
+  // up, and each caller's frame must be strictly further up than the last,
+  // so that the walk stays within the stack and ends.
+  uint64_t Low = std::max(SP, ThreadStack.Low);
+  while (Depth != MaxDepth && ThreadStack.High && isFrame(FP, Low)) {
+    const uint64_t *Frame = reinterpret_cast<const uint64_t *>(FP);
+    uint64_t Ret = Frame[1];
+    if (!isCode(Ret))
+      break;
+    Record[1 + Depth++].store(Ret, std::memory_order_relaxed);
+    Low = FP + 16;
+    FP = Frame[0];
+  }
+  Record[0].store(Depth, std::memory_order_release);
+}
+
+void handleSample(int, siginfo_t *, void *Context) {
+  int SavedErrno = errno;
+  InHandler.fetch_add(1);
+  if (!Draining.load()) {
+    uint64_t PC, FP, SP;
+    getRegisters(Context, PC, FP, SP);
+    recordSample(PC, FP, SP);
+  } else {
+    Dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+  InHandler.fetch_sub(1);
+  errno = SavedErrno;
+}
+#endif
+} // namespace
+
+void kal_profile_register_thread(void) {
+#ifdef KALEIDOSCOPE_HAVE_SAMPLER
+  void *Addr = nullptr;
+  size_t Size = 0;
+#ifdef __APPLE__
+  pthread_t Self = pthread_self();
+  Size = pthread_get_stacksize_np(Self);
+  Addr = static_cast<char *>(pthread_get_stackaddr_np(Self)) - Size;
+#else
+  pthread_attr_t Attr;
+  if (pthread_getattr_np(pthread_self(), &Attr))
+    return;
+  int Error = pthread_attr_getstack(&Attr, &Addr, &Size);
+  pthread_attr_destroy(&Attr);
+  if (Error)
+    return;
+#endif
+  // The handler only walks once High is set, which it may see as soon as
+  // the store happens.
+  ThreadStack.Low = reinterpret_cast<uint64_t>(Addr);
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  ThreadStack.High = ThreadStack.Low + Size;
+#endif
+}
+
+bool kal_profile_start(unsigned Hz) {
+#ifdef KALEIDOSCOPE_HAVE_SAMPLER
+  if (!Hz)
+    return false;
+
+  kal_profile_register_thread();
+
+  struct sigaction Action = {};
+  Action.sa_sigaction = handleSample;
+  // Restart the reads of the REPL the timer interrupts.
+  Action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&Action.sa_mask);
+  if (sigaction(SIGPROF, &Action, nullptr))
+    return false;
+
+  uint64_t Interval = 1000000 / Hz;
+  if (!Interval)
+    Interval = 1;
+  struct itimerval Timer = {};
+  Timer.it_interval.tv_sec = Interval / 1000000;
+  Timer.it_interval.tv_usec = Interval % 1000000;
+  Timer.it_value = Timer.it_interval;
+  return setitimer(ITIMER_PROF, &Timer, nullptr) == 0;
+#else
+  return false;
+#endif
+}
+
+void kal_profile_stop(void) {
+  struct itimerval Timer = {};
+  setitimer(ITIMER_PROF, &Timer, nullptr);
+  // A signal still pending would otherwise terminate the process.
+  signal(SIGPROF, SIG_IGN);
+}
+
+void kal_profile_add_code(uint64_t Begin, uint64_t End) {
+  if (Begin >= End)
+    return;
+  std::lock_guard<std::mutex> Lock(RangeMutex);
+
+  // Memory of code that was removed may have been reused, so drop the
+  // ranges the new one overlaps.
+  auto It = Ranges.lower_bound(Begin);
+  if (It != Ranges.begin() && std::prev(It)->second > Begin)
+    --It;
+  while (It != Ranges.end() && It->first < End)
+    It = Ranges.erase(It);
+
+  if (Ranges.size() == MaxRanges) {
+    DroppedRanges.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  Ranges.emplace(Begin, End);
+  publishRanges();
+}
+
+void kal_profile_remove_code(uint64_t Begin, uint64_t End) {
+  std::lock_guard<std::mutex> Lock(RangeMutex);
+  auto It = Ranges.find(Begin);
+  if (It == Ranges.end() || It->second != End)
+    return;
+  Ranges.erase(It);
+  publishRanges();
+}
+
+size_t kal_profile_buffer_words(void) { return MaxSamples * RecordWords; }
+
+size_t kal_profile_drain(uint64_t *Buffer) {
+  Draining = true;
+  while (InHandler)
+    std::this_thread::yield();
+
+  size_t NumRecords = NextRecord.load();
+  if (NumRecords > MaxSamples)
+    NumRecords = MaxSamples;
+
+  size_t Words = 0;
+  for (size_t I = 0; I != NumRecords; ++I) {
+    std::atomic<uint64_t> *Record = &Records[I * RecordWords];
+    uint64_t Depth = Record[0].load(std::memory_order_acquire);
+    if (!Depth)
+      continue;
+    Buffer[Words++] = Depth;
+    for (uint64_t J = 0; J != Depth; ++J)
+      Buffer[Words++] = Record[1 + J].load(std::memory_order_relaxed);
+    Record[0].store(0, std::memory_order_relaxed);
+  }
+
+  NextRecord = 0;
+  Draining = false;
+  return Words;
+}
+
+uint64_t kal_profile_dropped(void) { return Dropped; }
+
+uint64_t kal_profile_dropped_code(void) { return DroppedRanges; }
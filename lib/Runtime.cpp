@@ -0,0 +1,121 @@
+//===- Runtime.cpp - Runtime library of JIT'd code ------------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements the builtins JIT'd code calls into.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Runtime.h"
+#include <sched.h>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+KalOutputBuffer kal_output;
+
+/// Take the output buffer. A spin lock rather than a mutex keeps the inlined
+/// copies of the helpers free of calls on the uncontended path, and it is
+/// only held for as long as a write takes.
+static void lockOutput() {
+  while (kal_output.Locked.exchange(true, std::memory_order_acquire))
+    sched_yield();
+}
+
+static void unlockOutput() {
+  kal_output.Locked.store(false, std::memory_order_release);
+}
+
+/// Output goes to stderr with a 4KiB threshold unless configured otherwise.
+static void initialiseOutput() {
+  kal_output.Stream = stderr;
+  kal_output.FlushThreshold = 4096;
+  kal_output.Initialised = true;
+}
+
+/// Write out the buffered output, with the buffer taken.
+static void flushLocked() {
+  if (!kal_output.Initialised)
+    initialiseOutput();
+  if (kal_output.Size && kal_output.Stream)
+    fwrite(kal_output.Data, 1, kal_output.Size, kal_output.Stream);
+  kal_output.Size = 0;
+}
+
+void kal_flush(void) {
+  lockOutput();
+  flushLocked();
+  unlockOutput();
+}
+
+void kal_set_output(FILE *Stream) {
+  lockOutput();
+  flushLocked();
+  kal_output.Stream = Stream;
+  unlockOutput();
+}
+
+void kal_set_flush_threshold(size_t Threshold) {
+  lockOutput();
+  flushLocked();
+  if (Threshold >= KAL_OUTPUT_CAPACITY)
+    Threshold = KAL_OUTPUT_CAPACITY - 1;
+  kal_output.FlushThreshold = Threshold;
+  unlockOutput();
+}
+
+double putchard(double X) {
+  lockOutput();
+  kal_output.Data[kal_output.Size++] = (char)X;
+  if (kal_output.Size > kal_output.FlushThreshold)
+    flushLocked();
+  unlockOutput();
+  return 0;
+}
+
+double printd(double X) {
+  lockOutput();
+  // Leave room for the longest number snprintf can print.
+  if (kal_output.Size + 512 > KAL_OUTPUT_CAPACITY)
+    flushLocked();
+  kal_output.Size += snprintf(kal_output.Data + kal_output.Size,
+                              KAL_OUTPUT_CAPACITY - kal_output.Size, "%f\n", X);
+  if (kal_output.Size > kal_output.FlushThreshold)
+    flushLocked();
+  unlockOutput();
+  return 0;
+}
+
+int kal_isa_level(void) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  // The compiler checks every feature of a psABI level, including the OS
+  // support of the AVX and AVX-512 state, rather than the few that are
+  // checked easily.
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("x86-64-v4"))
+    return 3;
+  if (__builtin_cpu_supports("x86-64-v3"))
+    return 2;
+  if (__builtin_cpu_supports("x86-64-v2"))
+    return 1;
+  return 0;
+#elif defined(__aarch64__) && defined(__linux__)
+  // Each level requires every feature its clones are built with.
+  unsigned long HWCap = getauxval(AT_HWCAP);
+  bool DotProd = HWCap & (1UL << 20); // HWCAP_ASIMDDP
+  bool SVE = HWCap & (1UL << 22);     // HWCAP_SVE
+  if (DotProd && SVE)
+    return 2;
+  if (DotProd)
+    return 1;
+  return 0;
+#elif defined(__aarch64__) && defined(__APPLE__)
+  // Every Apple core has the dot product instructions, none has SVE.
+  return 1;
+#else
+  return 0;
+#endif
+}
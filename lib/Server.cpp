@@ -0,0 +1,130 @@
+//===- Server.cpp - Kaleidoscope sessions over a local socket -------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements the session server.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Server.h"
+#include "Lexer.h"
+#include "Logger.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+SessionServer::SessionServer(CodeGenOptions Opts, ParserOptions ParseOpts,
+                             unsigned MaxSessions)
+    : Opts(std::move(Opts)), ParseOpts(ParseOpts),
+      Sessions(llvm::hardware_concurrency(MaxSessions)) {
+  // Sessions compile on a shared pool of threads, and results go to their
+  // clients rather than to the server's log.
+  llvm::TargetOptions Options;
+  this->Opts.FastMath.applyTo(Options);
+  llvm::ExitOnError ExitOnError;
+  this->Opts.Engine = ExitOnError(llvm::orc::KaleidoscopeJITEngine::Create(
+      Options, /*ConcurrentCompile*/ true, this->Opts.JITCPU,
+      this->Opts.JITFeatures));
+  this->Opts.RuntimeLock = &RuntimeLock;
+  this->Opts.PrintIR = false;
+
+  CodeGenOptions PreludeOpts = this->Opts;
+  PreludeOpts.Prelude = true;
+  Prelude = std::make_unique<Parser>(PreludeOpts, ParseOpts);
+}
+
+void SessionServer::loadPrelude(std::string_view Source) {
+  Prelude->CurLexer = Lexer(Source);
+  Prelude->CurLexer.getNextTok();
+  Prelude->CodegenItems(Prelude->ParseTopLevelItems());
+
+  // Compile the whole prelude up front in a single lookup, on the engine's
+  // compile threads, rather than in the first session calling each part.
+  std::vector<llvm::StringRef> Names;
+  for (const auto &Entry : Prelude->CG.Definitions)
+    Names.push_back(Entry.getKey());
+  if (!Names.empty())
+    Prelude->CG.ExitOnError(Prelude->CG.JIT->lookup(Names).takeError());
+}
+
+bool SessionServer::serve(const std::string &Path) {
+  sockaddr_un Addr{};
+  Addr.sun_family = AF_UNIX;
+  if (Path.size() >= sizeof(Addr.sun_path)) {
+    fprintf(stderr, "Error: socket path '%s' is too long\n", Path.c_str());
+    return false;
+  }
+  memcpy(Addr.sun_path, Path.c_str(), Path.size() + 1);
+
+  int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Listener < 0) {
+    fprintf(stderr, "Error: cannot create socket: %s\n", strerror(errno));
+    return false;
+  }
+
+  // Replace the socket of an earlier server.
+  unlink(Path.c_str());
+  if (bind(Listener, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) ||
+      listen(Listener, SOMAXCONN)) {
+    fprintf(stderr, "Error: cannot listen on '%s': %s\n", Path.c_str(),
+            strerror(errno));
+    close(Listener);
+    return false;
+  }
+
+  // A client hanging up must only end its own session.
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr, "Serving sessions on %s\n", Path.c_str());
+  while (true) {
+    int Fd = accept(Listener, nullptr, nullptr);
+    if (Fd < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Error: cannot accept sessions: %s\n", strerror(errno));
+      break;
+    }
+    Sessions.async([this, Fd] { runSession(Fd); });
+  }
+
+  close(Listener);
+  Sessions.wait();
+  return true;
+}
+
+void SessionServer::runSession(int Fd) {
+  FILE *In = fdopen(Fd, "r");
+  FILE *Out = fdopen(dup(Fd), "w");
+  if (!In || !Out) {
+    fprintf(stderr, "Error: cannot open session: %s\n", strerror(errno));
+    if (In)
+      fclose(In);
+    else
+      close(Fd);
+    return;
+  }
+  // Prompts must reach the client before its next line is read.
+  setvbuf(Out, nullptr, _IONBF, 0);
+
+  FILE *&Stream = Logger::getStream();
+  FILE *ServerStream = Stream;
+  Stream = Out;
+  {
+    Parser Session(Opts, ParseOpts);
+    Session.ImportPrelude(*Prelude);
+
+    Lexer Lexer(In);
+    fprintf(Out, "ready> ");
+    Lexer.getNextTok();
+    Session.MainLoop(Lexer);
+  }
+  Stream = ServerStream;
+
+  fclose(Out);
+  fclose(In);
+}
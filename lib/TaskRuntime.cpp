@@ -0,0 +1,328 @@
+//===- TaskRuntime.cpp - Task runtime of spawn/await ----------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements the work-stealing task pool behind spawn and await.
+//
+//===----------------------------------------------------------------------===//
+
+#include "TaskRuntime.h"
+#include "Profiler.h"
+#include "Runtime.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+/// Task - A spawned call and, once it has run, its result.
+struct Task {
+  KalTaskFn Fn;
+  std::unique_ptr<char[]> Env;
+  double Result = 0;
+  std::atomic<bool> Done{false};
+};
+
+/// TaskTable - The tasks whose futures haven't been awaited yet. A future
+/// is a slot of the table and the generation the slot was in when the task
+/// was put there, so that a stale or made-up future is rejected instead of
+/// being taken for a task. Futures stay below 2^53 to survive a double.
+class TaskTable {
+  static constexpr unsigned SlotBits = 24, GenerationBits = 24;
+  static constexpr int64_t Tag = int64_t(0xA) << (SlotBits + GenerationBits);
+  static constexpr uint32_t SlotMask = (1u << SlotBits) - 1;
+  static constexpr uint32_t GenerationMask = (1u << GenerationBits) - 1;
+
+  struct Slot {
+    Task *T = nullptr;
+    uint32_t Generation = 0;
+  };
+
+  std::mutex Lock;
+  std::vector<Slot> Slots;
+  std::vector<uint32_t> FreeSlots;
+
+public:
+  /// Put T in a slot and return its future, or -1 if every slot is taken.
+  int64_t insert(Task *T) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    uint32_t Index;
+    if (!FreeSlots.empty()) {
+      Index = FreeSlots.back();
+      FreeSlots.pop_back();
+    } else if (Slots.size() <= SlotMask) {
+      Index = Slots.size();
+      Slots.emplace_back();
+    } else {
+      return -1;
+    }
+    Slots[Index].T = T;
+    return Tag | int64_t(Slots[Index].Generation) << SlotBits | Index;
+  }
+
+  /// Take the task of Future out of the table, or return null if Future
+  /// isn't one or its task was taken already.
+  Task *take(int64_t Future) {
+    if ((Future & ~((int64_t(1) << (SlotBits + GenerationBits)) - 1)) != Tag)
+      return nullptr;
+    uint32_t Index = Future & SlotMask;
+    uint32_t Generation = (Future >> SlotBits) & GenerationMask;
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Index >= Slots.size() || !Slots[Index].T ||
+        Slots[Index].Generation != Generation)
+      return nullptr;
+    Task *T = Slots[Index].T;
+    Slots[Index].T = nullptr;
+    Slots[Index].Generation = (Generation + 1) & GenerationMask;
+    FreeSlots.push_back(Index);
+    return T;
+  }
+};
+
+/// TaskQueue - The tasks queued on one worker. The worker takes the newest
+/// from the back, whose callers' data is still in its cache, and thieves
+/// take the oldest from the front, which tend to be the largest.
+class TaskQueue {
+  std::mutex Lock;
+  std::deque<Task *> Tasks;
+
+public:
+  void push(Task *T) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Tasks.push_back(T);
+  }
+
+  Task *pop() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Tasks.empty())
+      return nullptr;
+    Task *T = Tasks.back();
+    Tasks.pop_back();
+    return T;
+  }
+
+  Task *steal() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Tasks.empty())
+      return nullptr;
+    Task *T = Tasks.front();
+    Tasks.pop_front();
+    return T;
+  }
+};
+
+/// The queue of the worker running on this thread, -1 outside the pool.
+thread_local int WorkerIndex = -1;
+
+/// TaskPool - Worker threads with a queue each, plus a shared queue for the
+/// tasks spawned outside the pool. Threads waiting on a task run queued
+/// tasks instead of blocking, so nested spawns can't deadlock the pool.
+class TaskPool {
+  std::vector<std::unique_ptr<TaskQueue>> Queues; // The last one is shared.
+  std::atomic<size_t> Queued{0};     // Tasks in any queue.
+  std::atomic<size_t> Unfinished{0}; // Tasks spawned and not finished.
+  std::atomic<unsigned> Sleepers{0}; // Threads waiting on Changed.
+  std::mutex SleepLock;
+  std::condition_variable Changed; // A task was queued or finished.
+
+public:
+  explicit TaskPool(unsigned NumWorkers) {
+    for (unsigned I = 0; I <= NumWorkers; ++I)
+      Queues.push_back(std::make_unique<TaskQueue>());
+    // The pool lives as long as the process, and so do its workers.
+    for (unsigned I = 0; I != NumWorkers; ++I)
+      std::thread([this, I] {
+        WorkerIndex = I;
+        // Let the profiler follow the frames of the tasks run here.
+        kal_profile_register_thread();
+        runUntil([] { return false; });
+      }).detach();
+  }
+
+  void spawn(Task *T) {
+    ++Unfinished;
+    unsigned Index = WorkerIndex >= 0 ? WorkerIndex : Queues.size() - 1;
+    Queues[Index]->push(T);
+    ++Queued;
+    if (Sleepers) {
+      std::lock_guard<std::mutex> Guard(SleepLock);
+      Changed.notify_one();
+    }
+  }
+
+  void wait(Task *T) {
+    runUntil([T] { return T->Done.load(); });
+  }
+
+  void waitAll() {
+    runUntil([this] { return Unfinished == 0; });
+  }
+
+private:
+  /// Take a task off this thread's own queue, or else steal one.
+  Task *findWork() {
+    size_t NumQueues = Queues.size();
+    Task *T = nullptr;
+    if (WorkerIndex >= 0)
+      T = Queues[WorkerIndex]->pop();
+    size_t Start = WorkerIndex + 1;
+    for (size_t I = 0; !T && I != NumQueues; ++I)
+      T = Queues[(Start + I) % NumQueues]->steal();
+    if (T)
+      --Queued;
+    return T;
+  }
+
+  void run(Task *T) {
+    T->Result = T->Fn(T->Env.get());
+    T->Env.reset();
+    T->Done = true;
+    --Unfinished;
+    if (Sleepers) {
+      std::lock_guard<std::mutex> Guard(SleepLock);
+      Changed.notify_all();
+    }
+  }
+
+  /// Run queued tasks until Done holds, sleeping while there are none.
+  template <typename Predicate> void runUntil(Predicate Done) {
+    while (!Done()) {
+      if (Task *T = findWork()) {
+        run(T);
+        continue;
+      }
+      std::unique_lock<std::mutex> Guard(SleepLock);
+      ++Sleepers;
+      Changed.wait(Guard, [&] { return Done() || Queued != 0; });
+      --Sleepers;
+    }
+  }
+};
+
+/// RangeTask - The environment of a task reducing one chunk of a range.
+struct RangeTask {
+  KalRangeFn Fn;
+  const void *Env;
+  int64_t First, Last;
+};
+
+double runRange(void *Env) {
+  auto *Task = static_cast<RangeTask *>(Env);
+  return Task->Fn(Task->Env, Task->First, Task->Last);
+}
+
+double combine(int32_t Kind, double L, double R) {
+  switch (Kind) {
+  case KAL_REDUCE_SUM:
+    return L + R;
+  case KAL_REDUCE_PROD:
+    return L * R;
+  case KAL_REDUCE_MIN:
+    if (std::isnan(L) || std::isnan(R))
+      return L + R;
+    if (L == R)
+      return std::signbit(L) ? L : R;
+    return L < R ? L : R;
+  default:
+    if (std::isnan(L) || std::isnan(R))
+      return L + R;
+    if (L == R)
+      return std::signbit(L) ? R : L;
+    return L > R ? L : R;
+  }
+}
+
+/// Chunks a range is split into at most.
+constexpr uint64_t MaxChunks = 256;
+
+TaskTable Tasks;
+std::once_flag PoolCreated;
+std::atomic<TaskPool *> Pool{nullptr};
+std::atomic<unsigned> RequestedThreads{0};
+
+/// The pool is created by the first spawn.
+TaskPool &getPool() {
+  std::call_once(PoolCreated, [] {
+    unsigned NumWorkers = RequestedThreads;
+    if (!NumWorkers)
+      NumWorkers = std::thread::hardware_concurrency();
+    Pool = new TaskPool(NumWorkers ? NumWorkers : 1);
+  });
+  return *Pool;
+}
+} // namespace
+
+void kal_set_task_threads(unsigned Threads) { RequestedThreads = Threads; }
+
+int64_t kal_spawn(KalTaskFn Fn, const void *Env, size_t EnvSize) {
+  auto T = std::make_unique<Task>();
+  T->Fn = Fn;
+  T->Env.reset(new char[EnvSize]);
+  memcpy(T->Env.get(), Env, EnvSize);
+  int64_t Future = Tasks.insert(T.get());
+  if (Future < 0) {
+    kal_flush();
+    fprintf(stderr, "Error: too many tasks waiting to be awaited\n");
+    std::abort();
+  }
+  getPool().spawn(T.release());
+  return Future;
+}
+
+double kal_await(int64_t Future) {
+  std::unique_ptr<Task> T(Tasks.take(Future));
+  if (!T) {
+    kal_flush();
+    fprintf(stderr, "Error: await of an unknown or already awaited future\n");
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  getPool().wait(T.get());
+  return T->Result;
+}
+
+double kal_parallel_reduce(KalRangeFn Fn, const void *Env, int64_t Begin,
+                           int64_t End, int64_t Step, int32_t Kind,
+                           int64_t MinIterations) {
+  // Iterations are counted unsigned, as the range may span more than
+  // INT64_MAX.
+  uint64_t Iterations = 0;
+  if (Begin < End)
+    Iterations = (uint64_t(End) - uint64_t(Begin) - 1) / uint64_t(Step) + 1;
+  uint64_t MinChunk = std::max<int64_t>(MinIterations, 1);
+  uint64_t NumChunks = std::min(Iterations / MinChunk, MaxChunks);
+  if (NumChunks < 2)
+    return Fn(Env, Begin, End);
+
+  uint64_t PerChunk = (Iterations + NumChunks - 1) / NumChunks;
+  std::vector<int64_t> Futures;
+  int64_t First = Begin;
+  for (uint64_t Done = 0; Done < Iterations; Done += PerChunk) {
+    int64_t Last = End;
+    if (Done + PerChunk < Iterations)
+      Last = int64_t(uint64_t(Begin) + (Done + PerChunk) * uint64_t(Step));
+    RangeTask Task = {Fn, Env, First, Last};
+    Futures.push_back(kal_spawn(runRange, &Task, sizeof(Task)));
+    First = Last;
+  }
+
+  double Result = kal_await(Futures.front());
+  for (size_t I = 1; I != Futures.size(); ++I)
+    Result = combine(Kind, Result, kal_await(Futures[I]));
+  return Result;
+}
+
+void kal_wait_tasks(void) {
+  if (TaskPool *P = Pool)
+    P->waitAll();
+}
@@ -8,43 +8,463 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "ChunkedParser.h"
 #include "CodeGen.h"
 #include "Lexer.h"
 #include "Parser.h"
+#include "Profiler.h"
+#include "Runtime.h"
+#include "TaskRuntime.h"
+#include "Server.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/TargetSelect.h"
+#include <chrono>
 #include <cstdio>
 
-extern "C" double putchard(double x) {
-  fputc((char)x, stderr);
-  return 0;
-}
+static llvm::cl::opt<std::string>
+    InputFilename(llvm::cl::Positional,
+                  llvm::cl::desc("<input file, standard input by default>"),
+                  llvm::cl::init("-"));
 
-extern "C" double printd(double x) {
-  fprintf(stderr, "%f\n", x);
-  return 0;
-}
+static llvm::cl::opt<unsigned> ImportThreshold(
+    "import-threshold",
+    llvm::cl::desc("Instruction count up to which earlier definitions are "
+                   "imported into later modules for inlining"),
+    llvm::cl::init(CodeGenOptions().ImportInstrThreshold));
+
+static llvm::cl::opt<bool>
+    HotSwap("hot-swap",
+            llvm::cl::desc("Call definitions through stubs so that they can "
+                           "be redefined while the session is live"),
+            llvm::cl::init(false));
+
+static llvm::cl::opt<uint64_t> MemoryBudget(
+    "jit-memory-budget",
+    llvm::cl::desc("Bytes of JIT'd code definitions may keep resident, the "
+                   "least recently used ones are evicted and compiled again "
+                   "when next called (0 for no limit). Only code is "
+                   "budgeted, not the bitcode kept to recompile it"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<bool> ReportResidency(
+    "report-residency",
+    llvm::cl::desc("Report the code kept resident under -jit-memory-budget"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> LazyCompile(
+    "lazy-compile",
+    llvm::cl::desc("Compile definitions on their first call rather than when "
+                   "they are defined"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> Speculate(
+    "speculate",
+    llvm::cl::desc("Compile definitions lazily, and their likely callees on "
+                   "background threads before they are called"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> SpeculationDepth(
+    "speculation-depth",
+    llvm::cl::desc("How many calls deep -speculate compiles ahead of the code "
+                   "being entered, 1 for its direct callees only"),
+    llvm::cl::init(2));
+
+static llvm::cl::opt<bool> ReportSpeculation(
+    "report-speculation",
+    llvm::cl::desc("Report the first calls that waited for the compiler and "
+                   "the compiles -speculate did"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool>
+    Dedup("dedup",
+          llvm::cl::desc("Reuse the code of definitions and top-level "
+                         "expressions structurally identical to earlier ones"),
+          llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> ExpressionCacheSize(
+    "expr-cache-size",
+    llvm::cl::desc("Top-level expressions whose code -dedup keeps for reuse"),
+    llvm::cl::init(CodeGenOptions().ExpressionCacheSize));
+
+static llvm::cl::opt<bool> ReportDedup(
+    "report-dedup",
+    llvm::cl::desc("Report the duplicate definitions and expressions -dedup "
+                   "found"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> MLIR(
+    "mlir",
+    llvm::cl::desc("Lower definitions with counted loops through MLIR's "
+                   "affine dialect, fusing, interchanging and tiling them"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> BackgroundInit(
+    "background-init",
+    llvm::cl::desc("Start the JIT on a background thread while the first "
+                   "input is read and parsed"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> ReportStartup(
+    "report-startup",
+    llvm::cl::desc("Report the time until the JIT was ready and the first "
+                   "result was printed"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<std::string> Profile(
+    "profile",
+    llvm::cl::desc("Sample the JIT'd code and write its stacks to this path "
+                   "in the folded format of flamegraph.pl"),
+    llvm::cl::value_desc("path"));
+
+static llvm::cl::opt<unsigned> ProfileHz(
+    "profile-hz",
+    llvm::cl::desc("Samples taken by -profile per second of CPU time"),
+    llvm::cl::init(997));
+
+static llvm::cl::list<std::string> FastMath(
+    "fast-math",
+    llvm::cl::desc("Session wide fast-math flags: fast, reassoc, nnan, ninf, "
+                   "nsz, contract, fma"),
+    llvm::cl::CommaSeparated);
+
+static llvm::cl::opt<std::string> Serve(
+    "serve",
+    llvm::cl::desc("Serve sessions on a Unix socket at this path instead of "
+                   "reading the input, sharing one JIT between them (connect "
+                   "with e.g. 'nc -U <path>')"),
+    llvm::cl::value_desc("path"));
+
+static llvm::cl::opt<std::string>
+    Prelude("prelude",
+            llvm::cl::desc("Source compiled once with -serve, whose "
+                           "definitions every session can call"),
+            llvm::cl::value_desc("path"));
+
+static llvm::cl::opt<unsigned> MaxSessions(
+    "max-sessions",
+    llvm::cl::desc("Sessions served at once with -serve, one per hardware "
+                   "thread by default"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<std::string> JITCPU(
+    "jit-cpu",
+    llvm::cl::desc("CPU the JIT generates code for: 'host' to detect it, "
+                   "'generic' for code any host of the architecture runs"),
+    llvm::cl::init(CodeGenOptions().JITCPU));
+
+static llvm::cl::list<std::string> JITFeatures(
+    "jit-features",
+    llvm::cl::desc("Target features toggled on top of -jit-cpu, such as "
+                   "+avx2 or -sve"),
+    llvm::cl::CommaSeparated);
+
+static llvm::cl::opt<std::string> EmitObject(
+    "emit-obj",
+    llvm::cl::desc("Also write every definition to an object file, with "
+                   "functions containing loops cloned for several "
+                   "instruction set levels"),
+    llvm::cl::value_desc("path"));
+
+static llvm::cl::opt<std::string>
+    AOTCPU("aot-cpu",
+           llvm::cl::desc("Baseline CPU of -emit-obj, the generic CPU of "
+                          "the host architecture by default"));
+
+static llvm::cl::list<std::string> Multiversion(
+    "multiversion",
+    llvm::cl::desc("Functions -emit-obj clones for every instruction set "
+                   "level, besides those containing loops"),
+    llvm::cl::CommaSeparated);
+
+static llvm::cl::opt<std::string> VectorLibraryPath(
+    "vector-library-path",
+    llvm::cl::desc("Load the vector math library selected with "
+                   "-vector-library from this path, so that the JIT can "
+                   "resolve vectorized math calls"),
+    llvm::cl::value_desc("path"));
+
+static llvm::cl::opt<bool> ReportTailCalls(
+    "report-tail-calls",
+    llvm::cl::desc("Report the tail calls eliminated in every definition"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> SelectCostThreshold(
+    "select-cost-threshold",
+    llvm::cl::desc("Instructions the arms of an if/then/else free of side "
+                   "effects may cost together to be lowered to a select"),
+    llvm::cl::init(CodeGenOptions().SelectCostThreshold));
+
+static llvm::cl::opt<bool> ReportSelects(
+    "report-selects",
+    llvm::cl::desc("Report whether every if/then/else was lowered to a "
+                   "select or a branch"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> SpecializationBudget(
+    "specialization-budget",
+    llvm::cl::desc("Instructions of clones specialized on constant call "
+                   "arguments, 0 disables specialization"),
+    llvm::cl::init(CodeGenOptions().SpecializationBudget));
+
+static llvm::cl::opt<bool> ReportSpecializations(
+    "report-specializations",
+    llvm::cl::desc("Report the clones specialized on constant call "
+                   "arguments"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> OptLevel(
+    "opt-level",
+    llvm::cl::desc("Optimisation pipeline: 0 only inlines operators, 1 adds "
+                   "the function pipeline, 2 adds cross-module inlining and "
+                   "vectorization"),
+    llvm::cl::init(CodeGenOptions().OptLevel));
+
+static llvm::cl::opt<bool>
+    PrintIR("print-ir",
+            llvm::cl::desc("Print the IR of every item compiled and the "
+                           "final module"),
+            llvm::cl::init(true));
+
+static llvm::cl::opt<unsigned> OutputBufferSize(
+    "output-buffer-size",
+    llvm::cl::desc("Bytes of output buffered before it is written, 0 writes "
+                   "every character immediately"),
+    llvm::cl::init(4096));
+
+static llvm::cl::opt<unsigned> TaskThreads(
+    "task-threads",
+    llvm::cl::desc("Worker threads running spawned calls, one per hardware "
+                   "thread by default"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned> ParallelReduce(
+    "parallel-reduce",
+    llvm::cl::desc("Split counted reductions into chunks of at least this "
+                   "many iterations run on the task threads, 0 runs them on "
+                   "one thread"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<bool> InlineRuntime(
+    "inline-runtime",
+    llvm::cl::desc("Import the runtime from bitcode so that its helpers can "
+                   "be inlined"),
+    llvm::cl::init(true));
+
+static llvm::cl::opt<std::string> RuntimeBitcode(
+    "runtime-bitcode",
+    llvm::cl::desc("Runtime bitcode to import, instead of the one built "
+                   "with the library"),
+    llvm::cl::value_desc("path"));
+
+static llvm::cl::opt<bool> IterativeParser(
+    "iterative-parser",
+    llvm::cl::desc("Parse with explicit stacks instead of recursion, for "
+                   "very large or deeply nested generated input"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> MaxNestingDepth(
+    "max-nesting-depth",
+    llvm::cl::desc("Maximum nesting depth of expressions"),
+    llvm::cl::init(ParserOptions().MaxNestingDepth));
+
+static llvm::cl::opt<bool> ParallelParse(
+    "parallel-parse",
+    llvm::cl::desc("Read the whole input, parse it in chunks on all cores, "
+                   "then compile its items in order"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> ParseChunks(
+    "parse-chunks",
+    llvm::cl::desc("Number of chunks for -parallel-parse, four per hardware "
+                   "thread by default"),
+    llvm::cl::init(0));
+
+int main(int argc, char **argv) {
+  auto StartTime = std::chrono::steady_clock::now();
+  llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
 
-int main() {
   llvm::InitializeNativeTarget();
   llvm::InitializeNativeTargetAsmPrinter();
   llvm::InitializeNativeTargetAsmParser();
 
-  LLVMInitializeAArch64Target();
-  LLVMInitializeAArch64AsmPrinter();
-  LLVMInitializeAArch64AsmParser();
+  if (!VectorLibraryPath.empty()) {
+    std::string ErrMsg;
+    if (llvm::sys::DynamicLibrary::LoadLibraryPermanently(
+            VectorLibraryPath.c_str(), &ErrMsg)) {
+      fprintf(stderr, "Error: %s\n", ErrMsg.c_str());
+      return 1;
+    }
+  }
+
+  CodeGenOptions Opts;
+  Opts.ImportInstrThreshold = ImportThreshold;
+  Opts.HotSwap = HotSwap;
+  Opts.MemoryBudget = MemoryBudget;
+  Opts.ReportResidency = ReportResidency;
+  Opts.LazyCompile = LazyCompile || Speculate;
+  Opts.Speculate = Speculate;
+  Opts.SpeculationDepth = SpeculationDepth;
+  Opts.ReportSpeculation = ReportSpeculation;
+  Opts.Dedup = Dedup;
+  Opts.ExpressionCacheSize = ExpressionCacheSize;
+  Opts.ReportDedup = ReportDedup;
+  Opts.MLIR = MLIR;
+  Opts.BackgroundInit = BackgroundInit;
+  Opts.Profile = !Profile.empty();
+  Opts.ParallelReduceMin = ParallelReduce;
+  Opts.ReportTailCalls = ReportTailCalls;
+  Opts.SelectCostThreshold = SelectCostThreshold;
+  Opts.ReportSelects = ReportSelects;
+  Opts.SpecializationBudget = SpecializationBudget;
+  Opts.ReportSpecializations = ReportSpecializations;
+  Opts.OptLevel = OptLevel;
+  Opts.PrintIR = PrintIR;
+  Opts.InlineRuntime = InlineRuntime;
+  Opts.RuntimeBitcode = RuntimeBitcode;
+  Opts.JITCPU = JITCPU;
+  Opts.JITFeatures.assign(JITFeatures.begin(), JITFeatures.end());
+  kal_set_flush_threshold(OutputBufferSize);
+  kal_set_task_threads(TaskThreads);
+  for (const std::string &Flag : FastMath) {
+    if (!Opts.FastMath.enable(Flag)) {
+      fprintf(stderr, "Error: unknown fast-math flag '%s'\n", Flag.c_str());
+      return 1;
+    }
+  }
+
+#ifndef KALEIDOSCOPE_HAVE_MLIR
+  if (MLIR) {
+    fprintf(stderr,
+            "Error: -mlir needs a build with KALEIDOSCOPE_ENABLE_MLIR\n");
+    return 1;
+  }
+#endif
+
+  // Evicted definitions are already compiled again on their next call.
+  if (Opts.LazyCompile && MemoryBudget) {
+    fprintf(stderr,
+            "Error: -lazy-compile can't be used with -jit-memory-budget\n");
+    return 1;
+  }
+
+  // Samples are attributed by the session that ran them.
+  if (Opts.Profile && !Serve.empty()) {
+    fprintf(stderr, "Error: -profile can't be used with -serve\n");
+    return 1;
+  }
+
+  ParserOptions ParseOpts;
+  ParseOpts.Iterative = IterativeParser;
+  ParseOpts.MaxNestingDepth = MaxNestingDepth;
+
+  if (!Serve.empty()) {
+    SessionServer Server(Opts, ParseOpts, MaxSessions);
+    if (!Prelude.empty()) {
+      auto PreludeOrErr = llvm::MemoryBuffer::getFile(Prelude);
+      if (!PreludeOrErr) {
+        fprintf(stderr, "Error: cannot read '%s': %s\n", Prelude.c_str(),
+                PreludeOrErr.getError().message().c_str());
+        return 1;
+      }
+      llvm::StringRef Source = (*PreludeOrErr)->getBuffer();
+      Server.loadPrelude(std::string_view(Source.data(), Source.size()));
+    }
+    return Server.serve(Serve) ? 0 : 1;
+  }
+
+  // Entry counters are addresses in this process, so they can't go into an
+  // object file.
+  if (!EmitObject.empty() && MemoryBudget) {
+    fprintf(stderr,
+            "Error: -emit-obj can't be used with -jit-memory-budget\n");
+    return 1;
+  }
+  if (!EmitObject.empty() && Speculate) {
+    fprintf(stderr, "Error: -emit-obj can't be used with -speculate\n");
+    return 1;
+  }
+
+  Parser Parser(Opts, ParseOpts);
+  Parser.CG.StartTime = StartTime;
+  if (!EmitObject.empty()) {
+    AOTOptions AOTOpts;
+    AOTOpts.CPU = AOTCPU;
+    AOTOpts.Multiversion.assign(Multiversion.begin(), Multiversion.end());
+    Opts.FastMath.applyTo(AOTOpts.TargetOpts);
+    Parser.CG.AOT = std::make_unique<AOTCompiler>(std::move(AOTOpts));
+  }
+
+  if (Opts.Profile && !kal_profile_start(ProfileHz)) {
+    fprintf(stderr, "Error: -profile isn't supported on this host\n");
+    return 1;
+  }
+
+  // Standard input is read interactively unless it is parsed in parallel.
+  std::unique_ptr<llvm::MemoryBuffer> Input;
+  if (InputFilename != "-" || ParallelParse) {
+    auto InputOrErr = llvm::MemoryBuffer::getFileOrSTDIN(InputFilename);
+    if (!InputOrErr) {
+      fprintf(stderr, "Error: cannot read '%s': %s\n", InputFilename.c_str(),
+              InputOrErr.getError().message().c_str());
+      return 1;
+    }
+    Input = std::move(*InputOrErr);
+  }
+
+  if (ParallelParse) {
+    unsigned NumChunks = ParseChunks;
+    if (!NumChunks)
+      NumChunks = 4 * llvm::hardware_concurrency().compute_thread_count();
+
+    llvm::StringRef Source = Input->getBuffer();
+    Parser.CodegenItems(ChunkedParser::parse(
+        std::string_view(Source.data(), Source.size()), NumChunks, ParseOpts));
+  } else {
+    Lexer Lexer;
+    if (Input) {
+      llvm::StringRef Source = Input->getBuffer();
+      Lexer = ::Lexer(std::string_view(Source.data(), Source.size()));
+    }
+
+    // Prime the first token.
+    fprintf(stderr, "ready> ");
+    Lexer.getNextTok();
+
+    // Run the main loop.
+    Parser.MainLoop(Lexer);
+  }
+
+  kal_flush();
+
+  if (ReportResidency && MemoryBudget)
+    Parser.CG.ReportResidency();
+
+  if (ReportSpeculation && Speculate)
+    Parser.CG.ReportSpeculation();
+
+  if (ReportDedup && Dedup)
+    Parser.CG.ReportDedup();
 
-  Lexer Lexer;
-  Parser Parser;
+  if (ReportStartup)
+    Parser.CG.ReportStartup();
 
-  // Prime the first token.
-  fprintf(stderr, "ready> ");
-  Lexer.getNextTok();
+  if (Opts.Profile) {
+    kal_profile_stop();
+    Parser.CG.EnsureInitialised();
+    Parser.CG.ReportProfile(Profile);
+  }
 
-  // Run the main loop.
-  Parser.MainLoop(Lexer);
+  if (Parser.CG.AOT && !Parser.CG.AOT->emit(EmitObject))
+    return 1;
 
   // Print out all the generated code.
-  Parser.CG.Module->print(llvm::errs(), nullptr);
+  if (PrintIR) {
+    Parser.CG.EnsureInitialised();
+    Parser.CG.Module->print(llvm::errs(), nullptr);
+  }
 
   return 0;
 }
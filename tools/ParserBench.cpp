@@ -0,0 +1,116 @@
+//===- ParserBench.cpp - Parser stress benchmark --------------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// Generates inputs shaped like machine-generated code at growing sizes and
+// times parsing them with recursive descent and with the iterative parser.
+// Time per term staying flat as the size grows shows linear scaling.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Lexer.h"
+#include "Parser.h"
+#include "llvm/Support/CommandLine.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static llvm::cl::list<unsigned>
+    Sizes("sizes", llvm::cl::desc("Number of terms of each generated input"),
+          llvm::cl::CommaSeparated);
+
+/// Long flat chain of mixed precedence operators.
+static std::string generateChain(unsigned N) {
+  std::string Source = "x";
+  for (unsigned i = 1; i < N; ++i)
+    Source += i % 3 ? " + x" : " * y";
+  return Source;
+}
+
+/// Deeply nested parentheses.
+static std::string generateParens(unsigned N) {
+  return std::string(N, '(') + "x" + std::string(N, ')');
+}
+
+/// Deeply nested calls.
+static std::string generateCalls(unsigned N) {
+  std::string Source;
+  for (unsigned i = 0; i < N; ++i)
+    Source += "f(x, ";
+  Source += "x";
+  Source += std::string(N, ')');
+  return Source;
+}
+
+/// Deeply nested if/then/else.
+static std::string generateIfs(unsigned N) {
+  std::string Source;
+  for (unsigned i = 0; i < N; ++i)
+    Source += "if x < y then ";
+  Source += "1";
+  for (unsigned i = 0; i < N; ++i)
+    Source += " else 0";
+  return Source;
+}
+
+/// Time parsing Source as a single expression. Returns false if the parser
+/// rejected it.
+static bool timeParse(const std::string &Source, ParserOptions Opts,
+                      double &Millis) {
+  Opts.ParseOnly = true;
+  Parser P(CodeGenOptions(), Opts);
+  P.CurLexer = Lexer(Source);
+
+  auto Start = std::chrono::steady_clock::now();
+  P.CurLexer.getNextTok();
+  auto E = P.ParseExpression();
+  Millis = std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - Start)
+               .count();
+  return E && P.CurLexer.getCurTok() == TOK_EOF;
+}
+
+int main(int argc, char **argv) {
+  llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope parser bench\n");
+  std::vector<unsigned> TermCounts(Sizes.begin(), Sizes.end());
+  if (TermCounts.empty())
+    TermCounts = {1000, 10000, 100000, 1000000};
+
+  struct Shape {
+    const char *Name;
+    std::string (*Generate)(unsigned);
+  } Shapes[] = {{"chain", generateChain},
+                {"parens", generateParens},
+                {"calls", generateCalls},
+                {"ifs", generateIfs}};
+
+  // Recursive descent keeps its default nesting limit, beyond which it would
+  // risk the stack, while the iterative parser is unbounded.
+  ParserOptions Recursive;
+  ParserOptions Iterative;
+  Iterative.Iterative = true;
+  Iterative.MaxNestingDepth = ~0u;
+
+  printf("%-8s %10s %10s %12s %10s\n", "shape", "terms", "parser", "ms",
+         "ns/term");
+  for (const Shape &S : Shapes) {
+    for (unsigned N : TermCounts) {
+      std::string Source = S.Generate(N);
+      for (const ParserOptions &Opts : {Recursive, Iterative}) {
+        const char *Mode = Opts.Iterative ? "iterative" : "recursive";
+        double Millis;
+        if (!timeParse(Source, Opts, Millis)) {
+          printf("%-8s %10u %10s %12s %10s\n", S.Name, N, Mode, "rejected",
+                 "-");
+          continue;
+        }
+        printf("%-8s %10u %10s %12.2f %10.1f\n", S.Name, N, Mode, Millis,
+               Millis * 1e6 / N);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,174 @@
+//===- RuntimeBench.cpp - Generated code benchmark ------------------------===//
+//
+// Author: Rajveer <rajveer.developer@icloud.com>
+//
+//===----------------------------------------------------------------------===//
+//
+// JITs a corpus of numeric kernels under several pipeline configurations and
+// reports the time per call along with the IR and machine code size, so that
+// codegen changes can be judged on their runtime impact.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CodeGen.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Runtime.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/TargetSelect.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+static llvm::cl::opt<double> MinTime(
+    "min-time",
+    llvm::cl::desc("Seconds each kernel is run for under each configuration"),
+    llvm::cl::init(0.5));
+
+static llvm::cl::opt<std::string>
+    KernelFilter("kernel", llvm::cl::desc("Only run the named kernel"));
+
+/// Kernel - A program and the expression that is timed.
+struct Kernel {
+  const char *Name;
+  const char *Source;
+  const char *Entry;
+};
+
+static const Kernel Kernels[] = {
+    {"fib", R"(
+def fib(n) if n < 3 then 1 else fib(n - 1) + fib(n - 2);
+)",
+     "fib(24)"},
+
+    {"mandelbrot", R"(
+extern putchard(char);
+def unary!(v) if v then 0 else 1;
+def unary-(v) 0 - v;
+def binary> 10 (LHS RHS) RHS < LHS;
+def binary| 5 (LHS RHS) if LHS then 1 else if RHS then 1 else 0;
+def binary: 1 (x y) y;
+def printdensity(d)
+  if d > 8 then putchard(32)
+  else if d > 4 then putchard(46)
+  else if d > 2 then putchard(43)
+  else putchard(42);
+def mandelconverger(real imag iters creal cimag)
+  if iters > 255 | (real * real + imag * imag > 4) then iters
+  else mandelconverger(real * real - imag * imag + creal,
+                       2 * real * imag + cimag, iters + 1, creal, cimag);
+def mandelconverge(real imag) mandelconverger(real, imag, 0, real, imag);
+def mandelhelp(xmin xmax xstep ymin ymax ystep)
+  for y = ymin, y < ymax, ystep in
+    (for x = xmin, x < xmax, xstep in
+       printdensity(mandelconverge(x, y))) : putchard(10);
+def mandel(realstart imagstart realmag imagmag)
+  mandelhelp(realstart, realstart + realmag * 78, realmag,
+             imagstart, imagstart + imagmag * 40, imagmag);
+)",
+     "mandel(0 - 2.3, 0 - 1.3, 0.05, 0.07)"},
+
+    {"integrate", R"(
+def binary: 1 (x y) y;
+def f(x) 4 / (1 + x * x);
+def integrate(a b n)
+  var sum = 0, h = (b - a) / n in
+    (for i = 0, i < n in sum = sum + f(a + (i + 0.5) * h)) : sum * h;
+)",
+     "integrate(0, 1, 100000)"},
+
+    {"polynomial", R"(
+def binary: 1 (x y) y;
+def poly(x)
+  ((((((((0.5 * x - 1.25) * x + 2) * x - 0.75) * x + 3.5) * x - 1)
+     * x + 0.25) * x - 2) * x + 1);
+def polysum(n)
+  var s = 0 in (for i = 0, i < n in s = s + poly(i / n)) : s;
+)",
+     "polysum(100000)"},
+};
+
+/// Config - A pipeline configuration kernels are compiled under.
+struct Config {
+  const char *Name;
+  unsigned OptLevel;
+  bool FastMath;
+};
+
+static const Config Configs[] = {
+    {"O0", 0, false},
+    {"O1", 1, false},
+    {"O2", 2, false},
+    {"O2-fast", 2, true},
+};
+
+/// Compile Kernel under Config and time calls to its entry expression.
+static void runKernel(const Kernel &K, const Config &C) {
+  CodeGenOptions Opts;
+  Opts.OptLevel = C.OptLevel;
+  Opts.PrintIR = false;
+  if (C.FastMath)
+    Opts.FastMath = FastMathPolicy::fast();
+
+  Parser P(Opts);
+  std::string Source = K.Source;
+  Source += "def __bench() ";
+  Source += K.Entry;
+  Source += ";\n";
+
+  P.CurLexer = Lexer(Source);
+  P.CurLexer.getNextTok();
+  P.CodegenItems(P.ParseTopLevelItems());
+
+  auto Symbol = P.CG.JIT->lookup("__bench");
+  if (!Symbol) {
+    llvm::consumeError(Symbol.takeError());
+    fprintf(stderr, "Error: %s failed to compile\n", K.Name);
+    return;
+  }
+  double (*FP)() = Symbol->getAddress().toPtr<double (*)()>();
+
+  // Warm up once, then double the number of calls until the batch takes long
+  // enough to time reliably.
+  double Result = FP();
+  unsigned long Calls = 1;
+  double Seconds = 0;
+  while (true) {
+    auto Start = std::chrono::steady_clock::now();
+    for (unsigned long I = 0; I != Calls; ++I)
+      FP();
+    Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            Start)
+                  .count();
+    if (Seconds >= MinTime)
+      break;
+    Calls *= 2;
+  }
+
+  printf("%-12s %-8s %14.1f %10llu %10llu %14g\n", K.Name, C.Name,
+         Seconds * 1e9 / Calls,
+         static_cast<unsigned long long>(P.CG.EmittedInstructions),
+         static_cast<unsigned long long>(P.CG.JIT->getCodeSize()), Result);
+}
+
+int main(int argc, char **argv) {
+  llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope runtime bench\n");
+
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+
+  // Kernels still go through the buffered output, but it is discarded rather
+  // than flooding the terminal.
+  kal_set_output(nullptr);
+
+  printf("%-12s %-8s %14s %10s %10s %14s\n", "kernel", "config", "ns/call",
+         "IR insts", "code bytes", "result");
+  for (const Kernel &K : Kernels) {
+    if (!KernelFilter.empty() && KernelFilter != K.Name)
+      continue;
+    for (const Config &C : Configs)
+      runKernel(K, C);
+  }
+  return 0;
+}
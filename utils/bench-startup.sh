@@ -0,0 +1,31 @@
+#!/bin/bash
+#
+# Time short invocations of the driver, from process start to exit, with the
+# JIT initialised up front and in the background. Each input is a handful of
+# definitions and a single expression, so startup dominates.
+#
+# Usage: utils/bench-startup.sh [runs]
+
+DRIVER=${DRIVER:-./build/bin/main-driver}
+RUNS=${1:-20}
+
+INPUT=$(mktemp)
+cat > "$INPUT" << 'EOF'
+def sq(x) x * x;
+def norm(x y) sq(x) + sq(y);
+norm(3, 4);
+EOF
+
+for FLAGS in "" "-background-init"; do
+  START=$(date +%s%N)
+  for ((i = 0; i < RUNS; i++)); do
+    "$DRIVER" $FLAGS "$INPUT" > /dev/null 2>&1
+  done
+  END=$(date +%s%N)
+
+  ELAPSED=$(((END - START) / 1000 / RUNS))
+  echo "${FLAGS:-eager}: $((ELAPSED / 1000)) ms per run"
+  "$DRIVER" $FLAGS -report-startup "$INPUT" 2>&1 > /dev/null | grep '^Startup'
+done
+
+rm -f "$INPUT"
@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Time sessions of a growing number of definitions, each calling an earlier
+# one, with a top-level expression every thousand definitions. The time per
+# definition should stay roughly constant as the count grows.
+#
+# Usage: utils/bench-symbols.sh [count...]
+#
+# To measure a change, run it once against a build from before the change
+# and once against a build from after it, and compare the time per
+# definition at each count:
+#
+#   DRIVER=build-before/bin/main-driver utils/bench-symbols.sh
+#   DRIVER=build-after/bin/main-driver utils/bench-symbols.sh
+
+DRIVER=${DRIVER:-./build/bin/main-driver}
+COUNTS=${@:-1000 10000 100000}
+
+for N in $COUNTS; do
+  INPUT=$(mktemp)
+  {
+    echo "def f0(x) x;"
+    for ((i = 1; i < N; i++)); do
+      echo "def f$i(x) f$((i / 2))(x) + 1;"
+      if ((i % 1000 == 0)); then
+        echo "f$i(1);"
+      fi
+    done
+  } > "$INPUT"
+
+  START=$(date +%s%N)
+  "$DRIVER" -print-ir=false "$INPUT" > /dev/null 2>&1
+  END=$(date +%s%N)
+  rm -f "$INPUT"
+
+  ELAPSED=$(((END - START) / 1000))
+  echo "$N definitions: $((ELAPSED / 1000)) ms, $((ELAPSED / N)) us per definition"
+done
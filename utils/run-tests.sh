@@ -0,0 +1,54 @@
+#!/bin/bash
+#
+# Run the regression inputs in test/ through the driver. Each test is either
+# an input file NAME.k or a script NAME.gen that prints its input, which is
+# how very large inputs are kept out of the tree. Every "# RUN: <flags>" line
+# of a test runs the driver once with those flags, or once without flags if
+# there are none. The output of each run, without the IR and the prompts,
+# must match NAME.expected. JIT'd code prints to stderr, as does the driver.
+# Runs with -mlir are skipped unless the driver was built with MLIR.
+#
+# Usage: utils/run-tests.sh [test...]
+
+DRIVER=${DRIVER:-./build/bin/main-driver}
+TESTDIR=$(dirname "$0")/../test
+
+if [[ $# -eq 0 ]]; then
+  set -- "$TESTDIR"/*.k "$TESTDIR"/*.gen
+fi
+
+INPUT=$(mktemp)
+ACTUAL=$(mktemp)
+FAILED=0
+HAVE_MLIR=1
+"$DRIVER" -mlir /dev/null > /dev/null 2>&1 || HAVE_MLIR=0
+for TEST in "$@"; do
+  [[ -e "$TEST" ]] || continue
+  NAME=${TEST%.*}
+  if [[ "$TEST" == *.gen ]]; then
+    bash "$TEST" > "$INPUT"
+  else
+    cp "$TEST" "$INPUT"
+  fi
+
+  RUNS=$(sed -n 's/^# RUN:\s*//p' "$TEST")
+  [[ -n "$RUNS" ]] || RUNS=" "
+  while IFS= read -r FLAGS; do
+    if [[ $HAVE_MLIR -eq 0 && " $FLAGS " == *" -mlir "* ]]; then
+      echo "SKIP: $(basename "$TEST") ${FLAGS}"
+      continue
+    fi
+    "$DRIVER" -print-ir=false $FLAGS "$INPUT" > "$ACTUAL" 2> "$ACTUAL.err"
+    STATUS=$?
+    sed -e 's/ready> //g' -e '/^$/d' "$ACTUAL.err" >> "$ACTUAL"
+    if [[ $STATUS -ne 0 ]] || ! diff -u "$NAME.expected" "$ACTUAL"; then
+      echo "FAIL: $(basename "$TEST") ${FLAGS} (exit status $STATUS)"
+      FAILED=$((FAILED + 1))
+    else
+      echo "PASS: $(basename "$TEST") ${FLAGS}"
+    fi
+  done <<< "$RUNS"
+done
+
+rm -f "$INPUT" "$ACTUAL" "$ACTUAL.err"
+[[ $FAILED -eq 0 ]]